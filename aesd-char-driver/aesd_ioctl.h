@@ -38,9 +38,12 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Pin a snapshot of the buffer on this file handle when arg is non-zero, or
+// return to reading the live buffer when arg is 0.  Either way f_pos resets to 0.
+#define AESDCHAR_IOCSNAPSHOT _IO(AESD_IOC_MAGIC, 2)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 2
 
 #endif /* AESD_IOCTL_H */
@@ -14,6 +14,9 @@
 # ifdef __KERNEL__
    /* This one if debugging is on, and kernel space */
 #  define PDEBUG(fmt, args...) printk(KERN_DEBUG "aesdchar: " fmt, ## args)
+# elif defined(AESD_EMUL)
+   /* The driver built for aesdchar_bench, where stderr is the report */
+#  define PDEBUG(fmt, args...) do { } while (0)
 # else
    /* This one for user space */
 #  define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
@@ -24,6 +27,62 @@
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * Number of decompressed entries kept around for sequential readers
+ */
+#define AESD_DECOMP_CACHE_SLOTS 2
+
+/**
+ * Backing allocation for a circular buffer entry.  The entry's buffptr points
+ * at data[], so the header is recovered with aesd_entry_blob().  The entry's
+ * size always holds the uncompressed length, which keeps fpos arithmetic in
+ * aesd-circular-buffer.c unaware of compression.
+ */
+struct aesd_blob
+{
+    size_t size;                               /* Uncompressed length */
+    size_t stored_size;                        /* Bytes held in data[] */
+    bool compressed;                           /* data[] holds an LZ4 block */
+    bool compress_tried;                       /* Queued for compression once, under aesd_dev.lock */
+    u64 seq;                                   /* Commit order, assigned under aesd_dev.lock */
+    struct kref ref;                           /* Held by the buffer, snapshots and cache slots */
+    struct list_head stage_node;               /* Link in an aesd_stage before commit, then in a compression queue */
+    struct aesd_write_ticket *ticket;          /* Write that staged it, until published */
+    char data[];
+};
+
+/**
+ * Outcome of one aesd_write, on the writer's stack.  The publisher counts
+ * pending down as it publishes the write's commands, and never touches the
+ * ticket after the last one, when the writer may return.
+ */
+struct aesd_write_ticket
+{
+    int status;                                /* -ENOMEM if a command could not be published */
+    int pending;                               /* Commands not published yet, released at 0 */
+};
+
+/**
+ * Per-CPU list of commands split by aesd_write and waiting to be committed
+ * to the circular buffer.  Writers only take this CPU's lock while staging,
+ * the short aesd_dev.lock section then publishes every CPU's list at once.
+ */
+struct aesd_stage
+{
+    spinlock_t lock;
+    struct list_head cmds;
+};
+
+/**
+ * A decompressed copy of a compressed blob, holding a reference to the blob
+ */
+struct aesd_decomp_slot
+{
+    struct aesd_blob *blob;
+    char *buf;
+    unsigned long last_used;
+};
+
 struct aesd_dev
 {
     /**
@@ -32,6 +91,36 @@ struct aesd_dev
     struct cdev cdev;                          /* Char device structure */
     struct aesd_circular_buffer circ_buf;      /* Circular buffer for writes */
     struct mutex lock;                         /* Mutex to protect circular buffer */
+    void *lz4_wrkmem;                          /* LZ4 compression state, NULL when disabled */
+    struct mutex compress_lock;                /* Protects lz4_wrkmem, taken without lock */
+    struct mutex cache_lock;                   /* Protects decomp_cache, nests inside lock */
+    struct aesd_decomp_slot decomp_cache[AESD_DECOMP_CACHE_SLOTS];
+    unsigned long decomp_clock;                /* LRU clock for decomp_cache */
+    struct aesd_stage __percpu *stage;         /* Commands staged by aesd_write */
+    u64 commit_seq;                            /* Last seq assigned, protected by lock */
+    atomic_t publishing;                       /* A writer is draining the stages */
+    wait_queue_head_t publish_wq;              /* Woken when a drain ends */
+};
+
+/**
+ * A frozen copy of the circular buffer taken by AESDCHAR_IOCSNAPSHOT.  Each
+ * entry holds a reference to its blob, so readers stream a consistent image
+ * without aesd_dev.lock while writers keep evicting from the live buffer.
+ */
+struct aesd_snapshot
+{
+    struct kref ref;
+    struct aesd_circular_buffer circ_buf;
+};
+
+/**
+ * Per-open state, stored in filp->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    spinlock_t snap_lock;                      /* Protects snap */
+    struct aesd_snapshot *snap;                /* Pinned image, NULL for live reads */
 };
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
\ No newline at end of file
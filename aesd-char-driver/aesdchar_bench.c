@@ -0,0 +1,443 @@
+/*
+ * aesdchar_bench.c
+ *
+ * Load generator for the aesdchar file operations.  Writer threads append
+ * commands of random size, some left without a newline and some split over
+ * several write calls; reader threads mix reads from the start of the
+ * buffer to its end with llseek(SEEK_END) and AESDCHAR_IOCSEEKTO.  Every
+ * call is timed and the report gives ops/s, MB/s and latency percentiles
+ * for each kind of call.
+ *
+ * The target is /dev/aesdchar, or with -e the driver's own main.c built
+ * against aesdchar_emul.h, so the same load runs where no module can be
+ * loaded.  Build with "make bench".
+ */
+#include "aesdchar_emul.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+
+/* Log-linear latency buckets: 16 per power of two of nanoseconds */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum bench_op { OP_WRITE, OP_READ, OP_SEEK_END, OP_SEEKTO, OP_COUNT };
+
+static const char *const op_names[OP_COUNT] = { "write", "read", "seek_end", "seekto" };
+
+struct op_stats {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t max_ns;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+struct bench_config {
+    const char *device;
+    int emulate;
+    int writers;
+    int readers;
+    double seconds;
+    size_t write_min;
+    size_t write_max;
+    unsigned int newline_pct;   /* writes ending a command */
+    unsigned int max_pieces;    /* calls a write is split over */
+    unsigned int seek_end_pct;  /* reader calls that are llseek(SEEK_END) */
+    unsigned int seekto_pct;    /* reader calls that are AESDCHAR_IOCSEEKTO */
+    size_t read_size;
+};
+
+struct bench_thread {
+    pthread_t thread;
+    const struct bench_config *config;
+    int reader;
+    uint64_t seed;
+    struct op_stats stats[OP_COUNT];
+};
+
+/* An open file on the device or the emulated driver */
+struct bench_handle {
+    int fd;
+    struct file filp;
+};
+
+static int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *seed)
+{
+    /* xorshift64* */
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+    int shift;
+
+    if (ns < HIST_SUB)
+        return ns;
+    shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((ns >> shift) & (HIST_SUB - 1));
+}
+
+/* The smallest latency that falls in bucket b */
+static uint64_t hist_value(unsigned int b)
+{
+    if (b < HIST_SUB)
+        return b;
+    return (uint64_t)(HIST_SUB + b % HIST_SUB) << (b / HIST_SUB - 1);
+}
+
+static void record(struct op_stats *s, uint64_t start, ssize_t result)
+{
+    uint64_t ns = now_ns() - start;
+
+    s->ops++;
+    s->hist[hist_bucket(ns)]++;
+    if (ns > s->max_ns)
+        s->max_ns = ns;
+    if (result < 0)
+        s->errors++;
+    else
+        s->bytes += result;
+}
+
+/* Emulated calls return -errno where the system calls set errno */
+static long emul_result(long ret)
+{
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+static int handle_open(const struct bench_config *config, struct bench_handle *h)
+{
+    if (config->emulate) {
+        h->filp.f_pos = 0;
+        return emul_result(aesd_open(NULL, &h->filp));
+    }
+    h->fd = open(config->device, O_RDWR);
+    return h->fd == -1 ? -1 : 0;
+}
+
+static void handle_close(const struct bench_config *config, struct bench_handle *h)
+{
+    if (config->emulate)
+        aesd_release(NULL, &h->filp);
+    else
+        close(h->fd);
+}
+
+static ssize_t handle_write(const struct bench_config *config, struct bench_handle *h,
+                            const char *buf, size_t len)
+{
+    if (config->emulate)
+        return emul_result(aesd_write(&h->filp, buf, len, &h->filp.f_pos));
+    return write(h->fd, buf, len);
+}
+
+static ssize_t handle_read(const struct bench_config *config, struct bench_handle *h,
+                           char *buf, size_t len)
+{
+    if (config->emulate)
+        return emul_result(aesd_read(&h->filp, buf, len, &h->filp.f_pos));
+    return read(h->fd, buf, len);
+}
+
+static off_t handle_lseek(const struct bench_config *config, struct bench_handle *h,
+                          off_t off, int whence)
+{
+    if (config->emulate)
+        return emul_result(aesd_llseek(&h->filp, off, whence));
+    return lseek(h->fd, off, whence);
+}
+
+static int handle_seekto(const struct bench_config *config, struct bench_handle *h,
+                         struct aesd_seekto *seekto)
+{
+    if (config->emulate)
+        return emul_result(aesd_unlocked_ioctl(&h->filp, AESDCHAR_IOCSEEKTO, (unsigned long)seekto));
+    return ioctl(h->fd, AESDCHAR_IOCSEEKTO, seekto);
+}
+
+/* One command of random size, split at random points over up to max_pieces writes */
+static void write_command(struct bench_thread *t, struct bench_handle *h, char *buf)
+{
+    const struct bench_config *config = t->config;
+    size_t size = config->write_min;
+    size_t done = 0;
+    size_t piece;
+    unsigned int pieces;
+    uint64_t start;
+    ssize_t n;
+
+    if (config->write_max > config->write_min)
+        size += next_random(&t->seed) % (config->write_max - config->write_min + 1);
+    memset(buf, 'a' + next_random(&t->seed) % 26, size);
+    if (next_random(&t->seed) % 100 < config->newline_pct)
+        buf[size - 1] = '\n';
+
+    pieces = 1 + next_random(&t->seed) % config->max_pieces;
+    while (done < size) {
+        piece = size - done;
+        if (--pieces > 0 && piece > 1)
+            piece = 1 + next_random(&t->seed) % (piece - 1);
+        start = now_ns();
+        n = handle_write(config, h, buf + done, piece);
+        record(&t->stats[OP_WRITE], start, n);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+}
+
+static void reader_step(struct bench_thread *t, struct bench_handle *h, char *buf)
+{
+    const struct bench_config *config = t->config;
+    unsigned int pick = next_random(&t->seed) % 100;
+    struct aesd_seekto seekto;
+    uint64_t start;
+    ssize_t n;
+
+    if (pick < config->seek_end_pct) {
+        start = now_ns();
+        n = handle_lseek(config, h, 0, SEEK_END);
+        record(&t->stats[OP_SEEK_END], start, n < 0 ? -1 : 0);
+    } else if (pick < config->seek_end_pct + config->seekto_pct) {
+        seekto.write_cmd = next_random(&t->seed) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        seekto.write_cmd_offset = 0;
+        start = now_ns();
+        n = handle_seekto(config, h, &seekto);
+        /* Fewer commands than asked for is expected while the buffer fills */
+        record(&t->stats[OP_SEEKTO], start, n < 0 && errno != EINVAL ? -1 : 0);
+    } else {
+        start = now_ns();
+        n = handle_read(config, h, buf, config->read_size);
+        record(&t->stats[OP_READ], start, n);
+        if (n == 0)
+            handle_lseek(config, h, 0, SEEK_SET);
+    }
+}
+
+static void *bench_thread_func(void *arg)
+{
+    struct bench_thread *t = arg;
+    const struct bench_config *config = t->config;
+    struct bench_handle h;
+    char *buf;
+
+    buf = malloc(t->reader ? config->read_size : config->write_max);
+    if (!buf || handle_open(config, &h) == -1) {
+        perror("open");
+        free(buf);
+        t->stats[t->reader ? OP_READ : OP_WRITE].errors++;
+        return NULL;
+    }
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        if (t->reader)
+            reader_step(t, &h, buf);
+        else
+            write_command(t, &h, buf);
+    }
+    handle_close(config, &h);
+    free(buf);
+    return NULL;
+}
+
+static void merge(struct op_stats *into, const struct op_stats *from)
+{
+    unsigned int b;
+
+    into->ops += from->ops;
+    into->bytes += from->bytes;
+    into->errors += from->errors;
+    if (from->max_ns > into->max_ns)
+        into->max_ns = from->max_ns;
+    for (b = 0; b < HIST_BUCKETS; b++)
+        into->hist[b] += from->hist[b];
+}
+
+static double percentile_us(const struct op_stats *s, double p)
+{
+    uint64_t rank = (uint64_t)(s->ops * p / 100.0);
+    uint64_t seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += s->hist[b];
+        if (seen > rank)
+            return hist_value(b) / 1000.0;
+    }
+    return s->max_ns / 1000.0;
+}
+
+static void report(const struct bench_config *config, const struct op_stats *total, double elapsed)
+{
+    int op;
+
+    printf("%s, %d writers, %d readers, %.1f s\n",
+           config->emulate ? "emulated driver" : config->device,
+           config->writers, config->readers, elapsed);
+    printf("%-9s %10s %11s %9s %9s %9s %9s %9s %9s %8s\n", "op", "ops", "ops/s", "MB/s",
+           "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "errors");
+    for (op = 0; op < OP_COUNT; op++) {
+        const struct op_stats *s = &total[op];
+
+        if (s->ops == 0)
+            continue;
+        printf("%-9s %10llu %11.0f %9.1f %9.2f %9.2f %9.2f %9.2f %9.2f %8llu\n", op_names[op],
+               (unsigned long long)s->ops, s->ops / elapsed, s->bytes / elapsed / 1e6,
+               percentile_us(s, 50), percentile_us(s, 90), percentile_us(s, 99),
+               percentile_us(s, 99.9), s->max_ns / 1000.0, (unsigned long long)s->errors);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d device | -e] [-t writers] [-r readers] [-s seconds]\n"
+            "          [-w bytes | -w min-max] [-n newline_pct] [-k max_pieces]\n"
+            "          [-L seek_end_pct] [-I seekto_pct] [-b read_bytes]\n"
+            "  -e  run against the driver built into this program instead of a device\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config config = {
+        .device = "/dev/aesdchar",
+        .writers = 4,
+        .readers = 2,
+        .seconds = 5,
+        .write_min = 64,
+        .write_max = 64,
+        .newline_pct = 100,
+        .max_pieces = 1,
+        .seek_end_pct = 10,
+        .seekto_pct = 10,
+        .read_size = 4096,
+    };
+    struct op_stats total[OP_COUNT];
+    struct bench_thread *threads;
+    struct timespec run;
+    uint64_t start;
+    double elapsed;
+    char *end;
+    int nthreads;
+    int opt;
+    int i;
+    int op;
+
+    while ((opt = getopt(argc, argv, "d:et:r:s:w:n:k:L:I:b:")) != -1) {
+        switch (opt) {
+        case 'd':
+            config.device = optarg;
+            break;
+        case 'e':
+            config.emulate = 1;
+            break;
+        case 't':
+            config.writers = atoi(optarg);
+            break;
+        case 'r':
+            config.readers = atoi(optarg);
+            break;
+        case 's':
+            config.seconds = atof(optarg);
+            break;
+        case 'w':
+            config.write_min = strtoul(optarg, &end, 10);
+            config.write_max = *end == '-' ? strtoul(end + 1, &end, 10) : config.write_min;
+            if (*end != '\0') {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            config.newline_pct = atoi(optarg);
+            break;
+        case 'k':
+            config.max_pieces = atoi(optarg);
+            break;
+        case 'L':
+            config.seek_end_pct = atoi(optarg);
+            break;
+        case 'I':
+            config.seekto_pct = atoi(optarg);
+            break;
+        case 'b':
+            config.read_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    nthreads = config.writers + config.readers;
+    if (config.writers < 0 || config.readers < 0 || nthreads == 0 || config.seconds <= 0 ||
+        config.write_min == 0 || config.write_max < config.write_min || config.max_pieces == 0 ||
+        config.newline_pct > 100 || config.seek_end_pct + config.seekto_pct > 100 ||
+        config.read_size == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (config.emulate && aesd_init_module() != 0) {
+        fprintf(stderr, "Emulated driver failed to initialise\n");
+        return 1;
+    }
+
+    threads = calloc(nthreads, sizeof(*threads));
+    if (!threads) {
+        perror("calloc");
+        return 1;
+    }
+    start = now_ns();
+    for (i = 0; i < nthreads; i++) {
+        threads[i].config = &config;
+        threads[i].reader = i >= config.writers;
+        threads[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if (pthread_create(&threads[i].thread, NULL, bench_thread_func, &threads[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    run.tv_sec = (time_t)config.seconds;
+    run.tv_nsec = (long)((config.seconds - run.tv_sec) * 1e9);
+    while (nanosleep(&run, &run) == -1 && errno == EINTR)
+        ;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        for (op = 0; op < OP_COUNT; op++)
+            merge(&total[op], &threads[i].stats[op]);
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    report(&config, total, elapsed);
+    free(threads);
+    if (config.emulate)
+        aesd_cleanup_module();
+    return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * aesdchar_emul.h
+ *
+ * The kernel interfaces main.c uses, rebuilt on libc and pthreads so the
+ * driver's file operations run unmodified in a userspace process.
+ * aesdchar_bench links against this build when no module is loaded.
+ *
+ * Locking keeps its shape: dev->lock is a pthread mutex and the per-CPU
+ * stages are indexed by the CPU the calling thread is running on.  LZ4 is
+ * not available, so compress_keep leaves every entry as it is.
+ */
+#ifndef AESDCHAR_EMUL_H
+#define AESDCHAR_EMUL_H
+
+#define AESD_EMUL 1
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* sched_getcpu */
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+typedef uint64_t u64;
+
+#define __user
+#define __percpu
+
+#define KERN_ERR "<3>"
+#define KERN_WARNING "<4>"
+#define printk(fmt, args...) fprintf(stderr, fmt, ## args)
+
+#define THIS_MODULE NULL
+#define S_IRUGO 0444
+#define MODULE_AUTHOR(name)
+#define MODULE_LICENSE(license)
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm)
+#define module_init(fn)
+#define module_exit(fn)
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+/* Memory */
+#define GFP_KERNEL 0
+#define kmalloc(size, flags) malloc(size)
+#define kfree(ptr) free(ptr)
+#define vmalloc(size) malloc(size)
+#define vfree(ptr) free(ptr)
+
+static inline unsigned long copy_to_user(void *to, const void *from, size_t n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void *from, size_t n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+/* Locks */
+struct mutex {
+    pthread_mutex_t m;
+};
+
+#define mutex_init(lock) pthread_mutex_init(&(lock)->m, NULL)
+#define mutex_lock(lock) pthread_mutex_lock(&(lock)->m)
+#define mutex_unlock(lock) pthread_mutex_unlock(&(lock)->m)
+
+typedef pthread_spinlock_t spinlock_t;
+
+#define spin_lock_init(lock) pthread_spin_init(lock, PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(lock) pthread_spin_lock(lock)
+#define spin_unlock(lock) pthread_spin_unlock(lock)
+
+/* Atomics and wait queues, enough for one publisher at a time */
+typedef struct {
+    int counter;
+} atomic_t;
+
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_xchg(v, i) __atomic_exchange_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+typedef struct {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    int sleepers;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq)                                                 \
+    do {                                                                        \
+        pthread_mutex_init(&(wq)->m, NULL);                                     \
+        pthread_cond_init(&(wq)->c, NULL);                                      \
+        (wq)->sleepers = 0;                                                     \
+    } while (0)
+#define wait_event(wq, condition)                                               \
+    do {                                                                        \
+        pthread_mutex_lock(&(wq).m);                                            \
+        __atomic_add_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST);                \
+        while (!(condition))                                                    \
+            pthread_cond_wait(&(wq).c, &(wq).m);                                \
+        __atomic_sub_fetch(&(wq).sleepers, 1, __ATOMIC_SEQ_CST);                \
+        pthread_mutex_unlock(&(wq).m);                                          \
+    } while (0)
+/* Like the kernel's, cheap when nobody sleeps */
+#define wake_up_all(wq)                                                         \
+    do {                                                                        \
+        if (__atomic_load_n(&(wq)->sleepers, __ATOMIC_SEQ_CST)) {               \
+            pthread_mutex_lock(&(wq)->m);                                       \
+            pthread_cond_broadcast(&(wq)->c);                                   \
+            pthread_mutex_unlock(&(wq)->m);                                     \
+        }                                                                       \
+    } while (0)
+
+/* Reference counts */
+struct kref {
+    int refcount;
+};
+
+static inline void kref_init(struct kref *kref)
+{
+    kref->refcount = 1;
+}
+
+static inline void kref_get(struct kref *kref)
+{
+    __atomic_add_fetch(&kref->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline int kref_put(struct kref *kref, void (*release)(struct kref *kref))
+{
+    if (__atomic_sub_fetch(&kref->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        release(kref);
+        return 1;
+    }
+    return 0;
+}
+
+/* Doubly linked lists, as in <linux/list.h> */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+static inline void list_splice_tail_init(struct list_head *list, struct list_head *head)
+{
+    if (!list_empty(list)) {
+        list->next->prev = head->prev;
+        head->prev->next = list->next;
+        list->prev->next = head;
+        head->prev = list->prev;
+        INIT_LIST_HEAD(list);
+    }
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_for_each_entry_safe(pos, n, head, member)                          \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member),             \
+         n = list_entry(pos->member.next, __typeof__(*pos), member);           \
+         &pos->member != (head);                                               \
+         pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+/* Per-CPU data, one slot per configured CPU */
+static inline int aesd_emul_cpus(void)
+{
+    static int cpus;
+
+    if (!cpus) {
+        long n = sysconf(_SC_NPROCESSORS_CONF);
+        cpus = n > 0 ? n : 1;
+    }
+    return cpus;
+}
+
+static inline int aesd_emul_this_cpu(void)
+{
+    int cpu = sched_getcpu();
+
+    return cpu >= 0 ? cpu % aesd_emul_cpus() : 0;
+}
+
+#define alloc_percpu(type) ((type *)calloc(aesd_emul_cpus(), sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) (&(ptr)[cpu])
+#define get_cpu_ptr(ptr) (&(ptr)[aesd_emul_this_cpu()])
+#define put_cpu_ptr(ptr) ((void)(ptr))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < aesd_emul_cpus(); (cpu)++)
+
+/* LZ4, which never shrinks anything here; the stubs stand in for CONFIG_LZ4_* */
+#define IS_ENABLED(option) 1
+#define LZ4_MAX_INPUT_SIZE 0x7E000000
+#define LZ4_MEM_COMPRESS 16384
+#define LZ4_compressBound(size) ((size) + (size) / 255 + 16)
+#define LZ4_compress_default(src, dst, len, bound, wrkmem) 0
+#define LZ4_decompress_safe(src, dst, len, max) (-1)
+
+/* Character device registration */
+#define MKDEV(major, minor) (((major) << 20) | (minor))
+#define MAJOR(dev) ((dev) >> 20)
+
+struct inode;
+
+struct file {
+    loff_t f_pos;
+    void *private_data;
+};
+
+struct file_operations {
+    void *owner;
+    ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+    ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+    int (*open)(struct inode *, struct file *);
+    int (*release)(struct inode *, struct file *);
+    loff_t (*llseek)(struct file *, loff_t, int);
+    long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+};
+
+struct cdev {
+    void *owner;
+    const struct file_operations *ops;
+};
+
+#define cdev_init(cdev, fops) ((cdev)->ops = (fops))
+#define cdev_del(cdev) ((void)(cdev))
+
+static inline int cdev_add(struct cdev *cdev, dev_t devno, unsigned int count)
+{
+    return 0;
+}
+
+#define alloc_chrdev_region(dev, minor, count, name) (*(dev) = MKDEV(1, minor), 0)
+#define unregister_chrdev_region(dev, count) ((void)(dev))
+
+/* The aesdchar tracepoints compile away */
+#define trace_aesd_read_enter(count, pos) do { } while (0)
+#define trace_aesd_read_exit(ret) do { } while (0)
+#define trace_aesd_write_enter(count, pos) do { } while (0)
+#define trace_aesd_write_locked(count) do { } while (0)
+#define trace_aesd_write_exit(ret) do { } while (0)
+#define trace_aesd_ring_insert(seq, size, merged) do { } while (0)
+#define trace_aesd_llseek(off, whence, ret) do { } while (0)
+#define trace_aesd_ioctl(cmd, arg, ret) do { } while (0)
+
+/* The driver's entry points, for the harness */
+int aesd_init_module(void);
+void aesd_cleanup_module(void);
+int aesd_open(struct inode *inode, struct file *filp);
+int aesd_release(struct inode *inode, struct file *filp);
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+loff_t aesd_llseek(struct file *filp, loff_t off, int whence);
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+#endif /* AESDCHAR_EMUL_H */
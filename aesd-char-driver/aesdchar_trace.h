@@ -0,0 +1,132 @@
+/*
+ * aesdchar_trace.h
+ *
+ * Tracepoints on the aesdchar file operations, enabled under
+ * /sys/kernel/tracing/events/aesdchar or attached to as tracepoint:aesdchar:*.
+ * A write is traced on entry, once it holds dev->lock, for each command it
+ * puts in the ring and on return, so the time spent splitting, waiting for
+ * the lock and publishing can be told apart.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesd_io_enter,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+    ),
+    TP_printk("count=%zu pos=%lld", __entry->count, __entry->pos)
+);
+
+DEFINE_EVENT(aesd_io_enter, aesd_read_enter,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos)
+);
+
+DEFINE_EVENT(aesd_io_enter, aesd_write_enter,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos)
+);
+
+DECLARE_EVENT_CLASS(aesd_io_exit,
+    TP_PROTO(ssize_t ret),
+    TP_ARGS(ret),
+    TP_STRUCT__entry(
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->ret = ret;
+    ),
+    TP_printk("ret=%zd", __entry->ret)
+);
+
+DEFINE_EVENT(aesd_io_exit, aesd_read_exit,
+    TP_PROTO(ssize_t ret),
+    TP_ARGS(ret)
+);
+
+DEFINE_EVENT(aesd_io_exit, aesd_write_exit,
+    TP_PROTO(ssize_t ret),
+    TP_ARGS(ret)
+);
+
+TRACE_EVENT(aesd_write_locked,
+    TP_PROTO(size_t count),
+    TP_ARGS(count),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+    ),
+    TP_printk("count=%zu", __entry->count)
+);
+
+TRACE_EVENT(aesd_ring_insert,
+    TP_PROTO(u64 seq, size_t size, bool merged),
+    TP_ARGS(seq, size, merged),
+    TP_STRUCT__entry(
+        __field(u64, seq)
+        __field(size_t, size)
+        __field(bool, merged)
+    ),
+    TP_fast_assign(
+        __entry->seq = seq;
+        __entry->size = size;
+        __entry->merged = merged;
+    ),
+    TP_printk("seq=%llu size=%zu merged=%d",
+              (unsigned long long)__entry->seq, __entry->size, __entry->merged)
+);
+
+TRACE_EVENT(aesd_llseek,
+    TP_PROTO(loff_t off, int whence, loff_t ret),
+    TP_ARGS(off, whence, ret),
+    TP_STRUCT__entry(
+        __field(loff_t, off)
+        __field(int, whence)
+        __field(loff_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->off = off;
+        __entry->whence = whence;
+        __entry->ret = ret;
+    ),
+    TP_printk("off=%lld whence=%d ret=%lld", __entry->off, __entry->whence, __entry->ret)
+);
+
+TRACE_EVENT(aesd_ioctl,
+    TP_PROTO(unsigned int cmd, unsigned long arg, long ret),
+    TP_ARGS(cmd, arg, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(unsigned long, arg)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->arg = arg;
+        __entry->ret = ret;
+    ),
+    TP_printk("cmd=%#x arg=%#lx ret=%ld", __entry->cmd, __entry->arg, __entry->ret)
+);
+
+#endif /* _AESDCHAR_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
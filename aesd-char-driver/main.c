@@ -1,8 +1,14 @@
 /**
  * @file main.c
  * @brief AESD char driver implementation (C90 compliant) with llseek and ioctl support
+ *
+ * Load with compress_keep=N to LZ4 compress all but the newest N entries,
+ * on kernels built with CONFIG_LZ4_COMPRESS and CONFIG_LZ4_DECOMPRESS.
+ * AESDCHAR_IOCSNAPSHOT pins a read-only image of the buffer on a file handle.
+ * The file operations report to the aesdchar tracepoints in aesdchar_trace.h.
  */
 
+#ifdef __KERNEL__
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/printk.h>
@@ -13,11 +19,33 @@
 #include <linux/kernel.h>   /* min() macro */
 #include <linux/mutex.h>    /* mutex */
 #include <linux/uaccess.h>  /* copy_to_user, copy_from_user */
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>  /* vmalloc, vfree */
+#include <linux/lz4.h>      /* LZ4_compress_default, LZ4_decompress_safe */
+#include <linux/list.h>
+#include <linux/percpu.h>   /* alloc_percpu, per_cpu_ptr */
+#include <linux/spinlock.h>
+#include <linux/kref.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#else
+#include "aesdchar_emul.h"  /* built into aesdchar_bench as a userspace harness */
+#endif
 
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
 #include "aesd_ioctl.h"
 
+#ifdef __KERNEL__
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+#endif
+
+/* Without LZ4 in the kernel the module loads without it and ignores compress_keep */
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#define AESD_HAVE_LZ4 1
+#endif
+
 int aesd_major = 0;  /* dynamic major */
 int aesd_minor = 0;
 
@@ -26,6 +54,11 @@ MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
+/* Number of newest entries kept uncompressed, 0 disables compression */
+static unsigned int compress_keep = 0;
+module_param(compress_keep, uint, S_IRUGO);
+MODULE_PARM_DESC(compress_keep, "LZ4 compress entries older than the newest N (0 = off)");
+
 /* Define MUTEX_LOCK and MUTEX_UNLOCK macros if not already defined */
 #ifndef MUTEX_LOCK
 #define MUTEX_LOCK(lock) mutex_lock(lock)
@@ -35,6 +68,234 @@ struct aesd_dev aesd_device;
 #define MUTEX_UNLOCK(lock) mutex_unlock(lock)
 #endif
 
+/* Recover the blob header from a circular buffer entry */
+static inline struct aesd_blob *aesd_entry_blob(const struct aesd_buffer_entry *entry)
+{
+    return container_of((char *)entry->buffptr, struct aesd_blob, data[0]);
+}
+
+/* Allocate an uncompressed blob able to hold size bytes */
+static struct aesd_blob *aesd_blob_alloc(size_t size)
+{
+    struct aesd_blob *blob;
+
+    blob = kmalloc(sizeof(*blob) + size, GFP_KERNEL);
+    if (!blob)
+        return NULL;
+    blob->size = size;
+    blob->stored_size = size;
+    blob->compressed = false;
+    blob->compress_tried = false;
+    blob->seq = 0;
+    blob->ticket = NULL;
+    kref_init(&blob->ref);
+    return blob;
+}
+
+static void aesd_blob_release(struct kref *ref)
+{
+    kfree(container_of(ref, struct aesd_blob, ref));
+}
+
+/* Drop a reference to a blob, freeing it once no buffer, snapshot or cache slot uses it */
+static void aesd_blob_put(struct aesd_blob *blob)
+{
+    kref_put(&blob->ref, aesd_blob_release);
+}
+
+#ifdef AESD_HAVE_LZ4
+static int aesd_lz4_compress(struct aesd_dev *dev, const char *src, char *dst, int len, int bound)
+{
+    return LZ4_compress_default(src, dst, len, bound, dev->lz4_wrkmem);
+}
+
+static int aesd_lz4_decompress(const char *src, char *dst, int len, int max)
+{
+    return LZ4_decompress_safe(src, dst, len, max);
+}
+#else
+static int aesd_lz4_compress(struct aesd_dev *dev, const char *src, char *dst, int len, int bound)
+{
+    return 0;
+}
+
+static int aesd_lz4_decompress(const char *src, char *dst, int len, int max)
+{
+    return -1;
+}
+#endif
+
+/*
+ * Copy count bytes starting offset bytes into entry to user space.  Compressed
+ * entries are decompressed into the least recently used cache slot, so a
+ * reader walking the buffer in order decompresses each entry once.  The
+ * caller keeps the entry's blob alive, either by holding dev->lock or through
+ * a snapshot reference.
+ */
+static int aesd_copy_entry_to_user(struct aesd_dev *dev, struct aesd_buffer_entry *entry,
+                                   size_t offset, char __user *ubuf, size_t count)
+{
+    struct aesd_blob *blob = aesd_entry_blob(entry);
+    struct aesd_decomp_slot *slot = NULL;
+    char *buf;
+    int retval = 0;
+    int i;
+
+    if (!blob->compressed)
+        return copy_to_user(ubuf, entry->buffptr + offset, count) ? -EFAULT : 0;
+
+    MUTEX_LOCK(&dev->cache_lock);
+
+    for (i = 0; i < AESD_DECOMP_CACHE_SLOTS; i++) {
+        if (dev->decomp_cache[i].blob == blob) {
+            slot = &dev->decomp_cache[i];
+            break;
+        }
+    }
+
+    if (!slot) {
+        slot = &dev->decomp_cache[0];
+        for (i = 1; i < AESD_DECOMP_CACHE_SLOTS; i++) {
+            if (dev->decomp_cache[i].last_used < slot->last_used)
+                slot = &dev->decomp_cache[i];
+        }
+
+        buf = kmalloc(blob->size, GFP_KERNEL);
+        if (!buf) {
+            MUTEX_UNLOCK(&dev->cache_lock);
+            return -ENOMEM;
+        }
+        if (aesd_lz4_decompress(blob->data, buf, blob->stored_size, blob->size) != (int)blob->size) {
+            printk(KERN_ERR "aesdchar: corrupt compressed entry\n");
+            kfree(buf);
+            MUTEX_UNLOCK(&dev->cache_lock);
+            return -EIO;
+        }
+
+        /* The slot holds its own reference so it can never outlive the blob */
+        kfree(slot->buf);
+        if (slot->blob)
+            aesd_blob_put(slot->blob);
+        kref_get(&blob->ref);
+        slot->blob = blob;
+        slot->buf = buf;
+    }
+
+    slot->last_used = ++dev->decomp_clock;
+    if (copy_to_user(ubuf, slot->buf + offset, count))
+        retval = -EFAULT;
+
+    MUTEX_UNLOCK(&dev->cache_lock);
+    return retval;
+}
+
+/*
+ * An LZ4 compressed copy of blob, NULL if it does not shrink or fails to
+ * allocate.  Takes compress_lock for the shared work memory, not dev->lock.
+ */
+static struct aesd_blob *aesd_pack_blob(struct aesd_dev *dev, struct aesd_blob *blob)
+{
+    struct aesd_blob *packed = NULL;
+    char *scratch;
+    int bound;
+    int len;
+
+    if (blob->size > LZ4_MAX_INPUT_SIZE)
+        return NULL;
+
+    bound = LZ4_compressBound(blob->size);
+    scratch = kmalloc(bound, GFP_KERNEL);
+    if (!scratch)
+        return NULL;
+
+    MUTEX_LOCK(&dev->compress_lock);
+    len = aesd_lz4_compress(dev, blob->data, scratch, blob->size, bound);
+    MUTEX_UNLOCK(&dev->compress_lock);
+
+    if (len > 0 && (size_t)len < blob->size) {
+        packed = kmalloc(sizeof(*packed) + len, GFP_KERNEL);
+        if (packed) {
+            packed->size = blob->size;
+            packed->stored_size = len;
+            packed->compressed = true;
+            packed->compress_tried = true;
+            packed->seq = blob->seq;
+            kref_init(&packed->ref);
+            memcpy(packed->data, scratch, len);
+        }
+    }
+    kfree(scratch);
+    return packed;
+}
+
+/*
+ * Queue every entry behind the newest compress_keep entries that has not
+ * been tried yet on cold, each with a reference, for aesd_compress_queued.
+ * Entries are tried once, so one that does not shrink is not compressed
+ * again by every later write.  Caller holds dev->lock.
+ */
+static void aesd_queue_cold_entries(struct aesd_dev *dev, struct list_head *cold)
+{
+    struct aesd_circular_buffer *buffer = &dev->circ_buf;
+    struct aesd_blob *blob;
+    uint8_t count;
+    uint8_t i;
+
+    if (!dev->lz4_wrkmem)
+        return;
+
+    if (buffer->full)
+        count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    else
+        count = (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs)
+                % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+    for (i = 0; i + compress_keep < count; i++) {
+        blob = aesd_entry_blob(&buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]);
+        if (blob->compress_tried)
+            continue;
+        blob->compress_tried = true;
+        kref_get(&blob->ref);
+        list_add_tail(&blob->stage_node, cold);
+    }
+}
+
+/*
+ * Compress the blobs aesd_queue_cold_entries queued, without dev->lock, and
+ * swap each copy into its entry unless the entry was evicted meanwhile.
+ * Blobs are never modified in place, snapshots still holding the old one
+ * keep reading it.
+ */
+static void aesd_compress_queued(struct aesd_dev *dev, struct list_head *cold)
+{
+    struct aesd_blob *blob;
+    struct aesd_blob *tmp;
+    struct aesd_blob *packed;
+    struct aesd_buffer_entry *entry;
+    uint8_t i;
+
+    list_for_each_entry_safe(blob, tmp, cold, stage_node) {
+        list_del(&blob->stage_node);
+        packed = aesd_pack_blob(dev, blob);
+        if (packed) {
+            MUTEX_LOCK(&dev->lock);
+            for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+                entry = &dev->circ_buf.entry[i];
+                if (entry->buffptr == blob->data) {
+                    entry->buffptr = packed->data;
+                    aesd_blob_put(blob);
+                    packed = NULL;
+                    break;
+                }
+            }
+            MUTEX_UNLOCK(&dev->lock);
+            if (packed)
+                aesd_blob_put(packed);
+        }
+        aesd_blob_put(blob);
+    }
+}
+
 /* Helper function to calculate total buffer size */
 static size_t aesd_get_total_size(struct aesd_circular_buffer *buffer)
 {
@@ -73,64 +334,301 @@ static loff_t aesd_cmd_offset_to_fpos(struct aesd_circular_buffer *buffer,
     return fpos;
 }
 
+/* Helper function to convert a seekto request into an absolute file position */
+static int aesd_seekto_fpos(struct aesd_circular_buffer *buffer,
+                            const struct aesd_seekto *seekto, loff_t *fpos)
+{
+    uint8_t cmd_count = 0;
+    uint8_t i;
+    uint8_t actual_idx;
+    struct aesd_buffer_entry *entry;
+
+    /* Count valid commands in circular buffer */
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        actual_idx = (buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        entry = &buffer->entry[actual_idx];
+        if (entry->buffptr) {
+            cmd_count++;
+        } else {
+            break;
+        }
+    }
+
+    /* Validate command index */
+    if (seekto->write_cmd >= cmd_count)
+        return -EINVAL;
+
+    /* Get the specific command entry */
+    actual_idx = (buffer->out_offs + seekto->write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    entry = &buffer->entry[actual_idx];
+
+    /* Validate offset within command */
+    if (seekto->write_cmd_offset >= entry->size)
+        return -EINVAL;
+
+    *fpos = aesd_cmd_offset_to_fpos(buffer, seekto->write_cmd, seekto->write_cmd_offset);
+    return 0;
+}
+
+/* Pin the current contents of the circular buffer in a new snapshot */
+static struct aesd_snapshot *aesd_snapshot_create(struct aesd_dev *dev)
+{
+    struct aesd_snapshot *snap;
+    struct aesd_buffer_entry *entry;
+    uint8_t index;
+
+    snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        return NULL;
+    kref_init(&snap->ref);
+
+    MUTEX_LOCK(&dev->lock);
+    snap->circ_buf = dev->circ_buf;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &snap->circ_buf, index) {
+        if (entry->buffptr)
+            kref_get(&aesd_entry_blob(entry)->ref);
+    }
+    MUTEX_UNLOCK(&dev->lock);
+
+    return snap;
+}
+
+static void aesd_snapshot_release(struct kref *ref)
+{
+    struct aesd_snapshot *snap = container_of(ref, struct aesd_snapshot, ref);
+    struct aesd_buffer_entry *entry;
+    uint8_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &snap->circ_buf, index) {
+        if (entry->buffptr)
+            aesd_blob_put(aesd_entry_blob(entry));
+    }
+    kfree(snap);
+}
+
+static void aesd_snapshot_put(struct aesd_snapshot *snap)
+{
+    if (snap)
+        kref_put(&snap->ref, aesd_snapshot_release);
+}
+
+/* Take a reference to the file's snapshot, NULL when reading the live buffer */
+static struct aesd_snapshot *aesd_file_get_snapshot(struct aesd_file *af)
+{
+    struct aesd_snapshot *snap;
+
+    spin_lock(&af->snap_lock);
+    snap = af->snap;
+    if (snap)
+        kref_get(&snap->ref);
+    spin_unlock(&af->snap_lock);
+    return snap;
+}
+
+/* Install snap as the file's snapshot, dropping the previous one */
+static void aesd_file_set_snapshot(struct aesd_file *af, struct aesd_snapshot *snap)
+{
+    struct aesd_snapshot *old;
+
+    spin_lock(&af->snap_lock);
+    old = af->snap;
+    af->snap = snap;
+    spin_unlock(&af->snap_lock);
+    aesd_snapshot_put(old);
+}
+
 /* Open */
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *af;
+
     PDEBUG("open");
-    filp->private_data = &aesd_device;
+    af = kmalloc(sizeof(*af), GFP_KERNEL);
+    if (!af)
+        return -ENOMEM;
+    af->dev = &aesd_device;
+    af->snap = NULL;
+    spin_lock_init(&af->snap_lock);
+    filp->private_data = af;
     return 0;
 }
 
 /* Release */
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *af = filp->private_data;
+
     PDEBUG("release");
+    aesd_snapshot_put(af->snap);
+    kfree(af);
     return 0;
 }
 
-/* Read */
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/* Copy up to count bytes from buffer at *f_pos, caller keeps buffer stable */
+static ssize_t aesd_read_buffer(struct aesd_dev *dev, struct aesd_circular_buffer *buffer,
+                                char __user *buf, size_t count, loff_t *f_pos)
 {
     ssize_t bytes_read = 0;
     size_t offset;
+    size_t bytes_to_copy;
+    int err;
     struct aesd_buffer_entry *entry;
-    struct aesd_dev *dev = filp->private_data;
-    
-    MUTEX_LOCK(&dev->lock);
-    
+
     while (bytes_read < count) {
-        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circ_buf, *f_pos, &offset);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, *f_pos, &offset);
         if (!entry || !entry->buffptr) {
             break;  /* No more entries */
         }
-        
-        size_t bytes_to_copy = min(count - bytes_read, entry->size - offset);
-        if (copy_to_user(buf + bytes_read, entry->buffptr + offset, bytes_to_copy)) {
-            MUTEX_UNLOCK(&dev->lock);
-            return -EFAULT;
-        }
-        
+
+        bytes_to_copy = min(count - bytes_read, entry->size - offset);
+        err = aesd_copy_entry_to_user(dev, entry, offset, buf + bytes_read, bytes_to_copy);
+        if (err)
+            return (err == -EFAULT || !bytes_read) ? err : bytes_read;
+
         bytes_read += bytes_to_copy;
         *f_pos += bytes_to_copy;
     }
-    
+
+    return bytes_read;
+}
+
+static ssize_t aesd_do_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    ssize_t bytes_read;
+    struct aesd_file *af = filp->private_data;
+    struct aesd_dev *dev = af->dev;
+    struct aesd_snapshot *snap;
+
+    /* Snapshot readers stream their pinned image without blocking writers */
+    snap = aesd_file_get_snapshot(af);
+    if (snap) {
+        bytes_read = aesd_read_buffer(dev, &snap->circ_buf, buf, count, f_pos);
+        aesd_snapshot_put(snap);
+        return bytes_read;
+    }
+
+    MUTEX_LOCK(&dev->lock);
+    bytes_read = aesd_read_buffer(dev, &dev->circ_buf, buf, count, f_pos);
     MUTEX_UNLOCK(&dev->lock);
     return bytes_read;
 }
 
-/* Write */
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/* Read */
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    ssize_t retval;
+
+    trace_aesd_read_enter(count, *f_pos);
+    retval = aesd_do_read(filp, buf, count, f_pos);
+    trace_aesd_read_exit(retval);
+    return retval;
+}
+
+/*
+ * Add one staged command to the circular buffer, extending the newest entry
+ * when it has not been terminated by a newline yet.  Caller holds dev->lock.
+ */
+static int aesd_publish_cmd(struct aesd_dev *dev, struct aesd_blob *blob)
+{
+    struct aesd_circular_buffer *buffer = &dev->circ_buf;
+    struct aesd_buffer_entry new_entry;
+    struct aesd_buffer_entry *last_entry = NULL;
+    struct aesd_blob *combined;
+
+    if (buffer->full || buffer->in_offs != buffer->out_offs) {
+        last_entry = &buffer->entry[(buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    }
+
+    if (last_entry && last_entry->size > 0 && last_entry->buffptr[last_entry->size - 1] != '\n') {
+        combined = aesd_blob_alloc(last_entry->size + blob->size);
+        if (!combined)
+            return -ENOMEM;
+        memcpy(combined->data, last_entry->buffptr, last_entry->size);
+        memcpy(combined->data + last_entry->size, blob->data, blob->size);
+        combined->seq = blob->seq;
+        aesd_blob_put(aesd_entry_blob(last_entry));
+        aesd_blob_put(blob);
+        last_entry->buffptr = combined->data;
+        last_entry->size = combined->size;
+        trace_aesd_ring_insert(combined->seq, combined->size, true);
+        return 0;
+    }
+
+    new_entry.buffptr = blob->data;
+    new_entry.size = blob->size;
+
+    /* Check if we need to free an old entry before overwriting */
+    if (buffer->full && buffer->entry[buffer->in_offs].buffptr) {
+        aesd_blob_put(aesd_entry_blob(&buffer->entry[buffer->in_offs]));
+    }
+
+    aesd_circular_buffer_add_entry(buffer, &new_entry);
+    trace_aesd_ring_insert(blob->seq, blob->size, false);
+    return 0;
+}
+
+/*
+ * Move every command staged on any CPU into the circular buffer.  Each CPU's
+ * list is in write order and holds whole writes, so commands are numbered
+ * here, at commit, to give the buffer a single well defined order.  A
+ * command that cannot be published is dropped without using a number and
+ * its failure is reported through the ticket of the write that staged it,
+ * which may be waiting for us to finish.  Entries that turned cold
+ * are queued on cold for the caller to compress once it drops the lock.
+ * Caller holds dev->lock.
+ */
+static void aesd_publish_staged(struct aesd_dev *dev, struct list_head *cold)
+{
+    struct aesd_stage *stage;
+    struct aesd_blob *blob;
+    struct aesd_blob *tmp;
+    struct aesd_write_ticket *ticket;
+    LIST_HEAD(batch);
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        stage = per_cpu_ptr(dev->stage, cpu);
+        spin_lock(&stage->lock);
+        list_splice_tail_init(&stage->cmds, &batch);
+        spin_unlock(&stage->lock);
+    }
+
+    if (list_empty(&batch))
+        return;
+
+    list_for_each_entry_safe(blob, tmp, &batch, stage_node) {
+        list_del(&blob->stage_node);
+        ticket = blob->ticket;
+        blob->ticket = NULL;
+        blob->seq = dev->commit_seq + 1;
+        if (aesd_publish_cmd(dev, blob)) {
+            ticket->status = -ENOMEM;
+            aesd_blob_put(blob);
+        } else {
+            dev->commit_seq++;
+        }
+        /* The status store is ordered before the writer sees 0 */
+        smp_store_release(&ticket->pending, ticket->pending - 1);
+    }
+
+    aesd_queue_cold_entries(dev, cold);
+}
+
+static ssize_t aesd_do_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
     ssize_t retval;
     char *kbuf;
-    char *entry_buf;
-    char *combined;
+    struct aesd_blob *entry_blob;
+    struct aesd_blob *tmp;
+    struct aesd_stage *stage;
     size_t start;
     size_t i;
     size_t len;
-    struct aesd_buffer_entry new_entry;
-    struct aesd_buffer_entry *last_entry;
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_write_ticket ticket = { 0, 0 };
+    LIST_HEAD(cmds);
+    LIST_HEAD(cold);
+    struct aesd_file *af = filp->private_data;
+    struct aesd_dev *dev = af->dev;
 
     PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
 
@@ -148,74 +646,88 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff
 
     retval = count;
 
-    mutex_lock(&dev->lock);
-
-    /* Check last entry */
-    last_entry = NULL;
-    if (dev->circ_buf.in_offs != 0 || dev->circ_buf.full) {
-        last_entry = &dev->circ_buf.entry[(dev->circ_buf.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
-    }
-
-    if (last_entry && last_entry->size > 0 && last_entry->buffptr[last_entry->size - 1] != '\n') {
-        combined = kmalloc(last_entry->size + count, GFP_KERNEL);
-        if (!combined) {
-            mutex_unlock(&dev->lock);
-            kfree(kbuf);
-            return -ENOMEM;
-        }
-        memcpy(combined, last_entry->buffptr, last_entry->size);
-        memcpy(combined + last_entry->size, kbuf, count);
-        kfree((void*)last_entry->buffptr);  /* Cast away const for freeing */
-        last_entry->buffptr = combined;
-        last_entry->size += count;
-
-        mutex_unlock(&dev->lock);
-        kfree(kbuf);
-        return retval;
-    }
-
-    /* Split writes terminated by '\n' */
+    /* Split writes terminated by '\n' without holding dev->lock */
     start = 0;
     for (i = 0; i < count; i++) {
         if (kbuf[i] == '\n' || i == count - 1) {
             len = i - start + 1;
-            entry_buf = kmalloc(len, GFP_KERNEL);
-            if (!entry_buf) {
-                mutex_unlock(&dev->lock);
+            entry_blob = aesd_blob_alloc(len);
+            if (!entry_blob) {
+                list_for_each_entry_safe(entry_blob, tmp, &cmds, stage_node)
+                    kfree(entry_blob);
                 kfree(kbuf);
                 return -ENOMEM;
             }
-            memcpy(entry_buf, kbuf + start, len);
-
-            new_entry.buffptr = entry_buf;  /* This is now valid since buffptr is const char* */
-            new_entry.size = len;
-
-            /* Check if we need to free an old entry before overwriting */
-            if (dev->circ_buf.full && dev->circ_buf.entry[dev->circ_buf.in_offs].buffptr) {
-                kfree((void*)dev->circ_buf.entry[dev->circ_buf.in_offs].buffptr);
-            }
-
-            aesd_circular_buffer_add_entry(&dev->circ_buf, &new_entry);
+            memcpy(entry_blob->data, kbuf + start, len);
+            entry_blob->ticket = &ticket;
+            ticket.pending++;
+            list_add_tail(&entry_blob->stage_node, &cmds);
             start = i + 1;
         }
     }
-
-    mutex_unlock(&dev->lock);
     kfree(kbuf);
 
+    /* Stage the whole write on this CPU in one step so it stays contiguous */
+    stage = get_cpu_ptr(dev->stage);
+    spin_lock(&stage->lock);
+    list_splice_tail_init(&cmds, &stage->cmds);
+    spin_unlock(&stage->lock);
+    put_cpu_ptr(dev->stage);
+
+    /*
+     * Publish before returning so the data is visible to the next read.  One
+     * writer at a time drains every CPU's stage under dev->lock; the others
+     * sleep until it has published their commands, and only take over if
+     * it drained before they staged.  So dev->lock is taken once per batch
+     * rather than once per write.
+     */
+    while (smp_load_acquire(&ticket.pending)) {
+        if (atomic_xchg(&dev->publishing, 1) == 0) {
+            mutex_lock(&dev->lock);
+            trace_aesd_write_locked(count);
+            aesd_publish_staged(dev, &cold);
+            mutex_unlock(&dev->lock);
+            atomic_set(&dev->publishing, 0);
+            wake_up_all(&dev->publish_wq);
+            aesd_compress_queued(dev, &cold);
+        } else {
+            wait_event(dev->publish_wq, !smp_load_acquire(&ticket.pending) || !atomic_read(&dev->publishing));
+        }
+    }
+    if (ticket.status)
+        retval = ticket.status;
+
     return retval;
 }
 
-/* llseek implementation */
-loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
+/* Write */
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
-    struct aesd_dev *dev = filp->private_data;
+    ssize_t retval;
+
+    trace_aesd_write_enter(count, *f_pos);
+    retval = aesd_do_write(filp, buf, count, f_pos);
+    trace_aesd_write_exit(retval);
+    return retval;
+}
+
+static loff_t aesd_do_llseek(struct file *filp, loff_t off, int whence)
+{
+    struct aesd_file *af = filp->private_data;
+    struct aesd_dev *dev = af->dev;
+    struct aesd_snapshot *snap;
     loff_t newpos;
     size_t total_size;
     
-    MUTEX_LOCK(&dev->lock);
-    
-    total_size = aesd_get_total_size(&dev->circ_buf);
+    snap = aesd_file_get_snapshot(af);
+    if (snap) {
+        total_size = aesd_get_total_size(&snap->circ_buf);
+        aesd_snapshot_put(snap);
+    } else {
+        MUTEX_LOCK(&dev->lock);
+        total_size = aesd_get_total_size(&dev->circ_buf);
+        MUTEX_UNLOCK(&dev->lock);
+    }
     
     switch (whence) {
         case SEEK_SET:
@@ -231,32 +743,36 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
             break;
             
         default:
-            MUTEX_UNLOCK(&dev->lock);
             return -EINVAL;
     }
     
     /* Check bounds */
     if (newpos < 0 || newpos > total_size) {
-        MUTEX_UNLOCK(&dev->lock);
         return -EINVAL;
     }
     
     filp->f_pos = newpos;
-    MUTEX_UNLOCK(&dev->lock);
     
     return newpos;
 }
 
-/* ioctl implementation */
-long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/* llseek implementation */
+loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 {
-    struct aesd_dev *dev = filp->private_data;
+    loff_t retval = aesd_do_llseek(filp, off, whence);
+
+    trace_aesd_llseek(off, whence, retval);
+    return retval;
+}
+
+static long aesd_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_file *af = filp->private_data;
+    struct aesd_dev *dev = af->dev;
     struct aesd_seekto seekto;
-    uint8_t cmd_count = 0;
-    uint8_t i;
-    uint8_t actual_idx;
-    struct aesd_buffer_entry *entry;
+    struct aesd_snapshot *snap;
     loff_t new_fpos;
+    int retval;
     
     /* Check magic number and command number */
     if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC) return -ENOTTY;
@@ -268,40 +784,31 @@ long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                 return -EFAULT;
             }
             
-            MUTEX_LOCK(&dev->lock);
-            
-            /* Count valid commands in circular buffer */
-            for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-                actual_idx = (dev->circ_buf.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-                entry = &dev->circ_buf.entry[actual_idx];
-                if (entry->buffptr) {
-                    cmd_count++;
-                } else {
-                    break;
-                }
-            }
-            
-            /* Validate command index */
-            if (seekto.write_cmd >= cmd_count) {
+            snap = aesd_file_get_snapshot(af);
+            if (snap) {
+                retval = aesd_seekto_fpos(&snap->circ_buf, &seekto, &new_fpos);
+                aesd_snapshot_put(snap);
+            } else {
+                MUTEX_LOCK(&dev->lock);
+                retval = aesd_seekto_fpos(&dev->circ_buf, &seekto, &new_fpos);
                 MUTEX_UNLOCK(&dev->lock);
-                return -EINVAL;
             }
+            if (retval)
+                return retval;
             
-            /* Get the specific command entry */
-            actual_idx = (dev->circ_buf.out_offs + seekto.write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            entry = &dev->circ_buf.entry[actual_idx];
-            
-            /* Validate offset within command */
-            if (seekto.write_cmd_offset >= entry->size) {
-                MUTEX_UNLOCK(&dev->lock);
-                return -EINVAL;
-            }
-            
-            /* Calculate new file position */
-            new_fpos = aesd_cmd_offset_to_fpos(&dev->circ_buf, seekto.write_cmd, seekto.write_cmd_offset);
             filp->f_pos = new_fpos;
+            return 0;
             
-            MUTEX_UNLOCK(&dev->lock);
+        case AESDCHAR_IOCSNAPSHOT:
+            /* Pin the buffer as it is now, or return to live reads for arg 0 */
+            snap = NULL;
+            if (arg) {
+                snap = aesd_snapshot_create(dev);
+                if (!snap)
+                    return -ENOMEM;
+            }
+            aesd_file_set_snapshot(af, snap);
+            filp->f_pos = 0;
             return 0;
             
         default:
@@ -309,6 +816,15 @@ long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     }
 }
 
+/* ioctl implementation */
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    long retval = aesd_do_ioctl(filp, cmd, arg);
+
+    trace_aesd_ioctl(cmd, arg, retval);
+    return retval;
+}
+
 /* File operations structure */
 struct file_operations aesd_fops = {
     .owner = THIS_MODULE,
@@ -342,6 +858,8 @@ int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
+    int cpu;
+    struct aesd_stage *stage;
 
     result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
     aesd_major = MAJOR(dev);
@@ -355,10 +873,44 @@ int aesd_init_module(void)
     /* Initialize AESD circular buffer and mutex */
     aesd_circular_buffer_init(&aesd_device.circ_buf);
     mutex_init(&aesd_device.lock);
+    mutex_init(&aesd_device.cache_lock);
+    mutex_init(&aesd_device.compress_lock);
+    atomic_set(&aesd_device.publishing, 0);
+    init_waitqueue_head(&aesd_device.publish_wq);
+
+    aesd_device.stage = alloc_percpu(struct aesd_stage);
+    if (!aesd_device.stage) {
+        unregister_chrdev_region(dev, 1);
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        stage = per_cpu_ptr(aesd_device.stage, cpu);
+        spin_lock_init(&stage->lock);
+        INIT_LIST_HEAD(&stage->cmds);
+    }
+
+#ifndef AESD_HAVE_LZ4
+    if (compress_keep) {
+        printk(KERN_WARNING "aesdchar: kernel built without LZ4, ignoring compress_keep\n");
+        compress_keep = 0;
+    }
+#endif
+
+    /* The newest entry must stay uncompressed so partial writes can extend it */
+    if (compress_keep) {
+        aesd_device.lz4_wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+        if (!aesd_device.lz4_wrkmem) {
+            free_percpu(aesd_device.stage);
+            unregister_chrdev_region(dev, 1);
+            return -ENOMEM;
+        }
+    }
 
     result = aesd_setup_cdev(&aesd_device);
 
     if (result) {
+        vfree(aesd_device.lz4_wrkmem);
+        free_percpu(aesd_device.stage);
         unregister_chrdev_region(dev, 1);
     }
 
@@ -378,8 +930,16 @@ void aesd_cleanup_module(void)
     for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
         entry = &aesd_device.circ_buf.entry[i];
         if (entry->buffptr)
-            kfree((void*)entry->buffptr);  /* Cast away const for freeing */
+            aesd_blob_put(aesd_entry_blob(entry));
+    }
+
+    for (i = 0; i < AESD_DECOMP_CACHE_SLOTS; i++) {
+        kfree(aesd_device.decomp_cache[i].buf);
+        if (aesd_device.decomp_cache[i].blob)
+            aesd_blob_put(aesd_device.decomp_cache[i].blob);
     }
+    vfree(aesd_device.lz4_wrkmem);
+    free_percpu(aesd_device.stage);
 
     unregister_chrdev_region(devno, 1);
 }
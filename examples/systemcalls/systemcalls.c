@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2
 #include "systemcalls.h"
 
 /**
@@ -76,25 +77,194 @@ bool do_exec(int count, ...)
         return false;
     }
 
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("fork");
+    struct exec_batch_cmd cmd = { .argv = command };
+    return do_exec_batch(&cmd, 1, 1, NULL, NULL) == 0;
+}
+
+#define EXEC_WAIT_POLL_MS 10     // how often children without a pidfd are checked
+
+extern char **environ;
+
+bool exec_batch_succeeded(const struct exec_batch_cmd *cmd)
+{
+    return cmd->pid > 0 && cmd->status != -1 &&
+           WIFEXITED(cmd->status) && WEXITSTATUS(cmd->status) == 0;
+}
+
+// Start cmd without copying our address space; false if it could not be
+static bool exec_batch_spawn(struct exec_batch_cmd *cmd)
+{
+    int err = EINVAL;
+
+    if (cmd->argv != NULL && cmd->argv[0] != NULL && cmd->argv[0][0] == '/') {
+        err = posix_spawn(&cmd->pid, cmd->argv[0], NULL, NULL, cmd->argv, environ);
+    }
+    if (err != 0) {
+        fprintf(stderr, "posix_spawn %s: %s\n",
+                cmd->argv != NULL && cmd->argv[0] != NULL ? cmd->argv[0] : "(null)", strerror(err));
+        cmd->pid = 0;
         return false;
     }
+    return true;
+}
+
+// Milliseconds until deadline on CLOCK_MONOTONIC, negative once passed
+static long exec_remaining_ms(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
 
-    if (pid == 0) { // Child process
-        execv(command[0], command);
-        perror("execv"); // Only reached if execv fails
-        exit(EXIT_FAILURE);
+// A descriptor that polls readable once pid exits, -1 where the kernel has none
+static int exec_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Reap whichever of the n children in pids[] exits first, waiting up to
+ * timeout_ms, or without limit if negative.  Only these pids are waited on,
+ * so the status of the caller's other children is left for their owner.
+ * pidfds[i] holds the pidfd of pids[i], or -1 to have it checked every
+ * EXEC_WAIT_POLL_MS instead.  Returns the index reaped with *status set, or
+ * -1 on timeout.  If waitpid() fails for a child its index is returned with
+ * *status left alone and *ok cleared.
+ */
+static int exec_wait_any(const pid_t *pids, struct pollfd *pidfds, int n, int timeout_ms,
+                         int *status, bool *ok)
+{
+    struct timespec deadline;
+    int i;
+
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
     }
+    for (;;) {
+        bool sweep = false;
+        for (i = 0; i < n; i++) {
+            pid_t pid = waitpid(pids[i], status, WNOHANG);
+            if (pid == pids[i]) {
+                return i;
+            }
+            if (pid == -1 && errno != EINTR) {
+                perror("waitpid");
+                *ok = false;
+                return i;
+            }
+            if (pidfds[i].fd < 0) {
+                sweep = true;
+            }
+        }
 
-    int status;
-    if (waitpid(pid, &status, 0) == -1) {
-        perror("waitpid");
-        return false;
+        int wait_ms = sweep ? EXEC_WAIT_POLL_MS : -1;
+        if (timeout_ms >= 0) {
+            long remaining = exec_remaining_ms(&deadline);
+            if (remaining <= 0) {
+                return -1;
+            }
+            if (wait_ms < 0 || remaining < wait_ms) {
+                wait_ms = remaining;
+            }
+        }
+        // poll() skips negative descriptors; with more entries than it takes, sleep instead
+        if (poll(pidfds, n, wait_ms) == -1 && errno == EINVAL) {
+            struct timespec pause = { 0, EXEC_WAIT_POLL_MS * 1000000L };
+            nanosleep(&pause, NULL);
+        }
     }
+}
 
-    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+int do_exec_batch(struct exec_batch_cmd *cmds, int count, int max_parallel,
+                  exec_batch_done_fn done, void *arg)
+{
+    int nrunning = 0;
+    int next = 0;
+    int failed = 0;
+    bool ok = true;
+    int *running;
+    pid_t *pids;
+    struct pollfd *pidfds;
+    int i;
+
+    if (count <= 0) {
+        return 0;
+    }
+    if (max_parallel <= 0 || max_parallel > count) {
+        max_parallel = count;
+    }
+    for (i = 0; i < count; i++) {
+        cmds[i].pid = 0;
+        cmds[i].status = -1;
+    }
+    // Indexed by slot: the command running there, its pid and its pidfd
+    running = malloc(max_parallel * sizeof(*running));
+    pids = malloc(max_parallel * sizeof(*pids));
+    pidfds = malloc(max_parallel * sizeof(*pidfds));
+    if (running == NULL || pids == NULL || pidfds == NULL) {
+        perror("malloc");
+        free(running);
+        free(pids);
+        free(pidfds);
+        return -1;
+    }
+
+    for (;;) {
+        // Nothing more is started once a status could not be collected
+        while (ok && next < count && nrunning < max_parallel) {
+            if (exec_batch_spawn(&cmds[next])) {
+                running[nrunning] = next;
+                pids[nrunning] = cmds[next].pid;
+                pidfds[nrunning].fd = exec_pidfd_open(cmds[next].pid);
+                pidfds[nrunning].events = POLLIN;
+                nrunning++;
+            } else {
+                failed++;
+                if (done != NULL) {
+                    done(&cmds[next], next, arg);
+                }
+            }
+            next++;
+        }
+        if (nrunning == 0) {
+            break;
+        }
+
+        int status;
+        bool reaped = true;
+        int slot = exec_wait_any(pids, pidfds, nrunning, -1, &status, &reaped);
+        int index = running[slot];
+        if (reaped) {
+            cmds[index].status = status;
+        } else {
+            ok = false;
+        }
+        if (pidfds[slot].fd >= 0) {
+            close(pidfds[slot].fd);
+        }
+        nrunning--;
+        running[slot] = running[nrunning];
+        pids[slot] = pids[nrunning];
+        pidfds[slot] = pidfds[nrunning];
+        if (!exec_batch_succeeded(&cmds[index])) {
+            failed++;
+        }
+        if (done != NULL) {
+            done(&cmds[index], index, arg);
+        }
+    }
+
+    free(running);
+    free(pids);
+    free(pidfds);
+    return ok ? failed : -1;
 }
 
 /**
@@ -113,51 +283,255 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
+    va_end(args);
 
+    if (command[0] == NULL || command[0][0] != '/') {
+        return false;
+    }
+
+    // The child opens outputfile as its stdout, so ours is never touched
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err == 0) {
+        err = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                               O_WRONLY | O_TRUNC | O_CREAT, 0644);
+    }
+    if (err == 0) {
+        err = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        fprintf(stderr, "posix_spawn %s > %s: %s\n", command[0], outputfile, strerror(err));
+        return false;
+    }
+
+    int status;
+    bool reaped = true;
+    struct pollfd pidfd = { .fd = exec_pidfd_open(pid), .events = POLLIN };
+    exec_wait_any(&pid, &pidfd, 1, -1, &status, &reaped);
+    if (pidfd.fd >= 0) {
+        close(pidfd.fd);
+    }
+
+    return reaped && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
 
 /*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
-*/  int fd = open(outputfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
-    if (fd < 0) {
-        perror("open");
+ * Take len bytes of the command's output on fd, within limit bytes for the
+ * stream.  Grown buffers are doubled as needed; false if that failed.
+ */
+static bool exec_capture_take(struct exec_capture *capture, int fd, struct exec_output *out,
+                              bool grow, size_t limit, const char *data, size_t len)
+{
+    size_t room = limit - out->size;
+
+    if (len > room) {
+        len = room;
+        out->truncated = true;
+    }
+    if (len == 0) {
+        return true;
+    }
+    if (capture->callback != NULL) {
+        capture->callback(fd, data, len, capture->arg);
+        out->size += len;
+        return true;
+    }
+    // One byte past the data is kept for the terminating NUL
+    if (grow && out->size + len + 1 > out->capacity) {
+        size_t capacity = out->capacity ? out->capacity : 4096;
+        while (capacity < out->size + len + 1) {
+            capacity *= 2;
+        }
+        char *data_grown = realloc(out->data, capacity);
+        if (data_grown == NULL) {
+            perror("realloc");
+            out->truncated = true;
+            return false;
+        }
+        out->data = data_grown;
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->size, data, len);
+    out->size += len;
+    out->data[out->size] = '\0';
+    return true;
+}
+
+/**
+* @param capture - Where the output goes and the limits on the command, see
+*   struct exec_capture.  Its results are filled in on return.
+* All other parameters, see do_exec above
+* @return true if the command ran within the timeout and exited with status 0.
+*   Output beyond the cap is discarded without failing the call.
+*/
+bool do_exec_capture(struct exec_capture *capture, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    struct exec_output *outputs[2] = { &capture->out, &capture->err };
+    bool grow[2];
+    size_t limit[2];
+    for (i = 0; i < 2; i++) {
+        struct exec_output *out = outputs[i];
+        grow[i] = out->data == NULL && capture->callback == NULL;
+        if (grow[i]) {
+            out->capacity = 0;
+        }
+        limit[i] = capture->max_output ? capture->max_output : (size_t)-1;
+        if (!grow[i] && capture->callback == NULL) {
+            // A caller's buffer holds at most capacity - 1 bytes and the NUL
+            size_t fits = out->capacity ? out->capacity - 1 : 0;
+            limit[i] = fits < limit[i] ? fits : limit[i];
+            if (out->capacity) {
+                out->data[0] = '\0';
+            }
+        }
+        out->size = 0;
+        out->truncated = false;
+    }
+    capture->status = -1;
+    capture->timed_out = false;
+
+    if (command[0] == NULL || command[0][0] != '/') {
         return false;
     }
-    
-    int pid = fork();
-    if (pid == -1) {
-        perror("fork");
-        close(fd);
+
+    int pipes[2][2];
+    if (pipe2(pipes[0], O_CLOEXEC) == -1) {
+        perror("pipe2");
         return false;
     }
-    
-    if (pid == 0) { // Child process
-        if (dup2(fd, STDOUT_FILENO) < 0) {
-            perror("dup2");
-            close(fd);
-            exit(EXIT_FAILURE);
-        }
-        close(fd);
-        execv(command[0], command);
-        perror("execv"); // Only reached if execv fails
-        exit(EXIT_FAILURE);
-    }
-    
-    close(fd);
-    
-    int status;
-    if (waitpid(pid, &status, 0) == -1) {
-        perror("waitpid");
+    if (pipe2(pipes[1], O_CLOEXEC) == -1) {
+        perror("pipe2");
+        close(pipes[0][0]);
+        close(pipes[0][1]);
         return false;
     }
 
-    va_end(args);
+    // dup2 clears close-on-exec on the child's stdout and stderr only
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err == 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, pipes[0][1], STDOUT_FILENO);
+    }
+    if (err == 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, pipes[1][1], STDERR_FILENO);
+    }
+    if (err == 0) {
+        err = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipes[0][1]);
+    close(pipes[1][1]);
+    if (err != 0) {
+        fprintf(stderr, "posix_spawn %s: %s\n", command[0], strerror(err));
+        close(pipes[0][0]);
+        close(pipes[1][0]);
+        return false;
+    }
 
-    return true;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += capture->timeout_ms / 1000;
+    deadline.tv_nsec += (capture->timeout_ms % 1000) * 1000000L;
+
+    struct pollfd pfd[2] = {
+        { .fd = pipes[0][0], .events = POLLIN },
+        { .fd = pipes[1][0], .events = POLLIN },
+    };
+    const int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char buf[4096];
+    bool ok = true;
+    while (pfd[0].fd >= 0 || pfd[1].fd >= 0) {
+        int wait_ms = -1;
+        if (capture->timeout_ms > 0) {
+            long remaining = exec_remaining_ms(&deadline);
+            if (remaining <= 0) {
+                // Whatever the command left behind holding the pipes is not waited for
+                kill(pid, SIGKILL);
+                capture->timed_out = true;
+                break;
+            }
+            wait_ms = remaining;
+        }
+        // poll() skips the negative descriptors of closed streams
+        int rc = poll(pfd, 2, wait_ms);
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            kill(pid, SIGKILL);
+            ok = false;
+            break;
+        }
+        for (i = 0; i < 2 && rc > 0; i++) {
+            if (pfd[i].fd < 0 || pfd[i].revents == 0) {
+                continue;
+            }
+            ssize_t n = read(pfd[i].fd, buf, sizeof(buf));
+            if (n > 0) {
+                // Past the limit the pipe is still drained so the command never blocks
+                if (!exec_capture_take(capture, fds[i], outputs[i], grow[i], limit[i], buf, n)) {
+                    limit[i] = outputs[i]->size;
+                    ok = false;
+                }
+            } else if (n == 0 || errno != EINTR) {
+                close(pfd[i].fd);
+                pfd[i].fd = -1;
+            }
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if (pfd[i].fd >= 0) {
+            close(pfd[i].fd);
+        }
+    }
+
+    // A command that closed its output early is still held to the deadline
+    int status;
+    bool reaped = true;
+    if (!capture->timed_out && ok) {
+        long remaining = -1;
+        if (capture->timeout_ms > 0) {
+            remaining = exec_remaining_ms(&deadline);
+            remaining = remaining > 0 ? remaining : 0;
+        }
+        struct pollfd pidfd = { .fd = exec_pidfd_open(pid), .events = POLLIN };
+        int exited = exec_wait_any(&pid, &pidfd, 1, remaining, &status, &reaped);
+        if (pidfd.fd >= 0) {
+            close(pidfd.fd);
+        }
+        if (exited == -1) {
+            kill(pid, SIGKILL);
+            capture->timed_out = true;
+        } else if (!reaped) {
+            return false;
+        } else {
+            capture->status = status;
+        }
+    }
+    if (capture->status == -1) {
+        while (waitpid(pid, &status, 0) == -1) {
+            if (errno != EINTR) {
+                perror("waitpid");
+                return false;
+            }
+        }
+        capture->status = status;
+    }
+
+    return ok && !capture->timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0;
 }
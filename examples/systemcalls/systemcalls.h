@@ -3,10 +3,17 @@
 #include <stdarg.h>
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
 
 
 bool do_system(const char *command);
@@ -14,3 +21,70 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * Captured output of one stream.  With data NULL a buffer is allocated and
+ * grown as needed, which the caller frees, and data stays NULL if the stream
+ * was empty; otherwise data is the caller's buffer of capacity bytes.
+ * Captured output is NUL terminated.
+ */
+struct exec_output {
+    char *data;
+    size_t size;        // bytes captured, or passed to the callback
+    size_t capacity;
+    bool truncated;     // output past the cap was discarded
+};
+
+/**
+ * Called with each piece of output as it arrives.
+ * @param fd STDOUT_FILENO or STDERR_FILENO, the stream it was written to
+ */
+typedef void (*exec_output_fn)(int fd, const char *data, size_t len, void *arg);
+
+struct exec_capture {
+    struct exec_output out;
+    struct exec_output err;
+    exec_output_fn callback;    // if set, output streams here instead of into out and err
+    void *arg;
+    size_t max_output;          // bytes kept from each stream, 0 for no cap
+    int timeout_ms;             // the command is killed with SIGKILL after this, 0 never
+    int status;                 // waitpid() status, -1 if the command did not run
+    bool timed_out;
+};
+
+bool do_exec_capture(struct exec_capture *capture, int count, ...);
+
+/**
+ * One command of a do_exec_batch() call.  argv[0] is the full path to the
+ * command, as for do_exec(), and argv ends with a NULL.
+ */
+struct exec_batch_cmd {
+    char *const *argv;
+    pid_t pid;      // set once started, 0 if it never was
+    int status;     // waitpid() status once finished, -1 if it could not be started
+};
+
+/**
+ * Called by do_exec_batch() as each command finishes, in completion order.
+ * @param index the position of @param cmd in the array passed to do_exec_batch()
+ */
+typedef void (*exec_batch_done_fn)(struct exec_batch_cmd *cmd, int index, void *arg);
+
+/**
+* Run @param count commands from @param cmds with up to @param max_parallel of
+*   them running at once, 0 for no limit.  Commands are started in order with
+*   posix_spawn(), so the parent's address space is never copied, and a new
+*   one starts as soon as a running one exits.  Only the batch's own children
+*   are waited for, through pidfds where the kernel has them.
+* @param done if not NULL, called with @param arg as each command finishes
+* @return the number of commands which could not be started or did not exit
+*   with status 0, -1 if waiting for a command failed.  Commands left running
+*   after such a failure are still waited for before returning.
+*/
+int do_exec_batch(struct exec_batch_cmd *cmds, int count, int max_parallel,
+                  exec_batch_done_fn done, void *arg);
+
+/**
+ * @return true if @param cmd was started and exited with status 0
+ */
+bool exec_batch_succeeded(const struct exec_batch_cmd *cmd);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // memrchr
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,142 +9,691 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <syslog.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <pthread.h>
-#ifndef USE_AESD_CHAR_DEVICE
+#include <poll.h>
+#include <stdint.h>
 #include <time.h>
-#endif
-
-#ifdef USE_AESD_CHAR_DEVICE
-#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sched.h>
 
-/* Include ioctl definitions inline to avoid path issues */
-struct aesd_seekto {
-    uint32_t write_cmd;
-    uint32_t write_cmd_offset;
-};
+#include "binproto.h"
+#include "compress.h"
+#include "handoff.h"
+#include "log.h"
+#include "pool.h"
+#include "replicate.h"
+#include "scan.h"
+#include "storage.h"
+#include "response_cache.h"
+#include "subscribe.h"
+#include "trace.h"
+#include "writer.h"
 
-#define AESD_IOC_MAGIC 0x16
-#define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
-#define AESDCHAR_IOC_MAXNR 1
-#endif
+#define DEFAULT_PORT "9000"
+#define TIMESTAMP_INTERVAL 10
+#define BUFFER_SIZE 1024
 
-#define PORT "9000"
+// The build-time switch only picks the default, -S selects any backend
 #ifdef USE_AESD_CHAR_DEVICE
-#define DATA_FILE "/dev/aesdchar"
+#define DEFAULT_STORAGE "chardev"
 #else
-#define DATA_FILE "/var/tmp/aesdsocketdata"
-#define TIMESTAMP_INTERVAL 10
+#define DEFAULT_STORAGE "file"
 #endif
-#define BUFFER_SIZE 1024
+
+// Timer wheel driven from the main loop, one slot per second
+#define TICK_SECONDS 1
+#define TIMER_WHEEL_SLOTS 64
+#define DEFAULT_IDLE_TIMEOUT 120   // seconds without any data from the client
+#define DEFAULT_PACKET_TIMEOUT 30  // seconds to finish a packet once started
+
+#define DEFAULT_BACKLOG SOMAXCONN
+
+#define DEFAULT_DRAIN_TIMEOUT 30   // seconds a predecessor keeps serving after handoff
 
 int sockfd = -1;
+int timer_fd = -1;
+int signal_fd = -1;
+int listen_backlog = DEFAULT_BACKLOG;
+const char *listen_port = DEFAULT_PORT;
+
+// Graceful upgrade: a successor takes the listeners over upgrade_path
+const char *upgrade_path = DEFAULT_UPGRADE_PATH;
+int upgrade_fd = -1;        // listener for a successor, -1 once handed off
+int handoff_fd = -1;        // connection to the successor, told when draining ends
+int predecessor_fd = -1;    // connection to the instance taken over, until it has drained
+int drain_fd = -1;          // eventfd the last connection of a draining server signals
+unsigned int drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+volatile int draining = 0;
+uint64_t drain_deadline = 0;
+
+// A successor accepts at once but its client threads wait here until the
+// predecessor has released storage and it is opened
+int storage_ready = 0;
+pthread_mutex_t storage_ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t storage_ready_cond = PTHREAD_COND_INITIALIZER;
+
+// Replication: any connection may ask for the log with REPLICATE_HELLO, and
+// with -F this server follows a primary and refuses client writes
+const char *replicate_from = NULL;  // primary's address, NULL unless following
+const char *replica_path = NULL;    // unix socket followers may also connect to
+int replica_listen_fd = -1;
+int replica_stop_fd = -1;           // eventfd that stops the follower thread
+pthread_t replica_thread_id;
+int replica_thread_started = 0;
+
+// SO_REUSEPORT shards, each with its own listener and pinned acceptor thread
+struct acceptor_shard {
+    int listen_fd;
+    int cpu;
+    pthread_t thread_id;
+};
+
+struct acceptor_shard *shards = NULL;
+int shard_count = 0;
+int accept_stop_fd = -1;    // eventfd that stops every shard acceptor
 pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
 volatile int shutdown_requested = 0;
 
-// Singly linked list node for thread management
+unsigned int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+unsigned int packet_timeout = DEFAULT_PACKET_TIMEOUT;
+
+// Admission control limits, 0 means unlimited
+#define MEMORY_WAIT_TIMEOUT 5      // seconds a reader stays paused for memory
+unsigned int max_connections = 0;  // concurrent clients, refused at accept
+size_t max_client_bytes = 0;       // buffered partial packet per client
+size_t max_total_bytes = 0;        // packet buffers and responses, all clients
+
+int active_connections = 0;
+size_t buffered_bytes = 0;
+pthread_mutex_t memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t memory_cond = PTHREAD_COND_INITIALIZER;
+
+// Current tick, advanced by the main loop and read by client threads
+uint64_t server_tick = 1;
+
+// Received bytes not yet stored, always ending in a partial packet
+struct packet_buffer {
+    char *data;             // from the buffer pools, cap bytes
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * Everything one connection needs, linked into the thread list.  Nodes of
+ * finished connections are kept on a free list for the next accept.
+ */
 struct thread_node {
     pthread_t thread_id;
-    int client_fd;
+    int client_fd;          // -1 once the client thread has closed it
     int completed;
     struct thread_node *next;
+    struct sockaddr_storage client_addr;
+    struct packet_buffer pkt;
+    // Activity ticks, written by the client thread, 0 when unset
+    uint64_t last_activity;
+    uint64_t packet_start;
+    int compress;           // responses go out as deflate frames, AESDCHAR_COMPRESS
+    struct response_writer out;     // response pieces not sent yet
+    int subscribed;         // a push stream, which is idle by nature
+    // Timer wheel linkage, owned by the main loop
+    uint64_t deadline;
+    struct thread_node *wheel_next;
+    struct thread_node **wheel_pprev;
 };
 
 struct thread_node *thread_list_head = NULL;
 pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-#ifndef USE_AESD_CHAR_DEVICE
-// Timer thread data
-pthread_t timer_thread;
-#endif
+// Recycled nodes, protected by thread_list_mutex
+#define NODE_POOL_MAX 256
+struct thread_node *node_pool = NULL;
+unsigned int node_pool_count = 0;
+uint64_t node_pool_hits = 0;
+uint64_t node_pool_misses = 0;
 
-// Thread data structure for client connections
-struct thread_data {
-    int client_fd;
-    struct sockaddr_storage client_addr;
+struct thread_node *timer_wheel[TIMER_WHEEL_SLOTS];
+
+// Timestamp formatted once per tick so periodic records are a plain append
+char cached_timestamp[64];
+
+// Where packets are stored; append and snapshots are serialized by data_mutex
+struct storage *storage = NULL;
+const char *storage_name = DEFAULT_STORAGE;     // backend chosen with -S
+struct storage_config storage_config = { .data_path = FILE_DATA_PATH, .segment_size = DEFAULT_SEGMENT_SIZE };
+uint64_t append_count = 0;  // successful appends, protected by data_mutex
+
+// Echo-back copy of the stored data, protected by data_mutex
+struct response_cache response_cache = { .cap = DEFAULT_CACHE_BYTES, .generation = 1 };
+
+// Connections sent every append as it is stored, protected by data_mutex
+struct subscriber_list subscribers;
+
+/*
+ * Followers are only sent appends once they are durable, so a primary that
+ * crashes never leaves a follower holding bytes it lost.  Appends wait here
+ * tagged with the sync_begin that will cover them, and are published in
+ * order once every sync before them has finished; all protected by
+ * data_mutex.  A failed sync leaves its appends, and so every later one,
+ * unpublished.
+ */
+struct durable_pending {
+    struct data_segment *seg;
+    uint64_t sync;
+    int durable;
+    struct durable_pending *next;
 };
 
-void cleanup() {
-    syslog(LOG_INFO, "Caught signal, exiting");
-    
-    shutdown_requested = 1;
-    
-    // Close listening socket to unblock accept()
+struct subscriber_list followers;
+struct durable_pending *pending_head = NULL;
+struct durable_pending **pending_tail = &pending_head;
+off_t pending_bytes = 0;    // appended past what followers were sent
+uint64_t sync_next = 1;     // number of the next sync_begin
+
+// Compressed blocks of append-only history, shared by compressing connections
+struct compress_cache compress_cache;
+
+/*
+ * When an echo, which acknowledges the stored packets, may be sent: at once,
+ * after syncing each append, or after a commit thread has synced a batch of
+ * appends from all connections together.
+ */
+enum durability_mode {
+    DURABILITY_NONE,
+    DURABILITY_PACKET,
+    DURABILITY_GROUP,
+};
+
+#define DEFAULT_COMMIT_WINDOW_MS 2  // longest an append waits for its batch to start syncing
+
+enum durability_mode durability = DURABILITY_NONE;
+unsigned int commit_window_ms = DEFAULT_COMMIT_WINDOW_MS;
+
+// Group commit state: appends are numbered, commit_seq is the last one synced
+pthread_t commit_thread_id;
+int commit_thread_started = 0;
+pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+uint64_t append_seq = 0;
+uint64_t commit_seq = 0;
+int commit_failed = 0;      // a sync failed, nothing is acknowledged any more
+
+// Largest chunk of stored data read into one segment when echoing
+#define SEGMENT_SIZE (64 * 1024)
+
+// Stored data queued for a client before it is sent, with MSG_MORE, mid-response
+#define RESPONSE_BATCH_BYTES (4 * SEGMENT_SIZE)
+
+// Socket buffer sizes, TCP_NODELAY and MSG_ZEROCOPY, set with -T
+struct writer_config writer_config = { .nodelay = 1 };
+
+
+// Let client threads waiting for storage run, whether or not it was opened
+void storage_gate_open() {
+    pthread_mutex_lock(&storage_ready_mutex);
+    storage_ready = 1;
+    pthread_cond_broadcast(&storage_ready_cond);
+    pthread_mutex_unlock(&storage_ready_mutex);
+}
+
+// Block until storage_gate_open(); storage is NULL after if it failed to open
+void storage_gate_wait() {
+    pthread_mutex_lock(&storage_ready_mutex);
+    while (!storage_ready) {
+        pthread_cond_wait(&storage_ready_cond, &storage_ready_mutex);
+    }
+    pthread_mutex_unlock(&storage_ready_mutex);
+}
+
+/*
+ * Stop accepting.  The listeners are only closed, never shut down, since
+ * after a handoff the successor is accepting on the same sockets.
+ */
+void stop_acceptors() {
     if (sockfd != -1) {
-        shutdown(sockfd, SHUT_RDWR);
         close(sockfd);
         sockfd = -1;
     }
     
-#ifndef USE_AESD_CHAR_DEVICE
-    // Cancel timer thread
-    if (timer_thread) {
-        pthread_cancel(timer_thread);
-        pthread_join(timer_thread, NULL);
+    if (shard_count > 0) {
+        uint64_t one = 1;
+        if (write(accept_stop_fd, &one, sizeof(one)) == -1) {
+            log_msg(LOG_ERR, "Failed to stop acceptors: %s", strerror(errno));
+        }
     }
-#endif
+    for (int i = 0; i < shard_count; i++) {
+        pthread_join(shards[i].thread_id, NULL);
+        close(shards[i].listen_fd);
+    }
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+}
+
+// Connection and buffer pool counters added together
+void pool_totals(uint64_t *hits, uint64_t *misses) {
+    struct pool_stats stats;
     
-    // Wait for all client threads to complete
     pthread_mutex_lock(&thread_list_mutex);
-    struct thread_node *current = thread_list_head;
-    while (current != NULL) {
-        if (!current->completed) {
-            // Close client socket to unblock recv()
-            close(current->client_fd);
-            pthread_join(current->thread_id, NULL);
+    *hits = node_pool_hits;
+    *misses = node_pool_misses;
+    pthread_mutex_unlock(&thread_list_mutex);
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        pool_class_stats(i, &stats);
+        *hits += stats.hits;
+        *misses += stats.misses;
+    }
+}
+
+void log_pool_stats() {
+    struct pool_stats stats;
+    
+    log_msg(LOG_INFO, "Connection pool: %llu hits, %llu misses",
+            (unsigned long long)node_pool_hits, (unsigned long long)node_pool_misses);
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        pool_class_stats(i, &stats);
+        if (stats.hits + stats.misses > 0) {
+            log_msg(LOG_INFO, "Buffer pool %zu: %llu hits, %llu misses", POOL_MIN_SIZE << i,
+                    (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+        }
+    }
+}
+
+void cleanup() {
+    shutdown_requested = 1;
+    
+    stop_acceptors();
+    if (accept_stop_fd != -1) {
+        close(accept_stop_fd);
+        accept_stop_fd = -1;
+    }
+    if (upgrade_fd != -1) {
+        close(upgrade_fd);
+        upgrade_fd = -1;
+        unlink(upgrade_path);
+    }
+    if (replica_listen_fd != -1) {
+        close(replica_listen_fd);
+        replica_listen_fd = -1;
+        unlink(replica_path);
+    }
+    
+    // The follower thread stops between records, before storage goes away
+    if (replica_thread_started) {
+        uint64_t one = 1;
+        if (write(replica_stop_fd, &one, sizeof(one)) == -1) {
+            log_msg(LOG_ERR, "Failed to stop follower thread: %s", strerror(errno));
+        }
+        pthread_join(replica_thread_id, NULL);
+        replica_thread_started = 0;
+    }
+    if (replica_stop_fd != -1) {
+        close(replica_stop_fd);
+        replica_stop_fd = -1;
+    }
+    
+    if (timer_fd != -1) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    
+    // The commit thread finishes its batch and wakes any client waiting on it
+    if (commit_thread_started) {
+        pthread_mutex_lock(&commit_mutex);
+        pthread_cond_broadcast(&commit_cond);
+        pthread_mutex_unlock(&commit_mutex);
+        pthread_join(commit_thread_id, NULL);
+        commit_thread_started = 0;
+    }
+    
+    // Threads still waiting for storage find it missing and exit
+    storage_gate_open();
+    
+    // Shut down every client socket to unblock recv(), then wait for the threads
+    pthread_mutex_lock(&thread_list_mutex);
+    struct thread_node *current;
+    for (current = thread_list_head; current != NULL; current = current->next) {
+        if (current->client_fd != -1) {
+            shutdown(current->client_fd, SHUT_RDWR);
         }
+    }
+    current = thread_list_head;
+    thread_list_head = NULL;
+    pthread_mutex_unlock(&thread_list_mutex);
+    
+    while (current != NULL) {
+        pthread_join(current->thread_id, NULL);
         struct thread_node *temp = current;
         current = current->next;
         free(temp);
     }
-    thread_list_head = NULL;
-    pthread_mutex_unlock(&thread_list_mutex);
+    log_pool_stats();
+    while (node_pool != NULL) {
+        struct thread_node *temp = node_pool;
+        node_pool = node_pool->next;
+        free(temp);
+    }
+    node_pool_count = 0;
+    pool_drain();
     
-#ifndef USE_AESD_CHAR_DEVICE
-    unlink(DATA_FILE);
-#endif
+    storage_close(storage);
+    storage = NULL;
+    cache_free(&response_cache);
+    // Never synced, so never for followers
+    while (pending_head != NULL) {
+        struct durable_pending *p = pending_head;
+        pending_head = p->next;
+        segment_put(p->seg);
+        free(p);
+    }
+    pending_tail = &pending_head;
+    pending_bytes = 0;
+    if (compress_cache.hits + compress_cache.misses > 0) {
+        log_msg(LOG_INFO, "Compressed block cache: %llu hits, %llu misses",
+                (unsigned long long)compress_cache.hits, (unsigned long long)compress_cache.misses);
+    }
+    compress_cache_free(&compress_cache);
+    
+    // The successor opens the storage once it is released here
+    if (handoff_fd != -1) {
+        handoff_send_done(handoff_fd);
+        close(handoff_fd);
+        handoff_fd = -1;
+    }
+    if (predecessor_fd != -1) {
+        close(predecessor_fd);
+        predecessor_fd = -1;
+    }
+    if (drain_fd != -1) {
+        close(drain_fd);
+        drain_fd = -1;
+    }
+    if (signal_fd != -1) {
+        close(signal_fd);
+        signal_fd = -1;
+    }
     pthread_mutex_destroy(&data_mutex);
     pthread_mutex_destroy(&thread_list_mutex);
+    log_stop();
     closelog();
 }
 
-void signal_handler(int sig __attribute__((unused))) {
-    cleanup();
-    exit(0);
+// Remove a node from the timer wheel, if it is scheduled
+void wheel_cancel(struct thread_node *node) {
+    if (node->wheel_pprev == NULL) {
+        return;
+    }
+    *node->wheel_pprev = node->wheel_next;
+    if (node->wheel_next != NULL) {
+        node->wheel_next->wheel_pprev = node->wheel_pprev;
+    }
+    node->wheel_next = NULL;
+    node->wheel_pprev = NULL;
 }
 
-// Add thread to linked list
-void add_thread_to_list(pthread_t thread_id, int client_fd) {
-    struct thread_node *new_node = malloc(sizeof(struct thread_node));
-    new_node->thread_id = thread_id;
-    new_node->client_fd = client_fd;
-    new_node->completed = 0;
-    new_node->next = NULL;
+// Schedule a node to be looked at again on the given tick
+void wheel_schedule(struct thread_node *node, uint64_t deadline) {
+    struct thread_node **slot = &timer_wheel[deadline % TIMER_WHEEL_SLOTS];
+    
+    wheel_cancel(node);
+    node->deadline = deadline;
+    node->wheel_next = *slot;
+    if (*slot != NULL) {
+        (*slot)->wheel_pprev = &node->wheel_next;
+    }
+    node->wheel_pprev = slot;
+    *slot = node;
+}
+
+// Earliest tick at which a connection times out, 0 if it never does
+uint64_t connection_deadline(const struct thread_node *node) {
+    uint64_t deadline = 0;
+    uint64_t last_activity = __atomic_load_n(&node->last_activity, __ATOMIC_RELAXED);
+    uint64_t packet_start = __atomic_load_n(&node->packet_start, __ATOMIC_RELAXED);
+    
+    if (idle_timeout > 0 && !__atomic_load_n(&node->subscribed, __ATOMIC_RELAXED)) {
+        deadline = last_activity + idle_timeout / TICK_SECONDS;
+    }
+    if (packet_timeout > 0 && packet_start != 0) {
+        uint64_t packet_deadline = packet_start + packet_timeout / TICK_SECONDS;
+        if (deadline == 0 || packet_deadline < deadline) {
+            deadline = packet_deadline;
+        }
+    }
+    return deadline;
+}
+
+/*
+ * Expire the connections due on the current tick.  Client threads only
+ * record activity ticks, so a due node whose client has been active since
+ * is simply rescheduled to its new deadline rather than being moved on
+ * every recv.
+ */
+void wheel_advance(uint64_t now) {
+    struct thread_node *node;
+    
+    // Shard acceptors schedule and release nodes under the same mutex
+    pthread_mutex_lock(&thread_list_mutex);
+    node = timer_wheel[now % TIMER_WHEEL_SLOTS];
+    while (node != NULL) {
+        struct thread_node *next = node->wheel_next;
+        if (node->deadline <= now) {
+            uint64_t deadline = connection_deadline(node);
+            if (deadline == 0) {
+                wheel_cancel(node);
+            } else if (deadline > now) {
+                wheel_schedule(node, deadline);
+            } else if (!__atomic_load_n(&storage_ready, __ATOMIC_ACQUIRE)) {
+                // Clients waiting on the predecessor to drain are not idle
+                wheel_schedule(node, now + 1);
+            } else {
+                wheel_cancel(node);
+                if (node->client_fd != -1) {
+                    log_msg(LOG_INFO, "Timing out %s connection",
+                           __atomic_load_n(&node->packet_start, __ATOMIC_RELAXED) ? "stalled" : "idle");
+                    // The client thread sees EOF, closes the socket and exits
+                    shutdown(node->client_fd, SHUT_RDWR);
+                }
+            }
+        }
+        node = next;
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+}
+
+// Refresh the cached RFC 2822 timestamp record
+void update_cached_timestamp() {
+    time_t raw_time = time(NULL);
+    struct tm time_info;
+    
+    localtime_r(&raw_time, &time_info);
+    strftime(cached_timestamp, sizeof(cached_timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %Z\n", &time_info);
+}
+
+// Hold an append back from followers until it is durable, caller holds data_mutex
+static void followers_note_append(const char *buf, size_t len) {
+    if (durability == DURABILITY_NONE) {
+        subscribers_publish(&followers, buf, len);
+        return;
+    }
+    if (replica_path == NULL || len == 0) {
+        return;
+    }
+    struct durable_pending *p = malloc(sizeof(struct durable_pending));
+    struct data_segment *seg = segment_alloc(len);
+    if (p == NULL || seg == NULL) {
+        // Followers would miss these bytes; they catch up again on reconnect
+        free(p);
+        segment_put(seg);
+        subscribers_publish_segment(&followers, NULL);
+        return;
+    }
+    memcpy(seg->data, buf, len);
+    p->seg = seg;
+    p->sync = sync_next;
+    p->durable = 0;
+    p->next = NULL;
+    *pending_tail = p;
+    pending_tail = &p->next;
+    pending_bytes += len;
+}
+
+// Sync number sync finished, publish what is now durable in order
+static void followers_note_durable(uint64_t sync) {
+    if (replica_path == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&data_mutex);
+    for (struct durable_pending *p = pending_head; p != NULL; p = p->next) {
+        if (p->sync == sync) {
+            p->durable = 1;
+        }
+    }
+    while (pending_head != NULL && pending_head->durable) {
+        struct durable_pending *p = pending_head;
+        subscribers_publish_segment(&followers, p->seg);
+        pending_bytes -= p->seg->len;
+        pending_head = p->next;
+        segment_put(p->seg);
+        free(p);
+    }
+    if (pending_head == NULL) {
+        pending_tail = &pending_head;
+    }
+    pthread_mutex_unlock(&data_mutex);
+}
+
+// Store bytes and keep the response cache in step, caller holds data_mutex
+int storage_append(const char *buf, size_t len) {
+    TRACE1(append_start, len);
+    int rc = storage->ops->append(storage, buf, len);
+    TRACE2(append_done, len, rc);
+    if (rc == -1) {
+        // A ring may have taken part of it
+        cache_invalidate(&response_cache);
+        return -1;
+    }
+    cache_note_append(&response_cache, storage, buf, len);
+    subscribers_publish(&subscribers, buf, len);
+    followers_note_append(buf, len);
+    append_count++;
+    return 0;
+}
+
+// Carry the log on at offset past its end, caller holds data_mutex
+static int storage_skip(off_t offset) {
+    if (storage->ops->skip(storage, offset) == -1) {
+        return -1;
+    }
+    cache_invalidate(&response_cache);
+    return 0;
+}
+
+// Store bytes a client sent, which a follower only takes from its primary
+int client_append(const char *buf, size_t len) {
+    if (replicate_from != NULL) {
+        log_msg(LOG_WARNING, "Refusing write, this server follows %s", replicate_from);
+        errno = EROFS;
+        return -1;
+    }
+    return storage_append(buf, len);
+}
+
+// Append the cached timestamp record to the storage
+void write_timestamp() {
+    pthread_mutex_lock(&data_mutex);
+    if (storage_append(cached_timestamp, strlen(cached_timestamp)) == -1) {
+        log_msg(LOG_ERR, "Failed to write timestamp");
+    }
+    pthread_mutex_unlock(&data_mutex);
+}
+
+// Handle a timerfd expiry: advance the wheel and emit periodic records
+void handle_timer_tick() {
+    uint64_t expirations;
+    
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    
+    while (expirations-- > 0) {
+        uint64_t now = __atomic_add_fetch(&server_tick, 1, __ATOMIC_RELAXED);
+        wheel_advance(now);
+        // A follower stores the primary's timestamps instead
+        if (storage != NULL && storage->ops->timestamps && replicate_from == NULL && now % (TIMESTAMP_INTERVAL / TICK_SECONDS) == 0) {
+            update_cached_timestamp();
+            write_timestamp();
+        }
+    }
+}
+
+// Return a reaped node to the pool, caller holds thread_list_mutex
+void node_release(struct thread_node *node) {
+    if (node_pool_count >= NODE_POOL_MAX) {
+        free(node);
+        return;
+    }
+    node->next = node_pool;
+    node_pool = node;
+    node_pool_count++;
+}
+
+// Add thread to linked list, taking its node from the pool when there is one
+struct thread_node *add_thread_to_list(int client_fd, const struct sockaddr_storage *client_addr) {
+    struct thread_node *new_node;
     
     pthread_mutex_lock(&thread_list_mutex);
+    if (node_pool != NULL) {
+        new_node = node_pool;
+        node_pool = new_node->next;
+        node_pool_count--;
+        node_pool_hits++;
+        memset(new_node, 0, sizeof(struct thread_node));
+    } else {
+        node_pool_misses++;
+        new_node = calloc(1, sizeof(struct thread_node));
+        if (new_node == NULL) {
+            pthread_mutex_unlock(&thread_list_mutex);
+            return NULL;
+        }
+    }
+    new_node->client_fd = client_fd;
+    new_node->client_addr = *client_addr;
+    new_node->last_activity = __atomic_load_n(&server_tick, __ATOMIC_RELAXED);
+    
     if (thread_list_head == NULL) {
         thread_list_head = new_node;
     } else {
         new_node->next = thread_list_head;
         thread_list_head = new_node;
     }
+    uint64_t deadline = connection_deadline(new_node);
+    if (deadline != 0) {
+        wheel_schedule(new_node, deadline);
+    }
     pthread_mutex_unlock(&thread_list_mutex);
+    return new_node;
 }
 
-// Mark thread as completed
-void mark_thread_completed(pthread_t thread_id) {
+// Close the client socket and mark the thread as completed
+void finish_client(struct thread_node *node) {
+    writer_release(&node->out);
     pthread_mutex_lock(&thread_list_mutex);
-    struct thread_node *current = thread_list_head;
-    while (current != NULL) {
-        if (pthread_equal(current->thread_id, thread_id)) {
-            current->completed = 1;
-            break;
+    int client_fd = node->client_fd;
+    node->client_fd = -1;
+    node->completed = 1;
+    pthread_mutex_unlock(&thread_list_mutex);
+    close(client_fd);
+    // The last connection out of a draining server lets it exit without waiting for a tick
+    if (__atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED) == 0 && draining && drain_fd != -1) {
+        uint64_t one = 1;
+        if (write(drain_fd, &one, sizeof(one)) == -1) {
+            log_msg(LOG_ERR, "Failed to signal drain: %s", strerror(errno));
         }
-        current = current->next;
     }
-    pthread_mutex_unlock(&thread_list_mutex);
 }
 
 // Clean up completed threads
@@ -155,6 +705,7 @@ void cleanup_completed_threads() {
     while (current != NULL) {
         if (current->completed) {
             pthread_join(current->thread_id, NULL);
+            wheel_cancel(current);
             
             if (prev == NULL) {
                 thread_list_head = current->next;
@@ -164,7 +715,7 @@ void cleanup_completed_threads() {
             
             struct thread_node *temp = current;
             current = current->next;
-            free(temp);
+            node_release(temp);
         } else {
             prev = current;
             current = current->next;
@@ -173,341 +724,1751 @@ void cleanup_completed_threads() {
     pthread_mutex_unlock(&thread_list_mutex);
 }
 
-#ifdef USE_AESD_CHAR_DEVICE
-// Parse AESDCHAR_IOCSEEKTO command
-int parse_seekto_command(const char* buffer, int buffer_len, uint32_t* write_cmd, uint32_t* write_cmd_offset) {
-    const char* prefix = "AESDCHAR_IOCSEEKTO:";
-    const int prefix_len = strlen(prefix);
-    
-    // Check if buffer starts with the prefix and ends with newline
-    if (buffer_len < prefix_len + 3 || strncmp(buffer, prefix, prefix_len) != 0) {
-        return 0; // Not a seek command
+// Text commands handled in place of storing the line
+// Snapshot of what a text command reads, caller holds data_mutex
+int command_snapshot(enum text_command cmd, unsigned long long x, unsigned long long y,
+                     struct storage_snapshot *snap) {
+    switch (cmd) {
+    case TEXT_SEEKTO:
+        return storage->ops->seek_snapshot(storage, x, y, snap);
+    case TEXT_READ:
+        return storage_range_snapshot(storage, x > INT64_MAX ? INT64_MAX : x, y > INT64_MAX ? INT64_MAX : y, snap);
+    case TEXT_READPACKETS:
+        return storage_packet_snapshot(storage, x, y, snap);
+    default:
+        errno = EINVAL;
+        return -1;
     }
+}
+
+/*
+ * Account for bytes of buffered memory.  When the server-wide cap is hit the
+ * caller is paused, which stops it reading from its socket and pushes back on
+ * that client, until other connections release memory.  A caller still
+ * paused after MEMORY_WAIT_TIMEOUT is shed by its caller.
+ */
+int memory_reserve(size_t bytes) {
+    struct timespec deadline;
+    int rc = 0;
     
-    // Find the comma separator
-    const char* comma = strchr(buffer + prefix_len, ',');
-    if (comma == NULL) {
-        return 0; // Invalid format
+    pthread_mutex_lock(&memory_mutex);
+    if (max_total_bytes != 0 && buffered_bytes + bytes > max_total_bytes) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += MEMORY_WAIT_TIMEOUT;
+        while (buffered_bytes + bytes > max_total_bytes && rc == 0) {
+            if (bytes > max_total_bytes || shutdown_requested) {
+                rc = -1;
+                break;
+            }
+            if (pthread_cond_timedwait(&memory_cond, &memory_mutex, &deadline) == ETIMEDOUT) {
+                rc = -1;
+            }
+        }
     }
-    
-    // Find the newline
-    const char* newline = strchr(comma, '\n');
-    if (newline == NULL) {
-        return 0; // Invalid format
+    if (rc == 0) {
+        buffered_bytes += bytes;
     }
+    pthread_mutex_unlock(&memory_mutex);
+    return rc;
+}
+
+void memory_release(size_t bytes) {
+    pthread_mutex_lock(&memory_mutex);
+    buffered_bytes -= bytes;
+    pthread_mutex_unlock(&memory_mutex);
+    pthread_cond_broadcast(&memory_cond);
+}
+
+/*
+ * Make everything appended so far durable, called with data_mutex held and
+ * returning with it released so the sync itself runs without the lock.
+ */
+int sync_and_unlock() {
+    void *handle;
+    uint64_t sync = sync_next++;
     
-    // Parse X value (write_cmd)
-    char x_str[32];
-    int x_len = comma - (buffer + prefix_len);
-    if (x_len >= sizeof(x_str)) {
-        return 0; // Too long
+    if (storage->ops->sync_begin(storage, &handle) == -1) {
+        pthread_mutex_unlock(&data_mutex);
+        return -1;
     }
-    strncpy(x_str, buffer + prefix_len, x_len);
-    x_str[x_len] = '\0';
-    
-    // Parse Y value (write_cmd_offset)
-    char y_str[32];
-    int y_len = newline - (comma + 1);
-    if (y_len >= sizeof(y_str)) {
-        return 0; // Too long
+    pthread_mutex_unlock(&data_mutex);
+    if (storage->ops->sync_finish(storage, handle) == -1) {
+        return -1;
     }
-    strncpy(y_str, comma + 1, y_len);
-    y_str[y_len] = '\0';
-    
-    // Convert to integers
-    char* endptr;
-    *write_cmd = strtoul(x_str, &endptr, 10);
-    if (*endptr != '\0') {
-        return 0; // Invalid number
+    followers_note_durable(sync);
+    return 0;
+}
+
+// Number an append for group commit, caller holds data_mutex
+uint64_t commit_enqueue() {
+    pthread_mutex_lock(&commit_mutex);
+    uint64_t seq = ++append_seq;
+    if (seq == commit_seq + 1) {
+        // First append of a batch starts the commit window
+        pthread_cond_broadcast(&commit_cond);
     }
+    pthread_mutex_unlock(&commit_mutex);
+    return seq;
+}
+
+// Wait until the batch holding append seq is durable
+int commit_wait(uint64_t seq) {
+    int rc = 0;
     
-    *write_cmd_offset = strtoul(y_str, &endptr, 10);
-    if (*endptr != '\0') {
-        return 0; // Invalid number
+    pthread_mutex_lock(&commit_mutex);
+    while (commit_seq < seq && !commit_failed && !shutdown_requested) {
+        pthread_cond_wait(&commit_cond, &commit_mutex);
     }
-    
-    return 1; // Successfully parsed
+    if (commit_seq < seq || commit_failed) {
+        rc = -1;
+    }
+    pthread_mutex_unlock(&commit_mutex);
+    return rc;
 }
-#endif
 
-#ifndef USE_AESD_CHAR_DEVICE
-// Timer thread function
-void* timer_thread_func(void *arg __attribute__((unused))) {
-    struct timespec ts;
-    ts.tv_sec = TIMESTAMP_INTERVAL;
-    ts.tv_nsec = 0;
-    
-    while (!shutdown_requested) {
-        nanosleep(&ts, NULL);
-        
-        if (shutdown_requested) {
-            break;
+/*
+ * Group commit: once an append is pending, let others join it for up to
+ * commit_window_ms, then sync them all with one fdatasync.  Appends arriving
+ * during the sync form the next batch.  A failed sync leaves the file in an
+ * unknown state, so it stops all further acknowledgements rather than retry.
+ */
+void* commit_thread_func(void *arg __attribute__((unused))) {
+    pthread_mutex_lock(&commit_mutex);
+    while (!shutdown_requested && !commit_failed) {
+        if (append_seq == commit_seq) {
+            pthread_cond_wait(&commit_cond, &commit_mutex);
+            continue;
         }
         
-        // Get current time and format timestamp
-        time_t raw_time;
-        struct tm *time_info;
-        char timestamp[256];
-        
-        time(&raw_time);
-        time_info = localtime(&raw_time);
-        
-        // RFC 2822 compliant format: "timestamp:Sun, 06 Nov 1994 08:49:37 GMT"
-        strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %Z\n", time_info);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)commit_window_ms * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (!shutdown_requested &&
+               pthread_cond_timedwait(&commit_cond, &commit_mutex, &deadline) != ETIMEDOUT) {
+        }
+        pthread_mutex_unlock(&commit_mutex);
         
-        // Write timestamp to file with mutex protection
         pthread_mutex_lock(&data_mutex);
-        int fd = open(DATA_FILE, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if (fd != -1) {
-            write(fd, timestamp, strlen(timestamp));
-            close(fd);
+        pthread_mutex_lock(&commit_mutex);
+        uint64_t batch = append_seq;
+        pthread_mutex_unlock(&commit_mutex);
+        int rc = sync_and_unlock();
+        
+        pthread_mutex_lock(&commit_mutex);
+        if (rc == -1) {
+            log_msg(LOG_ERR, "Group commit failed, no longer acknowledging packets");
+            commit_failed = 1;
+        } else {
+            commit_seq = batch;
         }
-        pthread_mutex_unlock(&data_mutex);
+        pthread_cond_broadcast(&commit_cond);
     }
-    
+    pthread_mutex_unlock(&commit_mutex);
     return NULL;
 }
-#endif
 
-// Client thread function with proper file descriptor management
-void* client_thread_func(void *arg) {
-    struct thread_data *data = (struct thread_data*)arg;
-    int client_fd = data->client_fd;
-    struct sockaddr_storage client_addr = data->client_addr;
-    free(data);
-    
-    char client_ip[INET6_ADDRSTRLEN];
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    
-    // Get client IP for logging
-    inet_ntop(client_addr.ss_family,
-              (client_addr.ss_family == AF_INET) ? 
-                  (void *)&(((struct sockaddr_in *)&client_addr)->sin_addr) : 
-                  (void *)&(((struct sockaddr_in6 *)&client_addr)->sin6_addr),
-              client_ip, sizeof client_ip);
-    
-    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+// Record client activity so the timer wheel does not expire the connection
+void touch_connection(struct thread_node *node) {
+    __atomic_store_n(&node->last_activity, __atomic_load_n(&server_tick, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+/*
+ * Send what is queued for the client with non-blocking sends, more being
+ * set while the response goes on.  When the client's receive window is
+ * full only this connection waits for it, and a client that stops reading
+ * for longer than the idle timeout is dropped.
+ */
+int response_flush(struct thread_node *node, int more) {
+    struct response_writer *out = &node->out;
+    size_t len = writer_queued(out);
+    int timeout_ms = idle_timeout > 0 ? (int)idle_timeout * 1000 : -1;
     
-    while (!shutdown_requested && (bytes_received = recv(client_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-        int data_fd = -1;  // Initialize to -1
-        
-        pthread_mutex_lock(&data_mutex);
-        
-#ifdef USE_AESD_CHAR_DEVICE
-        // Check if this is a seek command
-        uint32_t write_cmd, write_cmd_offset;
-        if (parse_seekto_command(buffer, bytes_received, &write_cmd, &write_cmd_offset)) {
-            // This is a seek command - handle it specially
-            data_fd = open(DATA_FILE, O_RDWR);
-            if (data_fd == -1) {
-                syslog(LOG_ERR, "Failed to open data file for seek: %s", strerror(errno));
-                pthread_mutex_unlock(&data_mutex);
-                close(client_fd);
-                mark_thread_completed(pthread_self());
-                return NULL;
-            }
-            
-            // Perform the ioctl seek operation
-            struct aesd_seekto seekto;
-            seekto.write_cmd = write_cmd;
-            seekto.write_cmd_offset = write_cmd_offset;
-            
-            if (ioctl(data_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
-                syslog(LOG_ERR, "IOCTL seek failed: %s", strerror(errno));
-                close(data_fd);
-                pthread_mutex_unlock(&data_mutex);
-                close(client_fd);
-                mark_thread_completed(pthread_self());
-                return NULL;
+    if (len == 0) {
+        return 0;
+    }
+    TRACE2(send_start, out->fd, len);
+    while (writer_queued(out) > 0) {
+        ssize_t n = writer_send(out, more);
+        if (n > 0) {
+            touch_connection(node);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = out->fd, .events = POLLOUT };
+            int rc = poll(&pfd, 1, timeout_ms);
+            if (rc == 0) {
+                log_msg(LOG_INFO, "Dropping client that stopped reading its response");
+                return -1;
             }
-            
-            // Read from current position and send back to client
-            char read_buffer[BUFFER_SIZE];
-            ssize_t read_bytes;
-            while ((read_bytes = read(data_fd, read_buffer, BUFFER_SIZE)) > 0) {
-                if (send(client_fd, read_buffer, read_bytes, 0) == -1) {
-                    syslog(LOG_ERR, "Send failed after seek: %s", strerror(errno));
-                    close(data_fd);
-                    pthread_mutex_unlock(&data_mutex);
-                    close(client_fd);
-                    mark_thread_completed(pthread_self());
-                    return NULL;
-                }
+            if (rc == -1 && errno != EINTR) {
+                log_msg(LOG_ERR, "Poll failed: %s", strerror(errno));
+                return -1;
             }
-            
-            // Close immediately after use
-            close(data_fd);
-            pthread_mutex_unlock(&data_mutex);
-            continue; // Don't process this as a regular write
+            continue;
         }
-        
-        // Regular write processing - open device file ONLY when needed
-        data_fd = open(DATA_FILE, O_RDWR);
-#else
-        data_fd = open(DATA_FILE, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-#endif
-        if (data_fd == -1) {
-            syslog(LOG_ERR, "Failed to open data file: %s", strerror(errno));
-            pthread_mutex_unlock(&data_mutex);
-            close(client_fd);
-            mark_thread_completed(pthread_self());
-            return NULL;
+        log_msg(LOG_ERR, "Send failed: %s", strerror(errno));
+        return -1;
+    }
+    TRACE2(send_done, out->fd, len);
+    if (out->zc_count > 0 && writer_reap(out) == -1) {
+        log_msg(LOG_ERR, "Reading zerocopy completions failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Queue part of a response, referencing seg when data lies in it and
+ * copying it otherwise.  A full queue is sent to make room, and a piece
+ * too large to copy is sent straight from data.
+ */
+int response_add(struct thread_node *node, const char *data, size_t len, struct data_segment *seg) {
+    struct response_writer *out = &node->out;
+    
+    while (writer_add(out, data, len, seg) == -1) {
+        if (writer_queued(out) == 0) {
+            writer_borrow(out, data, len);
+            return response_flush(node, 1);
         }
+        if (response_flush(node, 1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Send the rest of a response and let TCP_NODELAY push it out
+int response_end(struct thread_node *node) {
+    if (writer_queued(&node->out) == 0) {
+        writer_uncork(&node->out);
+        return 0;
+    }
+    return response_flush(node, 0);
+}
+
+/*
+ * Stream a snapshot to the client a batch of segments at a time, without
+ * data_mutex, copying what is sent into fill when the response cache
+ * missed.  Queued segments stay reserved until they have been sent.
+ */
+int send_snapshot(int client_fd, struct thread_node *node, struct storage_snapshot *snap, struct cache_fill *fill) {
+    size_t reserved = 0;
+    int rc = 0;
+    
+    while (rc == 0 && (snap->size == -1 || snap->offset < snap->size)) {
+        size_t want = SEGMENT_SIZE;
+        if (snap->size != -1 && (off_t)want > snap->size - snap->offset) {
+            want = snap->size - snap->offset;
+        }
+        
+        if (memory_reserve(want) == -1) {
+            log_msg(LOG_WARNING, "Dropping response: server buffer memory exhausted");
+            rc = -1;
+            break;
+        }
+        reserved += want;
+        struct data_segment *seg = segment_alloc(want);
+        if (seg == NULL) {
+            log_msg(LOG_ERR, "Out of memory for response");
+            rc = -1;
+            break;
+        }
+        TRACE1(read_start, want);
+        ssize_t n = storage->ops->snapshot_read(storage, snap, seg->data, want);
+        TRACE1(read_done, n);
+        if (n <= 0) {
+            if (n == -1) {
+                log_msg(LOG_ERR, "Read failed: %s", strerror(errno));
+                rc = -1;
+            }
+            segment_put(seg);
+            break;
+        }
+        seg->len = n;
+        
+        cache_fill_add(&response_cache, fill, seg->data, n);
+        rc = response_add(node, seg->data, seg->len, seg);
+        segment_put(seg);
+        if (rc == 0 && writer_queued(&node->out) >= RESPONSE_BATCH_BYTES) {
+            rc = response_flush(node, 1);
+            memory_release(reserved);
+            reserved = 0;
+        }
+    }
+    if (rc == 0 && reserved > 0) {
+        rc = response_flush(node, 1);
+    }
+    memory_release(reserved);
+    return rc;
+}
+
+/*
+ * Stream a snapshot as deflate frames cut at COMPRESS_BLOCK boundaries of
+ * the storage offsets.  Complete blocks of append-only storage are taken
+ * from the shared cache when another response already compressed them.
+ */
+int send_compressed(int client_fd, struct thread_node *node, struct storage_snapshot *snap) {
+    static const char end_marker[COMPRESS_FRAME_HEADER];
+    size_t batch_reserved = 0;
+    
+    while (snap->offset < snap->size) {
+        uint64_t block = snap->offset / COMPRESS_BLOCK;
+        off_t block_end = (off_t)(block + 1) * COMPRESS_BLOCK;
+        int whole = storage->ops->append_only && snap->offset % COMPRESS_BLOCK == 0 && block_end <= snap->size;
+        size_t want = (block_end < snap->size ? block_end : snap->size) - snap->offset;
+        size_t reserved = want + compress_frame_bound(want);
         
-        // Write all received bytes to device/file
-        ssize_t total_written = 0;
-        while (total_written < bytes_received) {
-            ssize_t bytes_written = write(data_fd, buffer + total_written, bytes_received - total_written);
-            if (bytes_written == -1) {
-                if (errno == EINTR) {
-                    continue;
+        struct data_segment *frame = whole ? compress_cache_get(&compress_cache, block) : NULL;
+        if (frame != NULL) {
+            // The frame holds these bytes, reading them would be wasted
+            snap->offset += want;
+            reserved = 0;
+        } else {
+            if (memory_reserve(reserved) == -1) {
+                log_msg(LOG_WARNING, "Dropping response: server buffer memory exhausted");
+                memory_release(batch_reserved);
+                return -1;
+            }
+            struct data_segment *raw = segment_alloc(want);
+            size_t got = 0;
+            ssize_t n = 1;
+            while (raw != NULL && got < want && n > 0) {
+                n = storage->ops->snapshot_read(storage, snap, raw->data + got, want - got);
+                got += n > 0 ? n : 0;
+            }
+            if (raw == NULL || n == -1) {
+                log_msg(LOG_ERR, "Read failed: %s", raw == NULL ? "out of memory" : strerror(errno));
+                segment_put(raw);
+                memory_release(reserved + batch_reserved);
+                return -1;
+            }
+            frame = compress_frame(raw->data, got);
+            segment_put(raw);
+            if (frame == NULL) {
+                log_msg(LOG_ERR, "Compression failed");
+                memory_release(reserved + batch_reserved);
+                return -1;
+            }
+            if (whole && got == want) {
+                compress_cache_put(&compress_cache, block, frame);
+            }
+            if (got < want) {
+                // The snapshot ended early, finish the response with what there was
+                snap->size = snap->offset;
+            }
+        }
+        int rc = response_add(node, frame->data, frame->len, frame);
+        segment_put(frame);
+        batch_reserved += reserved;
+        if (rc == 0 && writer_queued(&node->out) >= RESPONSE_BATCH_BYTES) {
+            rc = response_flush(node, 1);
+            memory_release(batch_reserved);
+            batch_reserved = 0;
+        }
+        if (rc == -1) {
+            memory_release(batch_reserved);
+            return -1;
+        }
+    }
+    int rc = response_add(node, end_marker, sizeof(end_marker), NULL);
+    if (rc == 0 && batch_reserved > 0) {
+        rc = response_flush(node, 1);
+    }
+    memory_release(batch_reserved);
+    return rc;
+}
+
+/*
+ * Make room for at least one more recv into the packet buffer, growing it
+ * within the per-client and server-wide limits.  Returns the reason the
+ * connection has to be shed, or NULL on success.
+ */
+const char *packet_buffer_reserve(struct packet_buffer *pkt) {
+    // Leave room for a terminating NUL after the received bytes
+    if (pkt->cap - pkt->len > BUFFER_SIZE) {
+        return NULL;
+    }
+    if (max_client_bytes != 0 && pkt->len >= max_client_bytes) {
+        return "packet exceeds per-client limit";
+    }
+    
+    size_t new_cap = pkt->cap ? pkt->cap * 2 : 2 * BUFFER_SIZE;
+    if (memory_reserve(new_cap - pkt->cap) == -1) {
+        return "server buffer memory exhausted";
+    }
+    char *data = pool_alloc(new_cap);
+    if (data == NULL) {
+        memory_release(new_cap - pkt->cap);
+        return "out of memory";
+    }
+    if (pkt->len > 0) {
+        memcpy(data, pkt->data, pkt->len);
+    }
+    pool_free(pkt->data, pkt->cap);
+    pkt->data = data;
+    pkt->cap = new_cap;
+    return NULL;
+}
+
+// Drop consumed bytes, shrinking a buffer grown by a large packet
+void packet_buffer_consume(struct packet_buffer *pkt, size_t consumed) {
+    memmove(pkt->data, pkt->data + consumed, pkt->len - consumed);
+    pkt->len -= consumed;
+    
+    if (pkt->cap > 8 * BUFFER_SIZE && pkt->len < BUFFER_SIZE) {
+        char *data = pool_alloc(2 * BUFFER_SIZE);
+        if (data != NULL) {
+            memcpy(data, pkt->data, pkt->len);
+            pool_free(pkt->data, pkt->cap);
+            memory_release(pkt->cap - 2 * BUFFER_SIZE);
+            pkt->data = data;
+            pkt->cap = 2 * BUFFER_SIZE;
+        }
+    }
+}
+
+void packet_buffer_free(struct packet_buffer *pkt) {
+    pool_free(pkt->data, pkt->cap);
+    memory_release(pkt->cap);
+    pkt->data = NULL;
+    pkt->len = pkt->cap = 0;
+}
+
+// Release data_mutex once everything appended under it is durable
+int unlock_durable() {
+    if (durability == DURABILITY_PACKET) {
+        return sync_and_unlock();
+    }
+    if (durability == DURABILITY_GROUP) {
+        uint64_t seq = commit_enqueue();
+        pthread_mutex_unlock(&data_mutex);
+        return commit_wait(seq);
+    }
+    pthread_mutex_unlock(&data_mutex);
+    return 0;
+}
+
+/*
+ * Store every complete packet in the buffer and echo the stored data back.
+ * Runs of ordinary packets are appended together so each one lands whole in
+ * the storage, then echoed once.  Returns 1 when AESDCHAR_SUBSCRIBE turned
+ * the connection into a push stream.
+ */
+int process_packets(int client_fd, struct thread_node *node, struct packet_buffer *pkt, size_t complete) {
+    struct scan_lines lines;
+    size_t start = 0;
+    int rc = 0;
+    
+    scan_lines_init(&lines, pkt->data, complete);
+    while (rc == 0 && start < complete) {
+        struct storage_snapshot snap = { .offset = 0, .size = -1, .fd = -1, .priv = NULL };
+        struct cache_view view = { .seg = NULL };
+        struct cache_fill fill = { .active = 0 };
+        int have_snapshot = 0;
+        unsigned long long x, y;
+        int appended = 0;
+        size_t end = scan_lines_next(&lines);
+        
+        enum text_command cmd = parse_text_command(pkt->data + start, end - start, &x, &y);
+        if (cmd == TEXT_SUBSCRIBE) {
+            // Whatever follows the command is not read
+            return response_end(node) == -1 ? -1 : 1;
+        }
+        if (cmd == TEXT_COMPRESS) {
+            // Switch this connection's responses, acknowledged uncompressed
+            node->compress = x != 0;
+            const char *ack = node->compress ? "AESDCHAR_COMPRESS:deflate\n" : "AESDCHAR_COMPRESS:none\n";
+            rc = response_add(node, ack, strlen(ack), NULL);
+            start = end;
+            continue;
+        }
+        
+        // Only the append and the snapshot happen under the lock; compressed
+        // responses are built from storage and the compressed block cache
+        TRACE1(lock_wait, client_fd);
+        pthread_mutex_lock(&data_mutex);
+        TRACE1(lock_acquired, client_fd);
+        
+        // Check if this is a seek or read command
+        if (cmd != TEXT_PACKET) {
+            // Echo only what the command names, don't store it
+            rc = command_snapshot(cmd, x, y, &snap);
+            if (rc == -1) {
+                log_msg(LOG_ERR, "Read of %llu,%llu failed: %s", x, y, strerror(errno));
+            } else {
+                have_snapshot = 1;
+                if (!node->compress) {
+                    cache_lookup_range(&response_cache, &snap, &view);
                 }
-                syslog(LOG_ERR, "Write failed: %s", strerror(errno));
-                close(data_fd);
-                pthread_mutex_unlock(&data_mutex);
-                close(client_fd);
-                mark_thread_completed(pthread_self());
-                return NULL;
             }
-            total_written += bytes_written;
+        } else {
+            // Extend the run up to the next command
+            while (end < complete) {
+                size_t next = scan_lines_peek(&lines);
+                if (parse_text_command(pkt->data + end, next - end, &x, &y) != TEXT_PACKET) {
+                    break;
+                }
+                scan_lines_next(&lines);
+                end = next;
+            }
+            rc = client_append(pkt->data + start, end - start);
+            appended = rc == 0;
+            // Send entire content back to client, from the cache if it is current
+            if (rc == 0 && (node->compress || !cache_lookup_all(&response_cache, storage, &view))) {
+                rc = storage->ops->snapshot(storage, &snap);
+                if (rc == 0) {
+                    have_snapshot = 1;
+                    if (!node->compress) {
+                        cache_fill_begin(&response_cache, &snap, &fill);
+                    }
+                }
+            }
+        }
+        
+        // The echo acknowledges the packets, so it waits until they are durable
+        int respond = rc == 0;
+        if (respond && appended) {
+            rc = unlock_durable();
+        } else {
+            pthread_mutex_unlock(&data_mutex);
+        }
+        if (rc == -1 && respond) {
+            log_msg(LOG_ERR, "Packets not made durable, dropping connection");
+        }
+        
+        if (view.seg != NULL) {
+            if (rc == 0) {
+                rc = response_add(node, view.data, view.len, view.seg);
+            }
+            cache_view_release(&view);
+        } else if (have_snapshot && rc == 0) {
+            rc = node->compress ? send_compressed(client_fd, node, &snap) : send_snapshot(client_fd, node, &snap, &fill);
+        }
+        if (have_snapshot) {
+            storage->ops->snapshot_release(storage, &snap);
+        }
+        if (fill.active && rc == 0) {
+            pthread_mutex_lock(&data_mutex);
+            cache_fill_commit(&response_cache, &fill);
+            pthread_mutex_unlock(&data_mutex);
+        }
+        cache_fill_abandon(&fill);
+        TRACE2(packets_done, client_fd, end - start);
+        start = end;
+    }
+    // The echoes of every run in this read leave together
+    if (rc == 0) {
+        rc = response_end(node);
+    }
+    return rc;
+}
+
+// Longest run of appends stored under one lock hold and acknowledged together
+#define FRAME_BATCH 64
+
+// Answer a request with a header and a payload of at most BINPROTO_STATS_LEN bytes
+int frame_reply(int client_fd, struct thread_node *node, const struct binproto_header *req,
+                uint8_t status, const char *payload, uint32_t len) {
+    char reply[BINPROTO_HEADER_LEN + BINPROTO_STATS_LEN];
+    struct binproto_header hdr = { .length = len, .id = req->id, .opcode = req->opcode, .status = status };
+    
+    binproto_encode_header(reply, &hdr);
+    if (len > 0) {
+        memcpy(reply + BINPROTO_HEADER_LEN, payload, len);
+    }
+    return response_add(node, reply, BINPROTO_HEADER_LEN + len, NULL);
+}
+
+/*
+ * Store the run of complete APPEND frames at the start of data and
+ * acknowledge them together once they are durable.  Returns the bytes the
+ * run took, -1 if the connection has to be dropped.
+ */
+ssize_t frame_append_run(int client_fd, struct thread_node *node, const char *data, size_t len) {
+    char replies[FRAME_BATCH * BINPROTO_HEADER_LEN];
+    struct binproto_header hdr;
+    size_t pos = 0;
+    int count = 0;
+    int appended = 0;
+    
+    TRACE1(lock_wait, client_fd);
+    pthread_mutex_lock(&data_mutex);
+    TRACE1(lock_acquired, client_fd);
+    while (count < FRAME_BATCH && len - pos >= BINPROTO_HEADER_LEN) {
+        binproto_decode_header(data + pos, &hdr);
+        if (hdr.opcode != BINPROTO_APPEND || len - pos - BINPROTO_HEADER_LEN < hdr.length) {
+            break;
+        }
+        hdr.status = BINPROTO_OK;
+        if (hdr.length > 0) {
+            if (client_append(data + pos + BINPROTO_HEADER_LEN, hdr.length) == 0) {
+                appended = 1;
+            } else {
+                hdr.status = BINPROTO_FAILED;
+            }
+        }
+        pos += BINPROTO_HEADER_LEN + hdr.length;
+        hdr.length = 0;
+        binproto_encode_header(replies + count++ * BINPROTO_HEADER_LEN, &hdr);
+    }
+    
+    int rc = 0;
+    if (appended) {
+        rc = unlock_durable();
+    } else {
+        pthread_mutex_unlock(&data_mutex);
+    }
+    if (rc == -1) {
+        log_msg(LOG_ERR, "Packets not made durable, dropping connection");
+        return -1;
+    }
+    if (response_add(node, replies, count * BINPROTO_HEADER_LEN, NULL) == -1) {
+        return -1;
+    }
+    return pos;
+}
+
+// Clamp a u64 from the wire to an offset the storage can take
+static off_t frame_offset(const char *buf) {
+    uint64_t value = binproto_get_u64(buf);
+    
+    return value > INT64_MAX ? INT64_MAX : (off_t)value;
+}
+
+// Answer a READ, SEEK or READ_PACKETS request with the stored bytes it names
+int frame_read(int client_fd, struct thread_node *node, const struct binproto_header *req, const char *payload) {
+    struct storage_snapshot snap = { .offset = 0, .size = -1, .fd = -1, .priv = NULL };
+    struct cache_view view = { .seg = NULL };
+    int rc;
+    
+    if (req->opcode == BINPROTO_READ && req->length == 16) {
+        pthread_mutex_lock(&data_mutex);
+        rc = storage_range_snapshot(storage, frame_offset(payload), frame_offset(payload + 8), &snap);
+    } else if (req->opcode == BINPROTO_SEEK && req->length == 8) {
+        pthread_mutex_lock(&data_mutex);
+        rc = storage->ops->seek_snapshot(storage, binproto_get_u32(payload), binproto_get_u32(payload + 4), &snap);
+    } else if (req->opcode == BINPROTO_READ_PACKETS && req->length == 8) {
+        pthread_mutex_lock(&data_mutex);
+        rc = storage_packet_snapshot(storage, binproto_get_u32(payload), binproto_get_u32(payload + 4), &snap);
+    } else {
+        return frame_reply(client_fd, node, req, BINPROTO_BAD_REQUEST, NULL, 0);
+    }
+    if (rc == 0 && snap.size == -1) {
+        storage->ops->snapshot_release(storage, &snap);
+        rc = -1;
+    }
+    if (rc == 0) {
+        cache_lookup_range(&response_cache, &snap, &view);
+    }
+    pthread_mutex_unlock(&data_mutex);
+    if (rc == -1) {
+        return frame_reply(client_fd, node, req, BINPROTO_FAILED, NULL, 0);
+    }
+    
+    // The length field is 32 bits, longer ranges are cut short
+    if (snap.size - snap.offset > UINT32_MAX) {
+        snap.size = snap.offset + UINT32_MAX;
+    }
+    struct binproto_header hdr = {
+        .length = snap.size - snap.offset,
+        .id = req->id,
+        .opcode = req->opcode,
+        .status = BINPROTO_OK,
+    };
+    char header[BINPROTO_HEADER_LEN];
+    binproto_encode_header(header, &hdr);
+    rc = response_add(node, header, sizeof(header), NULL);
+    if (view.seg != NULL) {
+        if (rc == 0) {
+            rc = response_add(node, view.data, hdr.length, view.seg);
+        }
+        cache_view_release(&view);
+    } else if (rc == 0) {
+        struct cache_fill fill = { .active = 0 };
+        rc = send_snapshot(client_fd, node, &snap, &fill);
+        // A short read would leave the client waiting for bytes that never come
+        if (rc == 0 && snap.offset < snap.size) {
+            log_msg(LOG_ERR, "Stored data ended early, dropping connection");
+            rc = -1;
+        }
+    }
+    storage->ops->snapshot_release(storage, &snap);
+    return rc;
+}
+
+int frame_stats(int client_fd, struct thread_node *node, const struct binproto_header *req) {
+    struct binproto_stats stats;
+    char payload[BINPROTO_STATS_LEN];
+    
+    pthread_mutex_lock(&data_mutex);
+    off_t stored = storage->ops->size(storage);
+    stats.stored_bytes = stored > 0 ? stored : 0;
+    stats.appends = append_count;
+    pthread_mutex_unlock(&data_mutex);
+    stats.active_connections = __atomic_load_n(&active_connections, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&memory_mutex);
+    stats.buffered_bytes = buffered_bytes;
+    pthread_mutex_unlock(&memory_mutex);
+    pool_totals(&stats.pool_hits, &stats.pool_misses);
+    
+    binproto_encode_stats(payload, &stats);
+    return frame_reply(client_fd, node, req, BINPROTO_OK, payload, sizeof(payload));
+}
+
+/*
+ * Answer every complete frame in data in order.  Returns the bytes they
+ * took, -1 if the connection has to be dropped.
+ */
+ssize_t process_frames(int client_fd, struct thread_node *node, const char *data, size_t len) {
+    size_t pos = 0;
+    
+    while (len - pos >= BINPROTO_HEADER_LEN) {
+        struct binproto_header hdr;
+        int rc;
+        
+        binproto_decode_header(data + pos, &hdr);
+        if (len - pos - BINPROTO_HEADER_LEN < hdr.length) {
+            break;
+        }
+        if (hdr.opcode == BINPROTO_APPEND) {
+            ssize_t n = frame_append_run(client_fd, node, data + pos, len - pos);
+            if (n == -1) {
+                return -1;
+            }
+            pos += n;
+            continue;
+        }
+        switch (hdr.opcode) {
+        case BINPROTO_READ:
+        case BINPROTO_SEEK:
+        case BINPROTO_READ_PACKETS:
+            rc = frame_read(client_fd, node, &hdr, data + pos + BINPROTO_HEADER_LEN);
+            break;
+        case BINPROTO_STATS:
+            rc = frame_stats(client_fd, node, &hdr);
+            break;
+        default:
+            rc = frame_reply(client_fd, node, &hdr, BINPROTO_BAD_REQUEST, NULL, 0);
+            break;
+        }
+        if (rc == -1) {
+            return -1;
+        }
+        pos += BINPROTO_HEADER_LEN + hdr.length;
+    }
+    return pos;
+}
+
+/*
+ * Serve a connection that negotiated the framed protocol, starting with
+ * whatever followed the hello in pkt.  Only headers are looked at to find
+ * where a frame ends, so the payloads are never scanned.
+ */
+void serve_frames(int client_fd, struct thread_node *node, const struct sockaddr_storage *client_addr,
+                  struct packet_buffer *pkt) {
+    for (;;) {
+        // Replies to everything in one read go out together
+        ssize_t used = process_frames(client_fd, node, pkt->data, pkt->len);
+        if (used == -1 || response_end(node) == -1) {
+            return;
+        }
+        packet_buffer_consume(pkt, used);
+        
+        // A partly received frame runs the slow-client clock like a partial packet
+        uint64_t now = __atomic_load_n(&server_tick, __ATOMIC_RELAXED);
+        if (pkt->len == 0) {
+            __atomic_store_n(&node->packet_start, 0, __ATOMIC_RELAXED);
+        } else if (used > 0 || node->packet_start == 0) {
+            __atomic_store_n(&node->packet_start, now, __ATOMIC_RELAXED);
         }
         
-        // Check if we have a complete packet (ends with newline)
-        int has_newline = 0;
-        for (int i = 0; i < bytes_received; i++) {
-            if (buffer[i] == '\n') {
-                has_newline = 1;
+        if (shutdown_requested || (draining && pkt->len == 0)) {
+            return;
+        }
+        const char *shed_reason = packet_buffer_reserve(pkt);
+        if (shed_reason != NULL) {
+            log_addr(LOG_WARNING, client_addr, "Dropping connection (%s) from ", shed_reason);
+            return;
+        }
+        ssize_t n = recv(client_fd, pkt->data + pkt->len, pkt->cap - pkt->len - 1, 0);
+        TRACE2(recv, client_fd, n);
+        if (n <= 0) {
+            return;
+        }
+        pkt->len += n;
+        touch_connection(node);
+    }
+}
+
+#define SUBSCRIBER_BATCH 64    // queued segments sent per wakeup
+
+// Queue one replication record: a header naming its log offset, then the bytes in seg
+int send_record(int client_fd, struct thread_node *node, uint64_t offset, const char *data, size_t len,
+                struct data_segment *seg) {
+    char header[REPLICATE_HEADER_LEN];
+    struct replicate_header hdr = { .offset = offset, .length = len };
+    
+    replicate_encode_header(header, &hdr);
+    if (response_add(node, header, sizeof(header), NULL) == -1) {
+        return -1;
+    }
+    return response_add(node, data, len, seg);
+}
+
+/*
+ * Send every append queued for sub until the connection closes, sub falls
+ * too far behind, or the server stops.  With offset set each append goes
+ * out as a replication record starting at *offset, otherwise as it is.
+ * Anything the client sends is discarded.
+ */
+void stream_subscription(int client_fd, struct thread_node *node, const struct sockaddr_storage *client_addr,
+                         struct subscriber *sub, uint64_t *offset) {
+    struct data_segment *segs[SUBSCRIBER_BATCH];
+    char discard[BUFFER_SIZE];
+    int rc = 0;
+    
+    struct pollfd pfd[2] = {
+        { .fd = client_fd, .events = POLLIN },
+        { .fd = sub->wake_fd, .events = POLLIN },
+    };
+    while (rc == 0 && !shutdown_requested) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "Poll failed: %s", strerror(errno));
+            break;
+        }
+        // EOF, or the server shutting the connection down to time it out or drain
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0) {
+                break;
+            }
+        }
+        if (pfd[1].revents & POLLIN) {
+            int n = subscriber_take(sub, segs, SUBSCRIBER_BATCH);
+            if (n == -1) {
+                log_addr(LOG_WARNING, client_addr, "Dropping subscriber that fell behind ");
                 break;
             }
+            for (int i = 0; i < n; i++) {
+                if (rc == 0 && offset != NULL) {
+                    rc = send_record(client_fd, node, *offset, segs[i]->data, segs[i]->len, segs[i]);
+                    *offset += segs[i]->len;
+                } else if (rc == 0) {
+                    rc = response_add(node, segs[i]->data, segs[i]->len, segs[i]);
+                }
+                segment_put(segs[i]);
+            }
+            if (rc == 0) {
+                rc = response_end(node);
+            }
+        }
+    }
+}
+
+// Attach a subscriber for a connection the timer wheel must leave alone
+struct subscriber *subscribe_connection(struct thread_node *node) {
+    struct subscriber *sub = subscriber_create();
+    if (sub == NULL) {
+        log_msg(LOG_ERR, "Out of memory for subscriber");
+        return NULL;
+    }
+    __atomic_store_n(&node->subscribed, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->packet_start, 0, __ATOMIC_RELAXED);
+    return sub;
+}
+
+void unsubscribe(struct subscriber_list *list, struct subscriber *sub) {
+    pthread_mutex_lock(&data_mutex);
+    subscriber_detach(list, sub);
+    pthread_mutex_unlock(&data_mutex);
+    subscriber_destroy(sub);
+}
+
+/*
+ * Push every append to a subscribed connection.  The subscription is
+ * acknowledged by echoing the command.
+ */
+void serve_subscriber(int client_fd, struct thread_node *node, const struct sockaddr_storage *client_addr) {
+    static const char ack[] = "AESDCHAR_SUBSCRIBE\n";
+    
+    struct subscriber *sub = subscribe_connection(node);
+    if (sub == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&data_mutex);
+    subscriber_attach(&subscribers, sub);
+    pthread_mutex_unlock(&data_mutex);
+    log_addr(LOG_INFO, client_addr, "Subscribed ");
+    
+    if (response_add(node, ack, sizeof(ack) - 1, NULL) == 0 && response_end(node) == 0) {
+        stream_subscription(client_fd, node, client_addr, sub, NULL);
+    }
+    unsubscribe(&subscribers, sub);
+}
+
+/*
+ * Replicate to a follower that sent REPLICATE_HELLO, whose requested
+ * offset follows in pkt: send the stored log from that offset, then every
+ * durable append.  The snapshot, cut back to what followers have been sent,
+ * and the subscription are taken under one hold of data_mutex, so the
+ * records join up without a gap or an overlap.
+ */
+void serve_follower(int client_fd, struct thread_node *node, const struct sockaddr_storage *client_addr,
+                    struct packet_buffer *pkt) {
+    struct storage_snapshot snap = { .offset = 0, .size = -1, .fd = -1, .priv = NULL };
+    
+    while (pkt->len < REPLICATE_REQUEST_LEN - REPLICATE_HELLO_LEN) {
+        if (packet_buffer_reserve(pkt) != NULL) {
+            return;
+        }
+        ssize_t n = recv(client_fd, pkt->data + pkt->len, pkt->cap - pkt->len - 1, 0);
+        if (n <= 0) {
+            return;
+        }
+        pkt->len += n;
+    }
+    uint64_t offset = binproto_get_u64(pkt->data);
+    if (!storage->ops->append_only) {
+        log_addr(LOG_WARNING, client_addr, "Refusing follower, %s storage cannot be replicated, from ",
+                 storage->ops->name);
+        return;
+    }
+    struct subscriber *sub = subscribe_connection(node);
+    if (sub == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&data_mutex);
+    int rc = storage->ops->snapshot(storage, &snap);
+    if (rc == 0) {
+        snap.size -= pending_bytes;
+        if (snap.size < snap.offset) {
+            snap.offset = snap.size;
+        }
+        subscriber_attach(&followers, sub);
+    }
+    pthread_mutex_unlock(&data_mutex);
+    if (rc == -1) {
+        log_msg(LOG_ERR, "Snapshot for follower failed: %s", strerror(errno));
+        subscriber_destroy(sub);
+        return;
+    }
+    
+    if (offset > (uint64_t)snap.size) {
+        log_addr(LOG_WARNING, client_addr, "Follower is ahead of this log (%llu > %llu), dropping ",
+                 (unsigned long long)offset, (unsigned long long)snap.size);
+        rc = -1;
+    } else if (offset < (uint64_t)snap.offset) {
+        log_addr(LOG_WARNING, client_addr, "Follower needs %llu bytes no longer stored, resuming at %llu for ",
+                 (unsigned long long)(snap.offset - offset), (unsigned long long)snap.offset);
+        offset = snap.offset;
+    } else {
+        snap.offset = offset;
+    }
+    if (rc == 0) {
+        log_addr(LOG_INFO, client_addr, "Replicating from offset %llu to ", (unsigned long long)offset);
+    }
+    
+    // Catch up in segment sized records, a batch per send
+    while (rc == 0 && snap.offset < snap.size) {
+        struct data_segment *seg = segment_alloc(SEGMENT_SIZE);
+        if (seg == NULL) {
+            log_msg(LOG_ERR, "Out of memory for follower");
+            rc = -1;
+            break;
+        }
+        ssize_t n = storage->ops->snapshot_read(storage, &snap, seg->data, SEGMENT_SIZE);
+        if (n <= 0) {
+            log_msg(LOG_ERR, "Read for follower failed: %s", n == 0 ? "short log" : strerror(errno));
+            segment_put(seg);
+            rc = -1;
+            break;
+        }
+        rc = send_record(client_fd, node, offset, seg->data, n, seg);
+        segment_put(seg);
+        offset += n;
+        if (rc == 0 && writer_queued(&node->out) >= RESPONSE_BATCH_BYTES) {
+            rc = response_flush(node, 1);
+        }
+    }
+    if (rc == 0) {
+        rc = response_end(node);
+    }
+    storage->ops->snapshot_release(storage, &snap);
+    
+    if (rc == 0) {
+        stream_subscription(client_fd, node, client_addr, sub, &offset);
+    }
+    unsubscribe(&followers, sub);
+}
+
+// Client thread function with proper file descriptor management
+void* client_thread_func(void *arg) {
+    struct thread_node *node = arg;
+    int client_fd = node->client_fd;
+    struct sockaddr_storage client_addr = node->client_addr;
+    struct packet_buffer *pkt = &node->pkt;
+    ssize_t bytes_received;
+    const char *shed_reason;
+    int negotiated = 0;
+    
+    // The client IP is formatted by the logging thread, off this path
+    log_addr(LOG_INFO, &client_addr, "Accepted connection from ");
+    writer_init(&node->out, client_fd, &writer_config);
+    
+    storage_gate_wait();
+    if (storage == NULL) {
+        finish_client(node);
+        return NULL;
+    }
+    // Time spent waiting for the predecessor does not count as idle
+    __atomic_store_n(&node->last_activity, __atomic_load_n(&server_tick, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    
+    while (!shutdown_requested) {
+        // A draining server closes each connection between packets
+        if (draining && pkt->len == 0) {
+            break;
+        }
+        // Reading pauses here while the server is short of buffer memory
+        shed_reason = packet_buffer_reserve(pkt);
+        if (shed_reason != NULL) {
+            log_addr(LOG_WARNING, &client_addr, "Dropping connection (%s) from ", shed_reason);
+            break;
         }
         
-        // If we have a newline, send entire file content back to client
-        if (has_newline) {
-#ifdef USE_AESD_CHAR_DEVICE
-            // For char device, close and reopen to reset file position to beginning
-            close(data_fd);
-            data_fd = open(DATA_FILE, O_RDONLY);
-            if (data_fd == -1) {
-                syslog(LOG_ERR, "Failed to reopen data file for reading: %s", strerror(errno));
+        bytes_received = recv(client_fd, pkt->data + pkt->len, pkt->cap - pkt->len - 1, 0);
+        TRACE2(recv, client_fd, bytes_received);
+        if (bytes_received == 0 && pkt->len > 0) {
+            // Store a trailing partial packet as an unterminated write did
+            // before, as durably as a complete one
+            pthread_mutex_lock(&data_mutex);
+            if (client_append(pkt->data, pkt->len) == -1) {
                 pthread_mutex_unlock(&data_mutex);
-                close(client_fd);
-                mark_thread_completed(pthread_self());
-                return NULL;
+                log_addr(LOG_ERR, &client_addr, "Failed to store trailing partial packet from ");
+            } else if (unlock_durable() == -1) {
+                log_addr(LOG_ERR, &client_addr, "Trailing partial packet not made durable from ");
             }
-#else
-            // For regular files, seek to beginning
-            if (lseek(data_fd, 0, SEEK_SET) == -1) {
-                syslog(LOG_ERR, "Failed to seek to beginning: %s", strerror(errno));
-                close(data_fd);
-                pthread_mutex_unlock(&data_mutex);
-                close(client_fd);
-                mark_thread_completed(pthread_self());
-                return NULL;
+        }
+        if (bytes_received <= 0) {
+            break;
+        }
+        const char *received = pkt->data + pkt->len;
+        pkt->len += bytes_received;
+        pkt->data[pkt->len] = '\0';
+        
+        // The first bytes pick the protocol for the whole connection
+        if (!negotiated) {
+            int hello = binproto_hello_check(pkt->data, pkt->len);
+            int follower = replicate_hello_check(pkt->data, pkt->len);
+            if (hello == 0 || follower == 0) {
+                continue;
             }
-#endif
-
-            char read_buffer[BUFFER_SIZE];
-            ssize_t read_bytes;
-            
-            while ((read_bytes = read(data_fd, read_buffer, BUFFER_SIZE)) > 0) {
-                ssize_t total_sent = 0;
-                while (total_sent < read_bytes) {
-                    ssize_t sent = send(client_fd, read_buffer + total_sent, read_bytes - total_sent, 0);
-                    if (sent == -1) {
-                        if (errno == EINTR) {
-                            continue;
-                        }
-                        syslog(LOG_ERR, "Send failed: %s", strerror(errno));
-                        close(data_fd);
-                        pthread_mutex_unlock(&data_mutex);
-                        close(client_fd);
-                        mark_thread_completed(pthread_self());
-                        return NULL;
-                    }
-                    total_sent += sent;
-                }
+            negotiated = 1;
+            if (follower == 1) {
+                packet_buffer_consume(pkt, REPLICATE_HELLO_LEN);
+                serve_follower(client_fd, node, &client_addr, pkt);
+                break;
             }
-            
-            if (read_bytes == -1) {
-                syslog(LOG_ERR, "Read failed: %s", strerror(errno));
+            if (hello == 1) {
+                packet_buffer_consume(pkt, BINPROTO_HELLO_LEN);
+                // Answered along with the first frames
+                if (response_add(node, BINPROTO_HELLO, BINPROTO_HELLO_LEN, NULL) == 0) {
+                    serve_frames(client_fd, node, &client_addr, pkt);
+                }
+                break;
             }
         }
         
-        // CRITICAL: Always close the file descriptor immediately after use
-        if (data_fd != -1) {
-            close(data_fd);
-            data_fd = -1;
+        // Record activity for the timer wheel: a trailing partial packet
+        // starts (or keeps) the slow-client clock, a complete one stops it
+        uint64_t now = __atomic_load_n(&server_tick, __ATOMIC_RELAXED);
+        __atomic_store_n(&node->last_activity, now, __ATOMIC_RELAXED);
+        const char *last_newline = memrchr(received, '\n', bytes_received);
+        if (last_newline == received + bytes_received - 1) {
+            __atomic_store_n(&node->packet_start, 0, __ATOMIC_RELAXED);
+        } else if (last_newline != NULL || node->packet_start == 0) {
+            __atomic_store_n(&node->packet_start, now, __ATOMIC_RELAXED);
+        }
+        
+        if (last_newline == NULL) {
+            continue;
+        }
+        
+        size_t complete = last_newline - pkt->data + 1;
+        int rc = process_packets(client_fd, node, pkt, complete);
+        if (rc == 1) {
+            serve_subscriber(client_fd, node, &client_addr);
         }
-        pthread_mutex_unlock(&data_mutex);
+        if (rc != 0) {
+            break;
+        }
+        packet_buffer_consume(pkt, complete);
     }
     
-    close(client_fd);
-    syslog(LOG_INFO, "Closed connection from %s", client_ip);
+    packet_buffer_free(pkt);
+    log_addr(LOG_INFO, &client_addr, "Closed connection from ");
     
-    // Mark this thread as completed
-    mark_thread_completed(pthread_self());
+    // Close the socket and mark this thread as completed
+    finish_client(node);
     
     return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    struct addrinfo hints, *res, *p;
+// Accept one pending connection on listen_fd and start its client thread
+void accept_client(int listen_fd) {
     struct sockaddr_storage client_addr;
-    socklen_t client_addr_size;
-    int client_fd;
-    int daemon_mode = 0;
+    socklen_t client_addr_size = sizeof client_addr;
+    int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_addr_size);
+    
+    if (client_fd == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && !shutdown_requested) {
+            log_msg(LOG_ERR, "Accept failed: %s", strerror(errno));
+        }
+        return;
+    }
+    if (writer_tune_socket(client_fd, &writer_config, 0) == -1) {
+        log_msg(LOG_WARNING, "Setting socket buffer sizes failed: %s", strerror(errno));
+    }
 
-    openlog("aesdsocket", LOG_PID, LOG_USER);
+    // Refuse outright rather than degrading the clients already admitted
+    int active = __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    if (max_connections != 0 && (unsigned int)active > max_connections) {
+        __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+        log_msg(LOG_WARNING, "Refusing connection: %u connections active", max_connections);
+        close(client_fd);
+        return;
+    }
+
+    // Add thread to management list and timer wheel before it starts
+    struct thread_node *node = add_thread_to_list(client_fd, &client_addr);
+    if (node == NULL) {
+        log_msg(LOG_ERR, "Out of memory for client");
+        close(client_fd);
+        __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+        return;
+    }
 
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = 1;
+    // Create new thread for client
+    if (pthread_create(&node->thread_id, NULL, client_thread_func, node) != 0) {
+        log_msg(LOG_ERR, "Failed to create client thread");
+        // Nothing to join, return the node outright
+        pthread_mutex_lock(&thread_list_mutex);
+        struct thread_node **link = &thread_list_head;
+        while (*link != node) {
+            link = &(*link)->next;
+        }
+        *link = node->next;
+        wheel_cancel(node);
+        node_release(node);
+        pthread_mutex_unlock(&thread_list_mutex);
+        close(client_fd);
+        __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
     }
+}
 
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+// Create a socket bound to listen_port, optionally sharing the port with SO_REUSEPORT
+int open_listener(int reuse_port) {
+    struct addrinfo hints, *res, *p;
+    int fd = -1;
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    if (getaddrinfo(NULL, PORT, &hints, &res) != 0) {
-        syslog(LOG_ERR, "getaddrinfo failed");
+    if (getaddrinfo(NULL, listen_port, &hints, &res) != 0) {
+        log_msg(LOG_ERR, "getaddrinfo failed");
         return -1;
     }
 
     for (p = res; p != NULL; p = p->ai_next) {
-        sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfd == -1) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd == -1) {
             continue;
         }
         
         // Set socket options to reuse address
         int yes = 1;
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-            syslog(LOG_ERR, "setsockopt failed");
-            close(sockfd);
+        // Buffer sizes are set before listen so the window scale can use them
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+            (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) ||
+            writer_tune_socket(fd, &writer_config, 1) == -1) {
+            log_msg(LOG_ERR, "setsockopt failed");
+            close(fd);
+            fd = -1;
             continue;
         }
         
-        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == 0) {
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
             break;
         }
-        close(sockfd);
+        close(fd);
+        fd = -1;
     }
 
     freeaddrinfo(res);
 
-    if (p == NULL) {
-        syslog(LOG_ERR, "Failed to bind");
+    if (fd == -1) {
+        log_msg(LOG_ERR, "Failed to bind");
+    }
+    return fd;
+}
+
+/*
+ * Acceptor for one SO_REUSEPORT shard.  The kernel spreads incoming
+ * connections across the shards' listeners, and client threads inherit the
+ * acceptor's CPU affinity so each connection is served on its shard's core.
+ */
+void* shard_thread_func(void *arg) {
+    struct acceptor_shard *shard = (struct acceptor_shard*)arg;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        log_msg(LOG_ERR, "Failed to pin acceptor to CPU %d", shard->cpu);
+    }
+
+    struct pollfd pfd[2] = {
+        { .fd = shard->listen_fd, .events = POLLIN },
+        { .fd = accept_stop_fd, .events = POLLIN },
+    };
+    while (!shutdown_requested) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "Poll failed: %s", strerror(errno));
+            break;
+        }
+        if ((pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL)) || (pfd[1].revents & POLLIN)) {
+            break;
+        }
+        if (pfd[0].revents & POLLIN) {
+            accept_client(shard->listen_fd);
+        }
+    }
+    return NULL;
+}
+
+// Bind one SO_REUSEPORT listener per shard
+int open_shards(int count) {
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    if (count == 0) {
+        count = cpus;
+    }
+    shards = calloc(count, sizeof(struct acceptor_shard));
+    if (shards == NULL) {
+        return -1;
+    }
+    for (shard_count = 0; shard_count < count; shard_count++) {
+        shards[shard_count].listen_fd = open_listener(1);
+        if (shards[shard_count].listen_fd == -1) {
+            return -1;
+        }
+        shards[shard_count].cpu = shard_count % cpus;
+    }
+    return 0;
+}
+
+// Take count listeners handed over by a predecessor as shards
+int adopt_shards(const int *fds, int count) {
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    shards = calloc(count, sizeof(struct acceptor_shard));
+    if (shards == NULL) {
+        return -1;
+    }
+    for (shard_count = 0; shard_count < count; shard_count++) {
+        shards[shard_count].listen_fd = fds[shard_count];
+        shards[shard_count].cpu = shard_count % cpus;
+    }
+    return 0;
+}
+
+// Listen on every shard and start its acceptor
+int start_shards() {
+    accept_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (accept_stop_fd == -1) {
+        log_msg(LOG_ERR, "Failed to create acceptor eventfd: %s", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (listen(shards[i].listen_fd, listen_backlog) == -1 ||
+            pthread_create(&shards[i].thread_id, NULL, shard_thread_func, &shards[i]) != 0) {
+            log_msg(LOG_ERR, "Failed to start acceptor shard %d", i);
+            // Only shards that were started are joined by cleanup()
+            for (int j = i; j < shard_count; j++) {
+                close(shards[j].listen_fd);
+            }
+            shard_count = i;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int start_commit_thread() {
+    commit_thread_started = pthread_create(&commit_thread_id, NULL, commit_thread_func, NULL) == 0;
+    return commit_thread_started ? 0 : -1;
+}
+
+// Receive from the primary, 0 at EOF or once the follower is being stopped
+ssize_t replica_recv(int fd, char *buf, size_t len) {
+    struct pollfd pfd[2] = {
+        { .fd = replica_stop_fd, .events = POLLIN },
+        { .fd = fd, .events = POLLIN },
+    };
+    
+    for (;;) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (pfd[0].revents & POLLIN) {
+            return 0;
+        }
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        return n;
+    }
+}
+
+/*
+ * Append the records the primary streams until the connection ends,
+ * advancing *offset past every byte applied.  Records are applied as they
+ * arrive, so a connection lost mid-record resumes inside it.
+ */
+void replica_apply(int fd, char *buf, uint64_t *offset) {
+    char header[REPLICATE_HEADER_LEN];
+    struct replicate_header hdr;
+    size_t have = 0;
+    uint64_t remaining = 0;     // bytes left in the current record
+    
+    for (;;) {
+        if (remaining == 0) {
+            ssize_t n = replica_recv(fd, header + have, sizeof(header) - have);
+            if (n <= 0) {
+                return;
+            }
+            have += n;
+            if (have < sizeof(header)) {
+                continue;
+            }
+            have = 0;
+            replicate_decode_header(header, &hdr);
+            if (hdr.offset < *offset) {
+                log_msg(LOG_ERR, "Primary sent offset %llu, expected %llu",
+                        (unsigned long long)hdr.offset, (unsigned long long)*offset);
+                return;
+            }
+            if (hdr.offset > *offset) {
+                log_msg(LOG_WARNING, "Primary no longer stores %llu bytes, resuming at %llu",
+                        (unsigned long long)(hdr.offset - *offset), (unsigned long long)hdr.offset);
+                // Keep local offsets those of the primary, they are where a restart resumes
+                pthread_mutex_lock(&data_mutex);
+                int rc = storage_skip(hdr.offset);
+                pthread_mutex_unlock(&data_mutex);
+                if (rc == -1) {
+                    log_msg(LOG_ERR, "Failed to skip to offset %llu: %s",
+                            (unsigned long long)hdr.offset, strerror(errno));
+                    return;
+                }
+                *offset = hdr.offset;
+            }
+            remaining = hdr.length;
+            continue;
+        }
+        
+        size_t want = remaining < SEGMENT_SIZE ? remaining : SEGMENT_SIZE;
+        ssize_t n = replica_recv(fd, buf, want);
+        if (n <= 0) {
+            return;
+        }
+        pthread_mutex_lock(&data_mutex);
+        if (storage_append(buf, n) == -1) {
+            pthread_mutex_unlock(&data_mutex);
+            log_msg(LOG_ERR, "Failed to apply replicated data at offset %llu", (unsigned long long)*offset);
+            return;
+        }
+        if (unlock_durable() == -1) {
+            log_msg(LOG_ERR, "Replicated data at offset %llu not made durable", (unsigned long long)*offset);
+        }
+        *offset += n;
+        remaining -= n;
+    }
+}
+
+/*
+ * Follow the primary at replicate_from, reconnecting after
+ * REPLICATE_RETRY_SECONDS whenever the connection is lost.  The stream
+ * starts at the end of the local log, whose offsets are kept those of the
+ * primary's.  The log is kept on exit, so a restart resumes where it ended.
+ */
+void *replica_thread_func(void *arg) {
+    struct storage_snapshot snap = { .offset = 0, .size = -1, .fd = -1, .priv = NULL };
+    uint64_t offset = 0;
+    int reported = 0;
+    (void)arg;
+    
+    char *buf = malloc(SEGMENT_SIZE);
+    if (buf == NULL) {
+        log_msg(LOG_ERR, "Out of memory for follower");
+        return NULL;
+    }
+    pthread_mutex_lock(&data_mutex);
+    if (storage->ops->snapshot(storage, &snap) == 0) {
+        offset = snap.size;
+        storage->ops->snapshot_release(storage, &snap);
+    }
+    pthread_mutex_unlock(&data_mutex);
+    
+    while (!shutdown_requested) {
+        int fd = replicate_connect(replicate_from);
+        if (fd == -1) {
+            // Once per outage, not once per attempt
+            if (!reported) {
+                log_msg(LOG_WARNING, "Cannot reach primary %s: %s, retrying", replicate_from, strerror(errno));
+                reported = 1;
+            }
+        } else {
+            char request[REPLICATE_REQUEST_LEN];
+            replicate_encode_request(request, offset);
+            if (send(fd, request, sizeof(request), MSG_NOSIGNAL) == sizeof(request)) {
+                log_msg(LOG_INFO, "Following %s from offset %llu", replicate_from, (unsigned long long)offset);
+                reported = 0;
+                replica_apply(fd, buf, &offset);
+            }
+            close(fd);
+            if (!shutdown_requested && !reported) {
+                log_msg(LOG_WARNING, "Lost primary %s at offset %llu, reconnecting",
+                        replicate_from, (unsigned long long)offset);
+                reported = 1;
+            }
+        }
+        
+        struct pollfd pfd = { .fd = replica_stop_fd, .events = POLLIN };
+        if (poll(&pfd, 1, REPLICATE_RETRY_SECONDS * 1000) > 0) {
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int start_replica_thread() {
+    replica_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (replica_stop_fd == -1) {
+        return -1;
+    }
+    replica_thread_started = pthread_create(&replica_thread_id, NULL, replica_thread_func, NULL) == 0;
+    return replica_thread_started ? 0 : -1;
+}
+
+// Connect to the running instance and take over its listeners
+int take_over_listeners(int *sharded) {
+    int fds[HANDOFF_MAX_FDS];
+    int count;
+
+    predecessor_fd = handoff_connect(upgrade_path);
+    if (predecessor_fd == -1) {
+        log_msg(LOG_ERR, "No running instance at %s: %s", upgrade_path, strerror(errno));
+        return -1;
+    }
+    if (handoff_recv_fds(predecessor_fd, fds, HANDOFF_MAX_FDS, &count, sharded) == -1) {
+        log_msg(LOG_ERR, "Failed to receive listeners from %s", upgrade_path);
+        close(predecessor_fd);
+        predecessor_fd = -1;
+        return -1;
+    }
+    if (*sharded) {
+        return adopt_shards(fds, count);
+    }
+    sockfd = fds[0];
+    return 0;
+}
+
+// Stop reading from idle connections; busy ones close after their packet
+void start_drain() {
+    drain_fd = eventfd(0, EFD_CLOEXEC);
+    if (drain_fd == -1) {
+        log_msg(LOG_WARNING, "Failed to create drain eventfd, checking once a tick: %s", strerror(errno));
+    }
+    draining = 1;
+    drain_deadline = __atomic_load_n(&server_tick, __ATOMIC_RELAXED) + drain_timeout / TICK_SECONDS;
+    pthread_mutex_lock(&thread_list_mutex);
+    for (struct thread_node *node = thread_list_head; node != NULL; node = node->next) {
+        if (node->client_fd != -1 && __atomic_load_n(&node->packet_start, __ATOMIC_RELAXED) == 0) {
+            shutdown(node->client_fd, SHUT_RD);
+        }
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+}
+
+/*
+ * A successor connected to upgrade_fd: pass it the listeners, stop
+ * accepting and drain.  Storage is left in place for the successor, which
+ * opens it once cleanup() reports over handoff_fd that it was released.
+ * -1 if this instance carries on serving instead.
+ */
+int hand_off() {
+    int fds[HANDOFF_MAX_FDS];
+    int count = 0;
+    
+    int conn = accept4(upgrade_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+        return -1;
+    }
+    // Closing without the listeners fails the successor's takeover
+    if (!storage->ops->handoff) {
+        log_msg(LOG_WARNING, "The %s backend cannot pass its data on, refusing upgrade", storage->ops->name);
+        close(conn);
+        return -1;
+    }
+    if (sockfd != -1) {
+        fds[count++] = sockfd;
+    }
+    for (int i = 0; i < shard_count && count < HANDOFF_MAX_FDS; i++) {
+        fds[count++] = shards[i].listen_fd;
+    }
+    if (handoff_send_fds(conn, fds, count, shard_count > 0) == -1) {
+        log_msg(LOG_WARNING, "Listener handoff failed: %s", strerror(errno));
+        close(conn);
+        return -1;
+    }
+    log_msg(LOG_INFO, "Handed listeners to successor, draining %d connections",
+            __atomic_load_n(&active_connections, __ATOMIC_RELAXED));
+    handoff_fd = conn;
+    stop_acceptors();
+    // The successor has replaced the socket files, leave them in place
+    close(upgrade_fd);
+    upgrade_fd = -1;
+    if (replica_listen_fd != -1) {
+        close(replica_listen_fd);
+        replica_listen_fd = -1;
+    }
+    storage->keep = 1;
+    start_drain();
+    return 0;
+}
+
+/*
+ * Open storage and start what depends on it, then let client threads
+ * through the gate.  -1 if that failed; the gate is opened by cleanup().
+ */
+int open_storage() {
+    storage = storage_open(storage_name, &storage_config);
+    if (storage == NULL) {
+        return -1;
+    }
+    if (durability != DURABILITY_NONE && storage->ops->sync_begin == NULL) {
+        log_msg(LOG_WARNING, "The %s backend is not durable, ignoring -D", storage->ops->name);
+        durability = DURABILITY_NONE;
+    }
+    if (durability == DURABILITY_GROUP && start_commit_thread() == -1) {
+        log_msg(LOG_ERR, "Failed to start commit thread");
         return -1;
     }
+    if (replicate_from != NULL) {
+        // Its offsets must stay the primary's, and its log is where a restart resumes
+        if (!storage->ops->append_only || storage->ops->skip == NULL) {
+            log_msg(LOG_ERR, "The %s backend cannot follow a primary, use -S file", storage->ops->name);
+            return -1;
+        }
+        storage->keep = 1;
+        if (start_replica_thread() == -1) {
+            log_msg(LOG_ERR, "Failed to start follower thread");
+            return -1;
+        }
+    }
+    storage_gate_open();
+    return 0;
+}
+
+// Accept a successor at upgrade_path, which only makes sense holding storage
+void listen_for_successor() {
+    upgrade_fd = handoff_listen(upgrade_path);
+    if (upgrade_fd == -1) {
+        log_msg(LOG_WARNING, "Failed to listen for upgrades at %s: %s", upgrade_path, strerror(errno));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int daemon_mode = 0;
+    int sharded = 0;
+    int takeover = 0;
+    int opt;
+
+    log_init("aesdsocket");
+    compress_cache_init(&compress_cache);
+
+    while ((opt = getopt(argc, argv, "di:l:b:s:c:m:M:S:R:D:W:C:v:O:r:u:Ug:p:f:F:P:T:")) != -1) {
+        switch (opt) {
+        case 'd':
+            daemon_mode = 1;
+            break;
+        case 'i':
+            idle_timeout = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            packet_timeout = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg);
+            break;
+        case 's':
+            // Number of SO_REUSEPORT shards, 0 for one per online CPU
+            sharded = 1;
+            shard_count = atoi(optarg);
+            break;
+        case 'c':
+            max_connections = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            max_client_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'M':
+            max_total_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            storage_name = optarg;
+            break;
+        case 'R':
+            // Segment size and retention limits for the file backend
+            if (storage_parse_config(&storage_config, optarg) == -1) {
+                fprintf(stderr, "Invalid -R option list: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'D':
+            if (strcmp(optarg, "none") == 0) {
+                durability = DURABILITY_NONE;
+            } else if (strcmp(optarg, "packet") == 0) {
+                durability = DURABILITY_PACKET;
+            } else if (strcmp(optarg, "group") == 0) {
+                durability = DURABILITY_GROUP;
+            } else {
+                fprintf(stderr, "Unknown durability mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'W':
+            commit_window_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'C':
+            // Response cache memory cap, 0 always streams from storage
+            response_cache.cap = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            if (log_parse_level(optarg) == -1) {
+                fprintf(stderr, "Unknown log level: %s\n", optarg);
+                return -1;
+            }
+            log_set_level(log_parse_level(optarg));
+            break;
+        case 'O':
+            if (log_set_sink(optarg) == -1) {
+                fprintf(stderr, "Unknown log sink: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'r':
+            log_set_rate(strtoul(optarg, NULL, 10));
+            break;
+        case 'u':
+            upgrade_path = optarg;
+            break;
+        case 'U':
+            // Take the listeners over from the instance at upgrade_path
+            takeover = 1;
+            break;
+        case 'g':
+            drain_timeout = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            listen_port = optarg;
+            break;
+        case 'f':
+            // Data file, or segment file prefix, of the file and mmap backends
+            storage_config.data_path = optarg;
+            break;
+        case 'F':
+            // Follow the primary at host:port or a unix socket path
+            replicate_from = optarg;
+            break;
+        case 'P':
+            replica_path = optarg;
+            break;
+        case 'T':
+            // Socket buffer sizes, TCP_NODELAY and the smallest MSG_ZEROCOPY send
+            if (writer_parse_config(&writer_config, optarg) == -1) {
+                fprintf(stderr, "Invalid -T option list: %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-i idle_timeout_s] [-l packet_timeout_s] [-b backlog] [-s shards]\n"
+                    "          [-c max_connections] [-m max_client_bytes] [-M max_total_bytes]\n"
+                    "          [-S %s]\n"
+                    "          [-R segment=bytes,bytes=max,age=max_s,packets=max]\n"
+                    "          [-D none|packet|group] [-W commit_window_ms] [-C cache_bytes]\n"
+                    "          [-v log_level] [-O syslog|stderr] [-r log_messages_per_s]\n"
+                    "          [-u upgrade_socket] [-U] [-g drain_timeout_s]\n"
+                    "          [-p port] [-f data_path] [-F primary] [-P follower_socket]\n"
+                    "          [-T sndbuf=bytes,rcvbuf=bytes,nodelay=0|1,zerocopy=min_bytes]\n",
+                    argv[0], storage_names());
+            return -1;
+        }
+    }
+
+    // Termination signals are read from signal_fd by the main loop; every
+    // thread inherits this mask
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term, SIGINT);
+    sigaddset(&term, SIGTERM);
+    sigprocmask(SIG_BLOCK, &term, NULL);
+
+    // Bind (or take over) before forking so a failure is reported to the caller
+    if (takeover) {
+        if (take_over_listeners(&sharded) == -1) {
+            return -1;
+        }
+    } else if (sharded) {
+        int count = shard_count;
+        if (count < 0 || open_shards(count) == -1) {
+            log_msg(LOG_ERR, "Failed to bind acceptor shards");
+            return -1;
+        }
+    } else {
+        sockfd = open_listener(0);
+        if (sockfd == -1) {
+            return -1;
+        }
+    }
 
     if (daemon_mode) {
         pid_t pid = fork();
         if (pid < 0) {
-            syslog(LOG_ERR, "Fork failed");
+            log_msg(LOG_ERR, "Fork failed");
             close(sockfd);
             return -1;
         }
@@ -521,54 +2482,151 @@ int main(int argc, char *argv[]) {
         close(STDERR_FILENO);
     }
 
-    if (listen(sockfd, 5) == -1) {
-        syslog(LOG_ERR, "Listen failed");
+    // Threads do not survive fork(), so the log thread starts in the final process
+    if (log_start() == -1) {
+        log_msg(LOG_WARNING, "Failed to start log thread, logging synchronously");
+    }
+    atexit(log_stop);
+
+    signal_fd = signalfd(-1, &term, SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        log_msg(LOG_ERR, "Failed to create signalfd: %s", strerror(errno));
         close(sockfd);
         return -1;
     }
 
-#ifndef USE_AESD_CHAR_DEVICE
-    // Start timer thread only when not using char device
-    if (pthread_create(&timer_thread, NULL, timer_thread_func, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to create timer thread");
+    if (sockfd != -1 && listen(sockfd, listen_backlog) == -1) {
+        log_msg(LOG_ERR, "Listen failed");
         close(sockfd);
         return -1;
     }
-#endif
+
+    // One timerfd drives both connection timeouts and timestamp records
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        log_msg(LOG_ERR, "Failed to create timer: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    struct itimerspec tick = {
+        .it_interval = { .tv_sec = TICK_SECONDS, .tv_nsec = 0 },
+        .it_value = { .tv_sec = TICK_SECONDS, .tv_nsec = 0 },
+    };
+    timerfd_settime(timer_fd, 0, &tick, NULL);
+
+    // A successor accepts straight away and opens storage once the
+    // predecessor lets go of it; until then its clients wait for the gate
+    if (predecessor_fd != -1) {
+        log_msg(LOG_INFO, "Took over listeners, serving once predecessor drains");
+    } else if (open_storage() == -1) {
+        cleanup();
+        return -1;
+    }
+
+    if (sharded && start_shards() == -1) {
+        cleanup();
+        return -1;
+    }
+
+    if (predecessor_fd == -1) {
+        listen_for_successor();
+    }
+    if (replica_path != NULL) {
+        replica_listen_fd = replicate_listen_unix(replica_path, listen_backlog);
+        if (replica_listen_fd == -1) {
+            log_msg(LOG_ERR, "Failed to listen for followers at %s: %s", replica_path, strerror(errno));
+            cleanup();
+            return -1;
+        }
+    }
+
+    // Without shards the main loop accepts too, otherwise it only keeps time;
+    // poll skips the entries set to -1
+    struct pollfd fds[7] = {
+        { .fd = timer_fd, .events = POLLIN },
+        { .fd = signal_fd, .events = POLLIN },
+        { .fd = upgrade_fd, .events = POLLIN },
+        { .fd = sockfd, .events = POLLIN },
+        { .fd = replica_listen_fd, .events = POLLIN },
+        { .fd = predecessor_fd, .events = POLLIN },
+        { .fd = drain_fd, .events = POLLIN },
+    };
 
     while (!shutdown_requested) {
-        client_addr_size = sizeof client_addr;
-        client_fd = accept(sockfd, (struct sockaddr *)&client_addr, &client_addr_size);
-        
-        if (client_fd == -1) {
-            if (errno == EINTR) {
-                break;
+        fds[2].fd = upgrade_fd;
+        fds[3].fd = sockfd;
+        fds[4].fd = replica_listen_fd;
+        fds[5].fd = predecessor_fd;
+        fds[6].fd = drain_fd;
+        if (poll(fds, 7, -1) == -1) {
+            if (errno != EINTR) {
+                log_msg(LOG_ERR, "Poll failed: %s", strerror(errno));
             }
-            syslog(LOG_ERR, "Accept failed");
             continue;
         }
 
-        // Create thread data
-        struct thread_data *data = malloc(sizeof(struct thread_data));
-        data->client_fd = client_fd;
-        data->client_addr = client_addr;
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                log_msg(LOG_INFO, "Caught signal, exiting");
+                shutdown_requested = 1;
+                break;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            handle_timer_tick();
+            // Reap threads of connections that have ended or timed out
+            cleanup_completed_threads();
+            if (draining && (__atomic_load_n(&active_connections, __ATOMIC_RELAXED) == 0 ||
+                             server_tick >= drain_deadline)) {
+                log_msg(LOG_INFO, "Drained, exiting");
+                break;
+            }
+        }
+
+        // The last connection of a drain closed
+        if (drain_fd != -1 && (fds[6].revents & POLLIN)) {
+            uint64_t count;
+            if (read(drain_fd, &count, sizeof(count)) == sizeof(count) &&
+                __atomic_load_n(&active_connections, __ATOMIC_RELAXED) == 0) {
+                log_msg(LOG_INFO, "Drained, exiting");
+                break;
+            }
+        }
+
+        // The predecessor has drained and released storage, or exited
+        if (predecessor_fd != -1 && (fds[5].revents & (POLLIN | POLLHUP | POLLERR))) {
+            handoff_wait_done(predecessor_fd);
+            close(predecessor_fd);
+            predecessor_fd = -1;
+            if (open_storage() == -1) {
+                cleanup();
+                return -1;
+            }
+            listen_for_successor();
+        }
 
-        // Create new thread for client
-        pthread_t client_thread;
-        if (pthread_create(&client_thread, NULL, client_thread_func, data) != 0) {
-            syslog(LOG_ERR, "Failed to create client thread");
-            close(client_fd);
-            free(data);
+        if (upgrade_fd != -1 && (fds[2].revents & POLLIN)) {
+            // Nothing may have been left to drain
+            if (hand_off() == 0 && __atomic_load_n(&active_connections, __ATOMIC_RELAXED) == 0) {
+                log_msg(LOG_INFO, "Drained, exiting");
+                break;
+            }
             continue;
         }
 
-        // Add thread to management list
-        add_thread_to_list(client_thread, client_fd);
-        
-        // Periodically clean up completed threads
-        cleanup_completed_threads();
+        if (sockfd != -1 && (fds[3].revents & POLLIN)) {
+            accept_client(sockfd);
+            // Periodically clean up completed threads
+            cleanup_completed_threads();
+        }
+
+        if (replica_listen_fd != -1 && (fds[4].revents & POLLIN)) {
+            accept_client(replica_listen_fd);
+        }
     }
 
     cleanup();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,67 @@
+/*
+ * binproto.c
+ *
+ * Header layout: u32 length, u32 id, u8 opcode, u8 status, two reserved
+ * bytes sent as zero.
+ */
+#include <string.h>
+
+#include "binproto.h"
+
+int binproto_hello_check(const char *buf, size_t len) {
+    size_t n = len < BINPROTO_HELLO_LEN ? len : BINPROTO_HELLO_LEN;
+
+    if (memcmp(buf, BINPROTO_HELLO, n) != 0) {
+        return -1;
+    }
+    return n == BINPROTO_HELLO_LEN ? 1 : 0;
+}
+
+uint32_t binproto_get_u32(const char *buf) {
+    const unsigned char *p = (const unsigned char *)buf;
+
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+uint64_t binproto_get_u64(const char *buf) {
+    return (uint64_t)binproto_get_u32(buf) << 32 | binproto_get_u32(buf + 4);
+}
+
+void binproto_put_u32(char *buf, uint32_t value) {
+    unsigned char *p = (unsigned char *)buf;
+
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+void binproto_put_u64(char *buf, uint64_t value) {
+    binproto_put_u32(buf, value >> 32);
+    binproto_put_u32(buf + 4, value);
+}
+
+void binproto_decode_header(const char *buf, struct binproto_header *hdr) {
+    hdr->length = binproto_get_u32(buf);
+    hdr->id = binproto_get_u32(buf + 4);
+    hdr->opcode = buf[8];
+    hdr->status = buf[9];
+}
+
+void binproto_encode_header(char *buf, const struct binproto_header *hdr) {
+    binproto_put_u32(buf, hdr->length);
+    binproto_put_u32(buf + 4, hdr->id);
+    buf[8] = hdr->opcode;
+    buf[9] = hdr->status;
+    buf[10] = 0;
+    buf[11] = 0;
+}
+
+void binproto_encode_stats(char *buf, const struct binproto_stats *stats) {
+    binproto_put_u64(buf, stats->stored_bytes);
+    binproto_put_u64(buf + 8, stats->appends);
+    binproto_put_u64(buf + 16, stats->active_connections);
+    binproto_put_u64(buf + 24, stats->buffered_bytes);
+    binproto_put_u64(buf + 32, stats->pool_hits);
+    binproto_put_u64(buf + 40, stats->pool_misses);
+}
@@ -0,0 +1,81 @@
+/*
+ * binproto.h
+ *
+ * Framed binary protocol for aesdsocket.  A client switches its connection
+ * over by sending BINPROTO_HELLO as its first bytes, which the server
+ * echoes; connections that start any other way keep the newline protocol.
+ *
+ * Every request and response is then a header followed by length payload
+ * bytes, integers in network byte order.  Responses come in request order
+ * and carry the request's id, so a client may pipeline as many requests as
+ * it likes.  Payloads:
+ *
+ *   APPEND  request: bytes to store as they are     response: empty
+ *   READ    request: u64 offset, u64 length         response: stored bytes
+ *           (offset counts from the first byte still stored, length 0
+ *           reads to the end)
+ *   SEEK    request: u32 write_cmd, u32 offset      response: stored bytes
+ *           (everything from that command and offset on, as AESDCHAR_IOCSEEKTO)
+ *   READ_PACKETS  request: u32 first, u32 last      response: stored bytes
+ *           (commands first through last inclusive, of those still stored)
+ *   STATS   request: empty                          response: struct binproto_stats
+ */
+#ifndef AESDSOCKET_BINPROTO_H
+#define AESDSOCKET_BINPROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BINPROTO_HELLO "\0AESD/1\n"
+#define BINPROTO_HELLO_LEN 8
+#define BINPROTO_HEADER_LEN 12
+
+enum binproto_opcode {
+    BINPROTO_APPEND = 1,
+    BINPROTO_READ = 2,
+    BINPROTO_SEEK = 3,
+    BINPROTO_STATS = 4,
+    BINPROTO_READ_PACKETS = 5,
+};
+
+enum binproto_status {
+    BINPROTO_OK = 0,
+    BINPROTO_BAD_REQUEST = 1,   // unknown opcode or malformed payload
+    BINPROTO_FAILED = 2,        // the storage could not serve it
+};
+
+struct binproto_header {
+    uint32_t length;    // payload bytes after the header
+    uint32_t id;        // chosen by the client, echoed in the response
+    uint8_t opcode;     // echoed in the response
+    uint8_t status;     // 0 in requests
+};
+
+// STATS payload, each field a u64 on the wire
+struct binproto_stats {
+    uint64_t stored_bytes;
+    uint64_t appends;
+    uint64_t active_connections;
+    uint64_t buffered_bytes;
+    uint64_t pool_hits;         // connections and buffers reused
+    uint64_t pool_misses;       // connections and buffers allocated
+};
+
+#define BINPROTO_STATS_LEN 48
+
+/**
+ * 1 if buf starts with the hello, 0 if the len bytes so far still could,
+ * -1 if the connection uses the newline protocol
+ */
+int binproto_hello_check(const char *buf, size_t len);
+
+void binproto_decode_header(const char *buf, struct binproto_header *hdr);
+void binproto_encode_header(char *buf, const struct binproto_header *hdr);
+void binproto_encode_stats(char *buf, const struct binproto_stats *stats);
+
+uint32_t binproto_get_u32(const char *buf);
+uint64_t binproto_get_u64(const char *buf);
+void binproto_put_u32(char *buf, uint32_t value);
+void binproto_put_u64(char *buf, uint64_t value);
+
+#endif /* AESDSOCKET_BINPROTO_H */
@@ -0,0 +1,76 @@
+/*
+ * compress.c
+ *
+ * Frames are immutable segments, so a frame found in the cache is sent
+ * without the cache lock while another connection replaces its slot.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "binproto.h"
+#include "compress.h"
+
+void compress_cache_init(struct compress_cache *cache) {
+    memset(cache, 0, sizeof(*cache));
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+void compress_cache_free(struct compress_cache *cache) {
+    for (int i = 0; i < COMPRESS_CACHE_SLOTS; i++) {
+        segment_put(cache->slot[i].frame);
+        cache->slot[i].frame = NULL;
+    }
+    pthread_mutex_destroy(&cache->lock);
+}
+
+struct data_segment *compress_cache_get(struct compress_cache *cache, uint64_t block) {
+    struct compress_slot *slot = &cache->slot[block % COMPRESS_CACHE_SLOTS];
+    struct data_segment *frame = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if (slot->frame != NULL && slot->block == block) {
+        frame = segment_get(slot->frame);
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return frame;
+}
+
+void compress_cache_put(struct compress_cache *cache, uint64_t block, struct data_segment *frame) {
+    struct compress_slot *slot = &cache->slot[block % COMPRESS_CACHE_SLOTS];
+    struct data_segment *old;
+
+    pthread_mutex_lock(&cache->lock);
+    old = slot->frame;
+    slot->block = block;
+    slot->frame = segment_get(frame);
+    pthread_mutex_unlock(&cache->lock);
+    segment_put(old);
+}
+
+size_t compress_frame_bound(size_t len) {
+    return COMPRESS_FRAME_HEADER + compressBound(len);
+}
+
+struct data_segment *compress_frame(const char *data, size_t len) {
+    struct data_segment *frame = segment_alloc(compress_frame_bound(len));
+    uLongf out_len;
+
+    if (frame == NULL) {
+        return NULL;
+    }
+    out_len = frame->len - COMPRESS_FRAME_HEADER;
+    if (compress2((Bytef *)frame->data + COMPRESS_FRAME_HEADER, &out_len,
+                  (const Bytef *)data, len, COMPRESS_LEVEL) != Z_OK) {
+        segment_put(frame);
+        return NULL;
+    }
+    binproto_put_u32(frame->data, out_len);
+    frame->len = COMPRESS_FRAME_HEADER + out_len;
+    // Cached frames should cost what they compressed to, not the bound
+    struct data_segment *shrunk = realloc(frame, sizeof(struct data_segment) + frame->len);
+    return shrunk != NULL ? shrunk : frame;
+}
@@ -0,0 +1,59 @@
+/*
+ * compress.h
+ *
+ * Deflate compressed responses.  A response is cut at COMPRESS_BLOCK
+ * boundaries of the storage offsets and each piece is sent as its own zlib
+ * stream, so complete blocks of append-only history compress the same way
+ * for every client and are kept in a cache shared by all connections.
+ */
+#ifndef AESDSOCKET_COMPRESS_H
+#define AESDSOCKET_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "storage.h"
+
+#define COMPRESS_BLOCK (64 * 1024)
+#define COMPRESS_CACHE_SLOTS 256    // direct mapped by block number
+#define COMPRESS_LEVEL 6
+
+/*
+ * On the wire each piece is a u32 length in network byte order followed by
+ * that many bytes of zlib stream; a zero length ends the response.
+ */
+#define COMPRESS_FRAME_HEADER 4
+
+struct compress_slot {
+    uint64_t block;                 // block number, storage offset / COMPRESS_BLOCK
+    struct data_segment *frame;     // header and stream, NULL if the slot is empty
+};
+
+struct compress_cache {
+    pthread_mutex_t lock;
+    struct compress_slot slot[COMPRESS_CACHE_SLOTS];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+void compress_cache_init(struct compress_cache *cache);
+void compress_cache_free(struct compress_cache *cache);
+
+/**
+ * The cached frame for a complete block, NULL on a miss; the caller puts
+ * the returned reference
+ */
+struct data_segment *compress_cache_get(struct compress_cache *cache, uint64_t block);
+void compress_cache_put(struct compress_cache *cache, uint64_t block, struct data_segment *frame);
+
+/**
+ * Compress len bytes into a new frame, NULL on failure
+ */
+struct data_segment *compress_frame(const char *data, size_t len);
+
+// Largest frame compress_frame() makes for len bytes
+size_t compress_frame_bound(size_t len);
+
+#endif /* AESDSOCKET_COMPRESS_H */
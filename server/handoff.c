@@ -0,0 +1,163 @@
+/*
+ * handoff.c
+ *
+ * Wire format: the successor sends HANDOFF_REQUEST, the predecessor answers
+ * with a struct handoff_header carrying the listeners as SCM_RIGHTS, and
+ * later one HANDOFF_DONE byte.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "log.h"
+
+#define HANDOFF_MAGIC 0x61657364    // "aesd"
+#define HANDOFF_REQUEST 'U'
+#define HANDOFF_DONE 'D'
+
+struct handoff_header {
+    uint32_t magic;
+    int32_t count;
+    int32_t sharded;
+};
+
+static int handoff_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (handoff_address(path, &addr) == -1) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    char request = HANDOFF_REQUEST;
+    int fd;
+
+    if (handoff_address(path, &addr) == -1) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        write(fd, &request, 1) != 1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_send_fds(int sock, const int *fds, int count, int sharded) {
+    struct handoff_header header = { HANDOFF_MAGIC, count, sharded };
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    char request;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+
+    if (count < 1 || count > HANDOFF_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Whatever connected has a second to ask before the caller moves on
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (read(sock, &request, 1) != 1 || request != HANDOFF_REQUEST) {
+        errno = EPROTO;
+        return -1;
+    }
+    memset(control.buf, 0, sizeof(control.buf));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(header) ? 0 : -1;
+}
+
+int handoff_recv_fds(int sock, int *fds, int max, int *count, int *sharded) {
+    struct handoff_header header;
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(header) || header.magic != HANDOFF_MAGIC) {
+        errno = EPROTO;
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        header.count < 1 || header.count > max ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * header.count)) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * header.count);
+    *count = header.count;
+    *sharded = header.sharded;
+    return 0;
+}
+
+int handoff_send_done(int sock) {
+    char done = HANDOFF_DONE;
+
+    return send(sock, &done, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+int handoff_wait_done(int sock) {
+    char done;
+    ssize_t n;
+
+    do {
+        n = read(sock, &done, 1);
+    } while (n == -1 && errno == EINTR);
+    if (n != 1 || done != HANDOFF_DONE) {
+        log_msg(LOG_WARNING, "Predecessor exited without reporting it had drained");
+        return -1;
+    }
+    return 0;
+}
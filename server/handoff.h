@@ -0,0 +1,39 @@
+/*
+ * handoff.h
+ *
+ * Listening socket handoff between an aesdsocket and its successor over a
+ * unix socket.  The successor connects, receives the listeners with
+ * SCM_RIGHTS and starts accepting, then opens storage once the predecessor
+ * reports that it has drained.
+ */
+#ifndef AESDSOCKET_HANDOFF_H
+#define AESDSOCKET_HANDOFF_H
+
+#define DEFAULT_UPGRADE_PATH "/var/tmp/aesdsocket.upgrade"
+#define HANDOFF_MAX_FDS 256
+
+/**
+ * Listen for a successor at path, replacing any stale socket there
+ */
+int handoff_listen(const char *path);
+
+/**
+ * Connect to the running instance at path, -1 if there is none
+ */
+int handoff_connect(const char *path);
+
+/**
+ * Pass count listeners to the successor; sharded tells it they are
+ * SO_REUSEPORT shards rather than a single listener
+ */
+int handoff_send_fds(int sock, const int *fds, int count, int sharded);
+int handoff_recv_fds(int sock, int *fds, int max, int *count, int *sharded);
+
+/**
+ * The predecessor reports that it has drained and released its storage;
+ * waiting also returns if it exits without reporting
+ */
+int handoff_send_done(int sock);
+int handoff_wait_done(int sock);
+
+#endif /* AESDSOCKET_HANDOFF_H */
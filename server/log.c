@@ -0,0 +1,335 @@
+/*
+ * log.c
+ *
+ * The ring is a bounded multi-producer queue: each slot carries a sequence
+ * number telling producers whether it is free for their position and the
+ * drain thread whether it holds a published message.  Producers claim a
+ * position with one compare-and-swap and never wait; when the ring is full
+ * the message is dropped and counted instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+#define LOG_RING_SLOTS 1024     // power of two
+#define LOG_MSG_MAX 256
+
+struct log_slot {
+    uint64_t seq;
+    int level;
+    int has_addr;
+    struct timespec when;
+    struct sockaddr_storage addr;
+    char msg[LOG_MSG_MAX];
+};
+
+struct log_sink {
+    const char *name;
+    void (*write)(int level, const struct timespec *when, const char *msg);
+};
+
+static void syslog_sink_write(int level, const struct timespec *when, const char *msg) {
+    syslog(level, "%s", msg);
+}
+
+static void stderr_sink_write(int level, const struct timespec *when, const char *msg) {
+    struct tm tm;
+    char stamp[32];
+
+    localtime_r(&when->tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(stderr, "%s.%03ld [%d] %s\n", stamp, when->tv_nsec / 1000000, level, msg);
+}
+
+static const struct log_sink sinks[] = {
+    { "syslog", syslog_sink_write },
+    { "stderr", stderr_sink_write },
+};
+
+static const struct log_sink *sink = &sinks[0];
+static int log_level = LOG_INFO;
+static unsigned int log_rate = DEFAULT_LOG_RATE;
+
+static struct log_slot ring[LOG_RING_SLOTS];
+static uint64_t ring_tail;      // next position producers claim
+static uint64_t ring_head;      // next position the drain thread reads
+static uint64_t dropped;        // ring full
+static uint64_t suppressed;     // over the rate limit
+
+// Current second in the high half, messages logged in it in the low half
+static uint64_t rate_window;
+
+static int running;
+static int sleeping;            // the drain thread is waiting on wake_fd
+static int wake_fd = -1;
+static pthread_t drain_thread;
+
+void log_init(const char *ident) {
+    openlog(ident, LOG_PID, LOG_USER);
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++) {
+        ring[i].seq = i;
+    }
+}
+
+int log_set_sink(const char *name) {
+    for (size_t i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++) {
+        if (strcmp(sinks[i].name, name) == 0) {
+            sink = &sinks[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int log_parse_level(const char *name) {
+    static const char *const names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+    for (int i = 0; i < 8; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void log_set_level(int level) {
+    log_level = level;
+}
+
+void log_set_rate(unsigned int per_second) {
+    log_rate = per_second;
+}
+
+// Admit one routine message under the per-second cap
+static int log_rate_admit(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    uint64_t second = (uint64_t)now.tv_sec << 32;
+    uint64_t window = __atomic_load_n(&rate_window, __ATOMIC_RELAXED);
+    for (;;) {
+        uint64_t next;
+        if ((window & ~0xffffffffULL) != second) {
+            next = second | 1;
+        } else if ((window & 0xffffffffULL) < log_rate) {
+            next = window + 1;
+        } else {
+            return 0;
+        }
+        if (__atomic_compare_exchange_n(&rate_window, &window, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+}
+
+static void format_addr(const struct sockaddr_storage *addr, char *buf, size_t len) {
+    if (addr->ss_family == AF_UNIX) {
+        snprintf(buf, len, "local socket");
+        return;
+    }
+    const void *src = addr->ss_family == AF_INET ?
+        (const void *)&((const struct sockaddr_in *)addr)->sin_addr :
+        (const void *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+
+    if (inet_ntop(addr->ss_family, src, buf, len) == NULL) {
+        snprintf(buf, len, "unknown");
+    }
+}
+
+// Write one message to the sink, appending the address if there is one
+static void log_emit(int level, const struct timespec *when, const char *msg,
+                     const struct sockaddr_storage *addr) {
+    if (addr == NULL) {
+        sink->write(level, when, msg);
+        return;
+    }
+    char line[LOG_MSG_MAX + INET6_ADDRSTRLEN];
+    char ip[INET6_ADDRSTRLEN];
+    format_addr(addr, ip, sizeof(ip));
+    snprintf(line, sizeof(line), "%s%s", msg, ip);
+    sink->write(level, when, line);
+}
+
+static void log_queue(int level, const struct sockaddr_storage *addr, const char *fmt, va_list ap) {
+    if (level > log_level) {
+        return;
+    }
+    if (level >= LOG_NOTICE && log_rate != 0 && !log_rate_admit()) {
+        __atomic_add_fetch(&suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        char msg[LOG_MSG_MAX];
+        struct timespec when;
+        clock_gettime(CLOCK_REALTIME, &when);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        log_emit(level, &when, msg, addr);
+        return;
+    }
+
+    // Claim the slot for the next position, unless the drain thread is a lap behind
+    uint64_t pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+    for (;;) {
+        slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->level = level;
+    clock_gettime(CLOCK_REALTIME, &slot->when);
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    slot->has_addr = addr != NULL;
+    if (addr != NULL) {
+        slot->addr = *addr;
+    }
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1) {
+            // The drain thread still wakes on its poll timeout
+        }
+    }
+}
+
+void log_msg(int level, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_queue(level, NULL, fmt, ap);
+    va_end(ap);
+}
+
+void log_addr(int level, const struct sockaddr_storage *addr, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_queue(level, addr, fmt, ap);
+    va_end(ap);
+}
+
+// Write out every published message, returning how many there were
+static int log_drain(void) {
+    int count = 0;
+
+    for (;;) {
+        struct log_slot *slot = &ring[ring_head & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_head + 1) {
+            break;
+        }
+        log_emit(slot->level, &slot->when, slot->msg, slot->has_addr ? &slot->addr : NULL);
+        __atomic_store_n(&slot->seq, ring_head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        ring_head++;
+        count++;
+    }
+    return count;
+}
+
+// Report messages lost since the last report
+static void log_report_losses(void) {
+    static uint64_t reported_dropped, reported_suppressed;
+    uint64_t now_dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    uint64_t now_suppressed = __atomic_load_n(&suppressed, __ATOMIC_RELAXED);
+    struct timespec when;
+    char msg[LOG_MSG_MAX];
+
+    clock_gettime(CLOCK_REALTIME, &when);
+    if (now_dropped != reported_dropped) {
+        snprintf(msg, sizeof(msg), "Log ring full, dropped %llu messages",
+                 (unsigned long long)(now_dropped - reported_dropped));
+        sink->write(LOG_WARNING, &when, msg);
+        reported_dropped = now_dropped;
+    }
+    if (now_suppressed != reported_suppressed) {
+        snprintf(msg, sizeof(msg), "Rate limited %llu log messages",
+                 (unsigned long long)(now_suppressed - reported_suppressed));
+        sink->write(LOG_WARNING, &when, msg);
+        reported_suppressed = now_suppressed;
+    }
+}
+
+static void *log_thread_func(void *arg __attribute__((unused))) {
+    struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if (log_drain() > 0) {
+            continue;
+        }
+        log_report_losses();
+        // Announce the sleep, then look again so a message published meanwhile is not missed
+        __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+        if (log_drain() > 0) {
+            __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (poll(&pfd, 1, 1000) > 0) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) == -1) {
+                // Nothing to do, the ring is checked regardless
+            }
+        }
+        __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+    log_drain();
+    log_report_losses();
+    return NULL;
+}
+
+int log_start(void) {
+    sigset_t block, old;
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd == -1) {
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    // Termination signals are handled by the main thread
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int rc = pthread_create(&drain_thread, NULL, log_thread_func, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void log_stop(void) {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        // The drain thread notices within its poll timeout
+    }
+    pthread_join(drain_thread, NULL);
+    close(wake_fd);
+    wake_fd = -1;
+}
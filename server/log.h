@@ -0,0 +1,49 @@
+/*
+ * log.h
+ *
+ * Asynchronous logging for aesdsocket.  Messages are queued on a lock-free
+ * ring and written to the selected sink by a background thread, so a slow
+ * sink never stalls a connection.  Before log_start() and after log_stop()
+ * messages are written to the sink directly.
+ */
+#ifndef AESDSOCKET_LOG_H
+#define AESDSOCKET_LOG_H
+
+#include <syslog.h>
+#include <sys/socket.h>
+
+#define DEFAULT_LOG_RATE 1000   // LOG_NOTICE and less severe messages per second
+
+void log_init(const char *ident);
+
+/**
+ * Select the sink by name, -1 if unknown
+ */
+int log_set_sink(const char *name);
+
+/**
+ * Parse a syslog level name such as "warning" or "debug", -1 if unknown
+ */
+int log_parse_level(const char *name);
+void log_set_level(int level);
+
+/**
+ * Cap on routine messages per second, 0 for no cap.  Warnings and errors
+ * are never rate limited.
+ */
+void log_set_rate(unsigned int per_second);
+
+int log_start(void);
+// Write out everything queued and stop the background thread
+void log_stop(void);
+
+void log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Log a message followed by a client address, which is only formatted on the
+ * background thread
+ */
+void log_addr(int level, const struct sockaddr_storage *addr, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif /* AESDSOCKET_LOG_H */
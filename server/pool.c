@@ -0,0 +1,101 @@
+/*
+ * pool.c
+ *
+ * Each class is a LIFO free list threaded through the free buffers
+ * themselves, so the most recently used, cache-warm buffer goes out first.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+struct pool_free_buf {
+    struct pool_free_buf *next;
+};
+
+struct pool_class {
+    pthread_mutex_t lock;
+    struct pool_free_buf *free;
+    unsigned int count;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static struct pool_class classes[POOL_CLASSES] = {
+    [0 ... POOL_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+// Class holding buffers of exactly size bytes, -1 if none does
+static int pool_class_of(size_t size) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        if (size == POOL_MIN_SIZE << i) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void *pool_alloc(size_t size) {
+    int class = pool_class_of(size);
+    struct pool_free_buf *buf = NULL;
+
+    if (class == -1) {
+        return malloc(size);
+    }
+    struct pool_class *pc = &classes[class];
+    pthread_mutex_lock(&pc->lock);
+    if (pc->free != NULL) {
+        buf = pc->free;
+        pc->free = buf->next;
+        pc->count--;
+        pc->hits++;
+    } else {
+        pc->misses++;
+    }
+    pthread_mutex_unlock(&pc->lock);
+    return buf != NULL ? (void *)buf : malloc(size);
+}
+
+void pool_free(void *buf, size_t size) {
+    int class = pool_class_of(size);
+
+    if (buf == NULL) {
+        return;
+    }
+    if (class != -1) {
+        struct pool_class *pc = &classes[class];
+        pthread_mutex_lock(&pc->lock);
+        if (pc->count < POOL_CLASS_DEPTH) {
+            struct pool_free_buf *fb = buf;
+            fb->next = pc->free;
+            pc->free = fb;
+            pc->count++;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pc->lock);
+    }
+    free(buf);
+}
+
+void pool_class_stats(int class, struct pool_stats *stats) {
+    struct pool_class *pc = &classes[class];
+
+    pthread_mutex_lock(&pc->lock);
+    stats->hits = pc->hits;
+    stats->misses = pc->misses;
+    pthread_mutex_unlock(&pc->lock);
+}
+
+void pool_drain(void) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        struct pool_class *pc = &classes[i];
+        pthread_mutex_lock(&pc->lock);
+        while (pc->free != NULL) {
+            struct pool_free_buf *fb = pc->free;
+            pc->free = fb->next;
+            free(fb);
+        }
+        pc->count = 0;
+        pthread_mutex_unlock(&pc->lock);
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * pool.h
+ *
+ * Size-classed buffer pools for per-connection buffers.  Buffers of a
+ * power-of-two class between POOL_MIN_SIZE and POOL_MAX_SIZE are kept on a
+ * free list when released and handed out again, so connections coming and
+ * going and packet buffers growing and shrinking stop churning the
+ * allocator.  Other sizes go straight to malloc.
+ */
+#ifndef AESDSOCKET_POOL_H
+#define AESDSOCKET_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_MIN_SHIFT 11                       // 2 KiB
+#define POOL_CLASSES 6                          // up to 64 KiB
+#define POOL_MIN_SIZE ((size_t)1 << POOL_MIN_SHIFT)
+#define POOL_MAX_SIZE (POOL_MIN_SIZE << (POOL_CLASSES - 1))
+#define POOL_CLASS_DEPTH 64                     // free buffers kept per class
+
+struct pool_stats {
+    uint64_t hits;      // served from a free list
+    uint64_t misses;    // had to allocate
+};
+
+/**
+ * A buffer of exactly size bytes, NULL if out of memory
+ */
+void *pool_alloc(size_t size);
+void pool_free(void *buf, size_t size);
+
+/**
+ * Counters for one class, index 0 being POOL_MIN_SIZE
+ */
+void pool_class_stats(int class, struct pool_stats *stats);
+
+// Release every pooled buffer
+void pool_drain(void);
+
+#endif /* AESDSOCKET_POOL_H */
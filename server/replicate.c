@@ -0,0 +1,137 @@
+/*
+ * replicate.c
+ */
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "binproto.h"
+#include "replicate.h"
+
+int replicate_hello_check(const char *buf, size_t len) {
+    size_t n = len < REPLICATE_HELLO_LEN ? len : REPLICATE_HELLO_LEN;
+
+    if (memcmp(buf, REPLICATE_HELLO, n) != 0) {
+        return -1;
+    }
+    return n == REPLICATE_HELLO_LEN ? 1 : 0;
+}
+
+void replicate_encode_request(char *buf, uint64_t offset) {
+    memcpy(buf, REPLICATE_HELLO, REPLICATE_HELLO_LEN);
+    binproto_put_u64(buf + REPLICATE_HELLO_LEN, offset);
+}
+
+void replicate_encode_header(char *buf, const struct replicate_header *hdr) {
+    binproto_put_u64(buf, hdr->offset);
+    binproto_put_u32(buf + 8, hdr->length);
+}
+
+void replicate_decode_header(const char *buf, struct replicate_header *hdr) {
+    hdr->offset = binproto_get_u64(buf);
+    hdr->length = binproto_get_u32(buf + 8);
+}
+
+static int unix_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (unix_address(path, &addr) == -1) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_tcp(const char *address) {
+    struct addrinfo hints, *res, *p;
+    char host[256];
+    const char *port = strrchr(address, ':');
+    int fd = -1;
+
+    if (port == NULL || port == address || (size_t)(port - address) >= sizeof(host)) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Brackets around an IPv6 literal are not part of the host
+    const char *start = address;
+    size_t len = port - address;
+    if (len >= 2 && start[0] == '[' && start[len - 1] == ']') {
+        start++;
+        len -= 2;
+    }
+    memcpy(host, start, len);
+    host[len] = '\0';
+    port++;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (p = res; p != NULL; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+int replicate_connect(const char *address) {
+    return address[0] == '/' ? connect_unix(address) : connect_tcp(address);
+}
+
+int replicate_listen_unix(const char *path, int backlog) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (unix_address(path, &addr) == -1) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, backlog) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
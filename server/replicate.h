@@ -0,0 +1,56 @@
+/*
+ * replicate.h
+ *
+ * Log shipping from a primary aesdsocket to followers.  A follower connects
+ * to any of the primary's listeners and sends REPLICATE_HELLO followed by
+ * the u64 log offset it needs next.  The primary replies with a stream of
+ * records, each a header and length bytes of its log: first whatever is
+ * stored from that offset on, then every append as it is made.
+ *
+ * Offsets are positions in the primary's append-only log, so they also
+ * serve as sequence numbers.  A follower that loses the connection
+ * reconnects with the offset after the last byte it applied and the
+ * stream carries on from there.
+ */
+#ifndef AESDSOCKET_REPLICATE_H
+#define AESDSOCKET_REPLICATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REPLICATE_HELLO "\0AESD/R\n"
+#define REPLICATE_HELLO_LEN 8
+#define REPLICATE_REQUEST_LEN (REPLICATE_HELLO_LEN + 8)
+#define REPLICATE_HEADER_LEN 12
+#define REPLICATE_RETRY_SECONDS 1   // between attempts to reach the primary
+
+struct replicate_header {
+    uint64_t offset;    // log offset of the first byte that follows
+    uint32_t length;
+};
+
+/**
+ * 1 if buf starts with the hello, 0 if the len bytes so far still could,
+ * -1 if they cannot
+ */
+int replicate_hello_check(const char *buf, size_t len);
+
+// The hello and offset a follower opens with, REPLICATE_REQUEST_LEN bytes
+void replicate_encode_request(char *buf, uint64_t offset);
+
+void replicate_encode_header(char *buf, const struct replicate_header *hdr);
+void replicate_decode_header(const char *buf, struct replicate_header *hdr);
+
+/**
+ * Connect to a primary at "host:port", or at a unix socket if address
+ * starts with '/'; -1 with errno set on failure
+ */
+int replicate_connect(const char *address);
+
+/**
+ * Listen for followers on a unix socket at path, replacing any stale
+ * socket there
+ */
+int replicate_listen_unix(const char *path, int backlog);
+
+#endif /* AESDSOCKET_REPLICATE_H */
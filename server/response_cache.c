@@ -0,0 +1,222 @@
+/*
+ * response_cache.c
+ *
+ * Echo-back cache.  Backends with stable offsets keep it current by copying
+ * each append into it.  Ring backends do too, then drop the oldest commands
+ * past the ring's depth the way the ring itself does, so their offsets
+ * start at the first byte still held.  The next full echo after the cache
+ * was dropped refills it from the snapshot it streams.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "response_cache.h"
+
+static void cache_drop(struct response_cache *cache) {
+    segment_put(cache->buf);
+    cache->buf = NULL;
+    cache->used = 0;
+    cache->commands = 0;
+    cache->cached_generation = 0;
+}
+
+// Commands in len bytes, counting an unterminated tail
+static unsigned int count_commands(const char *data, size_t len) {
+    unsigned int commands = 0;
+    const char *end = data + len;
+
+    while (data < end) {
+        const char *newline = memchr(data, '\n', end - data);
+        commands++;
+        data = newline != NULL ? newline + 1 : end;
+    }
+    return commands;
+}
+
+// Evict the oldest commands the way a ring of entries commands does
+static void cache_trim_ring(struct response_cache *cache, unsigned int entries) {
+    while (cache->commands > entries) {
+        size_t first = -cache->base;
+        const char *newline = memchr(cache->buf->data + first, '\n', cache->used - first);
+        // Views of the front keep their bytes, only base moves past them
+        cache->base -= newline + 1 - (cache->buf->data + first);
+        cache->commands--;
+    }
+}
+
+// Capacity for at least need bytes, doubling within the cap
+static size_t cache_capacity(const struct response_cache *cache, size_t current, size_t need) {
+    size_t cap = current ? current : 4096;
+
+    while (cap < need) {
+        cap *= 2;
+    }
+    return cap > cache->cap ? cache->cap : cap;
+}
+
+void cache_note_append(struct response_cache *cache, struct storage *st, const char *buf, size_t len) {
+    int current = cache->buf != NULL && cache->cached_generation == cache->generation;
+
+    cache->generation++;
+    if (!current || (!st->ops->append_only && st->ops->ring_entries == 0)) {
+        cache_drop(cache);
+        return;
+    }
+    if (st->ops->ring_entries > 0) {
+        // An unterminated newest command is extended rather than added to
+        int open = cache->used > 0 && cache->buf->data[cache->used - 1] != '\n';
+        size_t first = -cache->base;
+        if (cache->used + len > cache->buf->len) {
+            if (cache->used - first + len > cache->cap) {
+                cache_drop(cache);
+                return;
+            }
+            struct data_segment *grown = segment_alloc(cache_capacity(cache, cache->buf->len,
+                                                                      cache->used - first + len));
+            if (grown == NULL) {
+                cache_drop(cache);
+                return;
+            }
+            memcpy(grown->data, cache->buf->data + first, cache->used - first);
+            cache->used -= first;
+            cache->base = 0;
+            segment_put(cache->buf);
+            cache->buf = grown;
+        }
+        memcpy(cache->buf->data + cache->used, buf, len);
+        cache->used += len;
+        cache->commands += count_commands(buf, len) - open;
+        cache_trim_ring(cache, st->ops->ring_entries);
+        cache->cached_generation = cache->generation;
+        return;
+    }
+    if (cache->used + len > cache->buf->len) {
+        // Keep only what the backend still retains, then regrow
+        off_t stored = st->ops->size(st);
+        size_t keep = stored > (off_t)len ? (size_t)stored - len : 0;
+        if (keep > cache->used) {
+            keep = cache->used;
+        }
+        if (keep + len > cache->cap) {
+            cache_drop(cache);
+            return;
+        }
+        struct data_segment *grown = segment_alloc(cache_capacity(cache, cache->buf->len, keep + len));
+        if (grown == NULL) {
+            cache_drop(cache);
+            return;
+        }
+        memcpy(grown->data, cache->buf->data + cache->used - keep, keep);
+        cache->base += cache->used - keep;
+        cache->used = keep;
+        // Views of the old buffer keep it alive
+        segment_put(cache->buf);
+        cache->buf = grown;
+    }
+    memcpy(cache->buf->data + cache->used, buf, len);
+    cache->used += len;
+    cache->cached_generation = cache->generation;
+}
+
+void cache_invalidate(struct response_cache *cache) {
+    cache->generation++;
+    cache_drop(cache);
+}
+
+static int cache_view_of(struct response_cache *cache, size_t offset, size_t len, struct cache_view *view) {
+    view->seg = segment_get(cache->buf);
+    view->data = cache->buf->data + offset;
+    view->len = len;
+    return 1;
+}
+
+// Everything the backend holds, 1 on a hit
+int cache_lookup_all(struct response_cache *cache, struct storage *st, struct cache_view *view) {
+    if (cache->buf == NULL || cache->cached_generation != cache->generation) {
+        return 0;
+    }
+    if (!st->ops->append_only) {
+        return cache_view_of(cache, -cache->base, cache->used + cache->base, view);
+    }
+    // Retention may have dropped the front since the bytes were cached
+    off_t stored = st->ops->size(st);
+    if (stored < 0 || (size_t)stored > cache->used) {
+        return 0;
+    }
+    return cache_view_of(cache, cache->used - stored, stored, view);
+}
+
+// The range a seek or range snapshot covers, 1 on a hit
+int cache_lookup_range(struct response_cache *cache, const struct storage_snapshot *snap,
+                       struct cache_view *view) {
+    if (cache->buf == NULL || cache->cached_generation != cache->generation || snap->size == -1 ||
+        snap->offset < cache->base || snap->size > cache->base + (off_t)cache->used) {
+        return 0;
+    }
+    return cache_view_of(cache, snap->offset - cache->base, snap->size - snap->offset, view);
+}
+
+void cache_view_release(struct cache_view *view) {
+    segment_put(view->seg);
+    view->seg = NULL;
+}
+
+void cache_fill_begin(struct response_cache *cache, const struct storage_snapshot *snap,
+                      struct cache_fill *fill) {
+    fill->buf = NULL;
+    fill->used = 0;
+    fill->base = snap->offset;
+    fill->generation = cache->generation;
+    // A snapshot already larger than the cap is streamed without filling
+    fill->active = cache->cap > 0 && (snap->size == -1 || (size_t)(snap->size - snap->offset) <= cache->cap);
+}
+
+void cache_fill_add(struct response_cache *cache, struct cache_fill *fill, const char *data, size_t len) {
+    if (!fill->active) {
+        return;
+    }
+    if (fill->used + len > cache->cap) {
+        cache_fill_abandon(fill);
+        return;
+    }
+    if (fill->buf == NULL || fill->used + len > fill->buf->len) {
+        struct data_segment *grown = segment_alloc(cache_capacity(cache, fill->buf ? fill->buf->len : 0,
+                                                                  fill->used + len));
+        if (grown == NULL) {
+            cache_fill_abandon(fill);
+            return;
+        }
+        if (fill->buf != NULL) {
+            memcpy(grown->data, fill->buf->data, fill->used);
+            segment_put(fill->buf);
+        }
+        fill->buf = grown;
+    }
+    memcpy(fill->buf->data + fill->used, data, len);
+    fill->used += len;
+}
+
+// Install a completed fill unless an append has made it stale meanwhile
+void cache_fill_commit(struct response_cache *cache, struct cache_fill *fill) {
+    if (fill->active && fill->buf != NULL && fill->generation == cache->generation &&
+        cache->cached_generation != cache->generation) {
+        segment_put(cache->buf);
+        cache->buf = fill->buf;
+        cache->base = fill->base;
+        cache->used = fill->used;
+        cache->commands = count_commands(fill->buf->data, fill->used);
+        cache->cached_generation = fill->generation;
+        fill->buf = NULL;
+    }
+    cache_fill_abandon(fill);
+}
+
+void cache_fill_abandon(struct cache_fill *fill) {
+    segment_put(fill->buf);
+    fill->buf = NULL;
+    fill->active = 0;
+}
+
+void cache_free(struct response_cache *cache) {
+    cache_drop(cache);
+}
@@ -0,0 +1,70 @@
+/*
+ * response_cache.h
+ *
+ * In-memory copy of the stored data for echo-backs, tagged with a
+ * generation number that every append bumps.
+ */
+#ifndef AESDSOCKET_RESPONSE_CACHE_H
+#define AESDSOCKET_RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "storage.h"
+
+#define DEFAULT_CACHE_BYTES (4 * 1024 * 1024)
+
+/*
+ * The contents live in one segment used as a buffer, buf->len being its
+ * capacity.  Bytes are only ever added past every reader's view, so views
+ * are read without the lock while appends extend the buffer in place.
+ */
+struct response_cache {
+    size_t cap;                     // memory cap, 0 disables the cache
+    uint64_t generation;            // bumped by every append
+    uint64_t cached_generation;     // generation the contents match, 0 if none
+    struct data_segment *buf;
+    off_t base;                     // storage offset of buf->data[0], -(first byte held) for a ring
+    size_t used;
+    unsigned int commands;          // newline terminated commands held, counting an open last one
+};
+
+// Cached bytes pinned for one response
+struct cache_view {
+    struct data_segment *seg;       // NULL on a miss
+    const char *data;
+    size_t len;
+};
+
+// Contents gathered while a missed snapshot is streamed, installed if still current
+struct cache_fill {
+    struct data_segment *buf;
+    size_t used;
+    off_t base;
+    uint64_t generation;
+    int active;
+};
+
+/*
+ * Functions taking the cache without a view or fill in progress are
+ * serialized by the caller's storage lock.
+ */
+void cache_note_append(struct response_cache *cache, struct storage *st, const char *buf, size_t len);
+// Forget the contents after stored data changed other than by an append
+void cache_invalidate(struct response_cache *cache);
+int cache_lookup_all(struct response_cache *cache, struct storage *st, struct cache_view *view);
+int cache_lookup_range(struct response_cache *cache, const struct storage_snapshot *snap,
+                       struct cache_view *view);
+void cache_view_release(struct cache_view *view);
+
+void cache_fill_begin(struct response_cache *cache, const struct storage_snapshot *snap,
+                      struct cache_fill *fill);
+// Called without the lock for each chunk streamed from the snapshot
+void cache_fill_add(struct response_cache *cache, struct cache_fill *fill, const char *data, size_t len);
+void cache_fill_commit(struct response_cache *cache, struct cache_fill *fill);
+void cache_fill_abandon(struct cache_fill *fill);
+
+void cache_free(struct response_cache *cache);
+
+#endif /* AESDSOCKET_RESPONSE_CACHE_H */
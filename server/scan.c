@@ -0,0 +1,267 @@
+/*
+ * scan.c
+ *
+ * The vector scanners compare a whole block against '\n' and walk the set
+ * bits of the resulting mask.  A block without a newline hands the search
+ * to the C library's memchr until the next one, so long packets scan as
+ * fast as memchr does and short ones skip its per call overhead.  Builds
+ * for other architectures get the scalar scanner, which is memchr alone.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+static size_t scan_scalar(const char *buf, size_t len, size_t *ends, size_t max) {
+    size_t count = 0;
+    const char *p = buf;
+    const char *end = buf + len;
+
+    while (count < max && (p = memchr(p, '\n', end - p)) != NULL) {
+        ends[count++] = p - buf;
+        p++;
+    }
+    return count;
+}
+
+#ifdef SCAN_X86
+// Record the newlines flagged in the 64 byte block mask for offset
+static inline size_t scan_mask(uint64_t mask, size_t offset, size_t *ends, size_t count, size_t max) {
+    while (mask != 0 && count < max) {
+        ends[count++] = offset + __builtin_ctzll(mask);
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+/*
+ * After a block without a newline the packet is likely a long one, which
+ * the C library's memchr crosses faster than a mask per block.  Moves *i
+ * to the next newline, 0 if there is none.
+ */
+static inline int scan_skip(const char *buf, size_t len, size_t *i) {
+    const char *next = memchr(buf + *i + 64, '\n', len - *i - 64);
+
+    if (next == NULL) {
+        return 0;
+    }
+    *i = next - buf;
+    return 1;
+}
+
+// Scan what is left after the last whole block, offsetting the results
+static size_t scan_tail(const char *buf, size_t len, size_t i, size_t *ends, size_t count, size_t max) {
+    if (count == max || i == len) {
+        return count;
+    }
+    size_t tail = scan_scalar(buf + i, len - i, ends + count, max - count);
+    for (size_t j = count; j < count + tail; j++) {
+        ends[j] += i;
+    }
+    return count + tail;
+}
+
+static size_t scan_sse2(const char *buf, size_t len, size_t *ends, size_t max) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 64 <= len && count < max) {
+        const __m128i *block = (const __m128i *)(buf + i);
+        uint64_t m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block), newline));
+        uint64_t m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 1), newline));
+        uint64_t m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 2), newline));
+        uint64_t m3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 3), newline));
+        uint64_t mask = m0 | m1 << 16 | m2 << 32 | m3 << 48;
+        if (mask == 0 && !scan_skip(buf, len, &i)) {
+            return count;
+        }
+        if (mask != 0) {
+            count = scan_mask(mask, i, ends, count, max);
+            i += 64;
+        }
+    }
+    return scan_tail(buf, len, i, ends, count, max);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, size_t *ends, size_t max) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 64 <= len && count < max) {
+        const __m256i *block = (const __m256i *)(buf + i);
+        uint32_t m0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(block), newline));
+        uint32_t m1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(block + 1), newline));
+        uint64_t mask = m0 | (uint64_t)m1 << 32;
+        if (mask == 0 && !scan_skip(buf, len, &i)) {
+            return count;
+        }
+        if (mask != 0) {
+            count = scan_mask(mask, i, ends, count, max);
+            i += 64;
+        }
+    }
+    return scan_tail(buf, len, i, ends, count, max);
+}
+#endif
+
+static size_t (*scan_impl)(const char *, size_t, size_t *, size_t) = scan_scalar;
+
+size_t scan_newlines(const char *buf, size_t len, size_t *ends, size_t max) {
+    return scan_impl(buf, len, ends, max);
+}
+
+int scan_select(enum scan_impl impl) {
+    switch (impl) {
+    case SCAN_SCALAR:
+        scan_impl = scan_scalar;
+        return 0;
+#ifdef SCAN_X86
+    case SCAN_SSE2:
+        scan_impl = scan_sse2;
+        return 0;
+    case SCAN_AVX2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2")) {
+            return -1;
+        }
+        scan_impl = scan_avx2;
+        return 0;
+#endif
+    default:
+        return -1;
+    }
+}
+
+const char *scan_impl_name(enum scan_impl impl) {
+    static const char *const names[] = { "scalar", "sse2", "avx2" };
+
+    return names[impl];
+}
+
+__attribute__((constructor))
+static void scan_select_best(void) {
+    if (scan_select(SCAN_AVX2) == -1) {
+        scan_select(SCAN_SSE2);
+    }
+}
+
+void scan_lines_init(struct scan_lines *lines, const char *data, size_t len) {
+    lines->data = data;
+    lines->len = len;
+    lines->scanned = 0;
+    lines->count = 0;
+    lines->next = 0;
+}
+
+size_t scan_lines_peek(struct scan_lines *lines) {
+    if (lines->next == lines->count) {
+        if (lines->scanned == lines->len) {
+            return 0;
+        }
+        size_t base = lines->scanned;
+        lines->count = scan_newlines(lines->data + base, lines->len - base, lines->ends, SCAN_BATCH);
+        lines->next = 0;
+        if (lines->count == 0) {
+            lines->scanned = lines->len;
+            return 0;
+        }
+        // A full batch may have stopped short of the end
+        for (size_t i = 0; i < lines->count; i++) {
+            lines->ends[i] += base;
+        }
+        lines->scanned = lines->count == SCAN_BATCH ? lines->ends[SCAN_BATCH - 1] + 1 : lines->len;
+    }
+    return lines->ends[lines->next] + 1;
+}
+
+size_t scan_lines_next(struct scan_lines *lines) {
+    size_t end = scan_lines_peek(lines);
+
+    if (end != 0) {
+        lines->next++;
+    }
+    return end;
+}
+
+// Parse digits ending in stop at *p, advancing past stop; 0 if malformed or too large
+static int parse_number(const char **p, const char *end, char stop, unsigned long long *value) {
+    const char *s = *p;
+    unsigned long long v = 0;
+
+    if (s == end || *s < '0' || *s > '9') {
+        return 0;
+    }
+    for (; s < end && *s >= '0' && *s <= '9'; s++) {
+        unsigned int digit = *s - '0';
+        if (v > (~0ULL - digit) / 10) {
+            return 0;
+        }
+        v = v * 10 + digit;
+    }
+    if (s == end || *s != stop) {
+        return 0;
+    }
+    *p = s + 1;
+    *value = v;
+    return 1;
+}
+
+// Parse "X,Y\n" filling the rest of the line after a command's prefix
+static int parse_pair(const char *args, const char *end, unsigned long long *x, unsigned long long *y) {
+    return parse_number(&args, end, ',', x) && parse_number(&args, end, '\n', y) && args == end;
+}
+
+#define COMMAND_PREFIX "AESDCHAR_"
+#define COMMAND_PREFIX_LEN (sizeof(COMMAND_PREFIX) - 1)
+
+// Whether the line continues with name after the common prefix
+#define HAS_NAME(rest, rest_len, name) \
+    ((rest_len) >= sizeof(name) - 1 && memcmp((rest), (name), sizeof(name) - 1) == 0)
+
+enum text_command parse_text_command(const char *buffer, size_t len, unsigned long long *x, unsigned long long *y) {
+    // Ordinary packets are turned away on their first bytes
+    if (len <= COMMAND_PREFIX_LEN || buffer[0] != 'A' ||
+        memcmp(buffer, COMMAND_PREFIX, COMMAND_PREFIX_LEN) != 0) {
+        return TEXT_PACKET;
+    }
+    const char *rest = buffer + COMMAND_PREFIX_LEN;
+    const char *end = buffer + len;
+    size_t rest_len = len - COMMAND_PREFIX_LEN;
+
+    switch (rest[0]) {
+    case 'C':
+        // Any method is a compress command, only deflate turns it on
+        if (HAS_NAME(rest, rest_len, "COMPRESS:") && rest_len > 9) {
+            *x = rest_len == 17 && memcmp(rest + 9, "deflate\n", 8) == 0;
+            return TEXT_COMPRESS;
+        }
+        break;
+    case 'S':
+        if (rest_len == 10 && memcmp(rest, "SUBSCRIBE\n", 10) == 0) {
+            return TEXT_SUBSCRIBE;
+        }
+        break;
+    case 'I':
+        if (HAS_NAME(rest, rest_len, "IOCSEEKTO:") && parse_pair(rest + 10, end, x, y)) {
+            return *x <= UINT32_MAX && *y <= UINT32_MAX ? TEXT_SEEKTO : TEXT_PACKET;
+        }
+        break;
+    case 'R':
+        if (HAS_NAME(rest, rest_len, "READ:") && parse_pair(rest + 5, end, x, y)) {
+            return TEXT_READ;
+        }
+        if (HAS_NAME(rest, rest_len, "READPACKETS:") && parse_pair(rest + 12, end, x, y)) {
+            return *x <= UINT32_MAX && *y <= UINT32_MAX ? TEXT_READPACKETS : TEXT_PACKET;
+        }
+        break;
+    }
+    return TEXT_PACKET;
+}
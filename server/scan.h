@@ -0,0 +1,68 @@
+/*
+ * scan.h
+ *
+ * Packet boundaries and text commands in received data.  Newlines are
+ * found a batch at a time with the widest vector compare the CPU offers,
+ * and commands are recognised in place, without copying their arguments.
+ */
+#ifndef AESDSOCKET_SCAN_H
+#define AESDSOCKET_SCAN_H
+
+#include <stddef.h>
+
+#define SCAN_BATCH 256      // newlines found per pass over the buffer
+
+enum scan_impl {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+};
+
+/**
+ * Store the offsets of up to max newlines in buf[0, len) in ends, in order,
+ * returning how many were found
+ */
+size_t scan_newlines(const char *buf, size_t len, size_t *ends, size_t max);
+
+/**
+ * Use impl from now on, -1 if this CPU or build lacks it.  The best one
+ * available is picked at startup.
+ */
+int scan_select(enum scan_impl impl);
+const char *scan_impl_name(enum scan_impl impl);
+
+// Newline terminated lines of a buffer, handed out from one scan per batch
+struct scan_lines {
+    const char *data;
+    size_t len;
+    size_t scanned;         // bytes before this have been scanned
+    size_t count;
+    size_t next;
+    size_t ends[SCAN_BATCH];
+};
+
+void scan_lines_init(struct scan_lines *lines, const char *data, size_t len);
+
+/**
+ * Offset just past the newline ending the next line, 0 when none is left;
+ * peek leaves the line to be taken again
+ */
+size_t scan_lines_peek(struct scan_lines *lines);
+size_t scan_lines_next(struct scan_lines *lines);
+
+enum text_command {
+    TEXT_PACKET,        // not a command, stored like any packet
+    TEXT_SEEKTO,        // AESDCHAR_IOCSEEKTO:write_cmd,write_cmd_offset
+    TEXT_READ,          // AESDCHAR_READ:offset,length (0 reads to the end)
+    TEXT_READPACKETS,   // AESDCHAR_READPACKETS:first,last (inclusive)
+    TEXT_COMPRESS,      // AESDCHAR_COMPRESS:deflate or AESDCHAR_COMPRESS:none
+    TEXT_SUBSCRIBE,     // AESDCHAR_SUBSCRIBE
+};
+
+/**
+ * Recognise the newline terminated line in buffer, filling in the
+ * command's arguments: x and y for the pairs, x = 1 for deflate
+ */
+enum text_command parse_text_command(const char *buffer, size_t len, unsigned long long *x, unsigned long long *y);
+
+#endif /* AESDSOCKET_SCAN_H */
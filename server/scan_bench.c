@@ -0,0 +1,183 @@
+/*
+ * scan_bench.c
+ *
+ * Throughput of splitting a large multi-packet read into packets and
+ * recognising the text commands among them, as process_packets does.  The
+ * baseline is the earlier approach: memchr for each packet and a parser
+ * that copies each argument out with strncpy before strtoull.
+ *
+ * Build with "make bench" and run ./scan_bench [megabytes] [rounds] [longest_packet].
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scan.h"
+
+struct tally {
+    size_t packets;
+    size_t commands;
+    unsigned long long args;    // sum of every parsed argument
+};
+
+static int legacy_pair(const char *buffer, int buffer_len, const char *prefix,
+                       unsigned long long *x, unsigned long long *y) {
+    const int prefix_len = strlen(prefix);
+    char x_str[32], y_str[32];
+    char *endptr;
+
+    if (buffer_len < prefix_len + 3 || strncmp(buffer, prefix, prefix_len) != 0) {
+        return 0;
+    }
+    const char *end = buffer + buffer_len;
+    const char *comma = memchr(buffer + prefix_len, ',', end - (buffer + prefix_len));
+    if (comma == NULL) {
+        return 0;
+    }
+    const char *newline = memchr(comma, '\n', end - comma);
+    if (newline == NULL) {
+        return 0;
+    }
+    int x_len = comma - (buffer + prefix_len);
+    int y_len = newline - (comma + 1);
+    if (x_len >= (int)sizeof(x_str) || y_len >= (int)sizeof(y_str)) {
+        return 0;
+    }
+    strncpy(x_str, buffer + prefix_len, x_len);
+    x_str[x_len] = '\0';
+    strncpy(y_str, comma + 1, y_len);
+    y_str[y_len] = '\0';
+    *x = strtoull(x_str, &endptr, 10);
+    if (*endptr != '\0') {
+        return 0;
+    }
+    *y = strtoull(y_str, &endptr, 10);
+    return *endptr == '\0';
+}
+
+static enum text_command legacy_command(const char *buffer, int len, unsigned long long *x, unsigned long long *y) {
+    if (len >= 19 && strncmp(buffer, "AESDCHAR_COMPRESS:", 18) == 0) {
+        *x = len == 26 && memcmp(buffer + 18, "deflate\n", 8) == 0;
+        return TEXT_COMPRESS;
+    }
+    if (len == 19 && memcmp(buffer, "AESDCHAR_SUBSCRIBE\n", 19) == 0) {
+        return TEXT_SUBSCRIBE;
+    }
+    if (legacy_pair(buffer, len, "AESDCHAR_IOCSEEKTO:", x, y)) {
+        return TEXT_SEEKTO;
+    }
+    if (legacy_pair(buffer, len, "AESDCHAR_READ:", x, y)) {
+        return TEXT_READ;
+    }
+    if (legacy_pair(buffer, len, "AESDCHAR_READPACKETS:", x, y)) {
+        return TEXT_READPACKETS;
+    }
+    return TEXT_PACKET;
+}
+
+static void count(struct tally *t, enum text_command cmd, unsigned long long x, unsigned long long y) {
+    t->packets++;
+    if (cmd == TEXT_SEEKTO || cmd == TEXT_READ || cmd == TEXT_READPACKETS) {
+        t->commands++;
+        t->args += x + y;
+    }
+}
+
+static void run_legacy(const char *buf, size_t len, struct tally *t) {
+    size_t start = 0;
+
+    while (start < len) {
+        unsigned long long x = 0, y = 0;
+        size_t end = (const char *)memchr(buf + start, '\n', len - start) - buf + 1;
+        enum text_command cmd = legacy_command(buf + start, end - start, &x, &y);
+        count(t, cmd, x, y);
+        start = end;
+    }
+}
+
+static void run_scan(const char *buf, size_t len, struct tally *t) {
+    struct scan_lines lines;
+    size_t start = 0;
+    size_t end;
+
+    scan_lines_init(&lines, buf, len);
+    while ((end = scan_lines_next(&lines)) != 0) {
+        unsigned long long x = 0, y = 0;
+        enum text_command cmd = parse_text_command(buf + start, end - start, &x, &y);
+        count(t, cmd, x, y);
+        start = end;
+    }
+}
+
+// Packets of 8 to longest bytes with a command every hundred or so
+static size_t fill(char *buf, size_t size, size_t longest) {
+    static const char *const commands[] = {
+        "AESDCHAR_IOCSEEKTO:%u,%u\n", "AESDCHAR_READ:%u,%u\n", "AESDCHAR_READPACKETS:%u,%u\n",
+    };
+    unsigned int seed = 1;
+    size_t len = 0;
+
+    while (len + longest + 64 < size) {
+        seed = seed * 1103515245 + 12345;
+        unsigned int r = seed >> 8;
+        if (r % 100 == 0) {
+            len += sprintf(buf + len, commands[(r / 100) % 3], (r / 100) % 1000, (r / 7) % 97);
+        } else {
+            size_t n = 8 + r % (longest - 7);
+            for (size_t i = 0; i < n - 1; i++) {
+                buf[len + i] = 'a' + (r + i) % 26;
+            }
+            buf[len + n - 1] = '\n';
+            len += n;
+        }
+    }
+    return len;
+}
+
+static double seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t len, int rounds, double elapsed, const struct tally *t) {
+    printf("%-8s %8.1f MB/s  %zu packets, %zu commands, args %llu\n", name,
+           (double)len * rounds / elapsed / 1e6, t->packets / rounds, t->commands / rounds, t->args / rounds);
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 64) << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    size_t longest = argc > 3 ? strtoul(argv[3], NULL, 10) : 200;
+    char *buf = malloc(size);
+
+    if (buf == NULL || rounds <= 0 || longest < 8) {
+        fprintf(stderr, "Usage: %s [megabytes] [rounds] [longest_packet]\n", argv[0]);
+        return 1;
+    }
+    size_t len = fill(buf, size, longest);
+
+    struct tally t = { 0 };
+    double start = seconds();
+    for (int i = 0; i < rounds; i++) {
+        run_legacy(buf, len, &t);
+    }
+    report("legacy", len, rounds, seconds() - start, &t);
+
+    for (enum scan_impl impl = SCAN_SCALAR; impl <= SCAN_AVX2; impl++) {
+        if (scan_select(impl) == -1) {
+            printf("%-8s unavailable\n", scan_impl_name(impl));
+            continue;
+        }
+        memset(&t, 0, sizeof(t));
+        start = seconds();
+        for (int i = 0; i < rounds; i++) {
+            run_scan(buf, len, &t);
+        }
+        report(scan_impl_name(impl), len, rounds, seconds() - start, &t);
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * storage.c
+ *
+ * Backend registry and helpers shared by the storage backends.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "log.h"
+#include "storage.h"
+
+static const struct storage_ops *backends[] = {
+    &file_storage_ops,
+    &chardev_storage_ops,
+    &ring_storage_ops,
+    &mmap_storage_ops,
+};
+
+#define BACKEND_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+struct data_segment *segment_alloc(size_t len) {
+    struct data_segment *seg = malloc(sizeof(struct data_segment) + len);
+    if (seg != NULL) {
+        seg->refs = 1;
+        seg->len = len;
+    }
+    return seg;
+}
+
+struct data_segment *segment_get(struct data_segment *seg) {
+    __atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+    return seg;
+}
+
+void segment_put(struct data_segment *seg) {
+    if (seg != NULL && __atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(seg);
+    }
+}
+
+// Record a new command starting at pos
+static int command_index_push(struct command_index *idx, off_t pos) {
+    if (idx->count == idx->cap) {
+        size_t new_cap = idx->cap ? idx->cap * 2 : 64;
+        off_t *starts = realloc(idx->starts, new_cap * sizeof(off_t));
+        if (starts == NULL) {
+            return -1;
+        }
+        idx->starts = starts;
+        idx->cap = new_cap;
+    }
+    idx->starts[idx->count++] = pos;
+    return 0;
+}
+
+// Index the commands in len bytes appended at offset base
+int command_index_append(struct command_index *idx, off_t base, const char *buf, size_t len) {
+    size_t i = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (!idx->open && command_index_push(idx, base) == -1) {
+        return -1;
+    }
+    for (;;) {
+        const char *newline = memchr(buf + i, '\n', len - i);
+        if (newline == NULL) {
+            break;
+        }
+        i = newline - buf + 1;
+        if (i == len) {
+            break;
+        }
+        if (command_index_push(idx, base + i) == -1) {
+            return -1;
+        }
+    }
+    idx->open = buf[len - 1] != '\n';
+    return 0;
+}
+
+// Translate a command, counted from the oldest kept, and offset within it to a byte position
+int command_index_locate(const struct command_index *idx, off_t size,
+                         uint32_t write_cmd, uint32_t write_cmd_offset, off_t *pos) {
+    size_t cmd = idx->head + write_cmd;
+
+    if (write_cmd >= idx->count - idx->head) {
+        return -1;
+    }
+    off_t end = cmd + 1 < idx->count ? idx->starts[cmd + 1] : size;
+    if (idx->starts[cmd] + (off_t)write_cmd_offset >= end) {
+        return -1;
+    }
+    *pos = idx->starts[cmd] + write_cmd_offset;
+    return 0;
+}
+
+/*
+ * Forget the commands that ended before base, the new start of the stream.
+ * A command cut by base keeps its remaining bytes.  Trimmed slots are only
+ * reclaimed once they are half the array, so trimming is amortized O(1).
+ */
+void command_index_trim(struct command_index *idx, off_t base) {
+    while (idx->head + 1 < idx->count && idx->starts[idx->head + 1] <= base) {
+        idx->head++;
+    }
+    if (idx->head < idx->count && idx->starts[idx->head] < base) {
+        idx->starts[idx->head] = base;
+    }
+    if (idx->head > idx->count / 2) {
+        memmove(idx->starts, idx->starts + idx->head, (idx->count - idx->head) * sizeof(off_t));
+        idx->count -= idx->head;
+        idx->head = 0;
+    }
+}
+
+void command_index_free(struct command_index *idx) {
+    free(idx->starts);
+    memset(idx, 0, sizeof(*idx));
+}
+
+struct storage *storage_open(const char *name, const struct storage_config *config) {
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        if (strcmp(backends[i]->name, name) != 0) {
+            continue;
+        }
+        struct storage *st = calloc(1, sizeof(struct storage));
+        if (st == NULL) {
+            return NULL;
+        }
+        st->ops = backends[i];
+        st->config = config;
+        if (st->ops->open(st) == -1) {
+            log_msg(LOG_ERR, "Failed to open %s storage", name);
+            free(st);
+            return NULL;
+        }
+        return st;
+    }
+    log_msg(LOG_ERR, "Unknown storage backend %s", name);
+    return NULL;
+}
+
+int storage_range_snapshot(struct storage *st, off_t offset, off_t len, struct storage_snapshot *snap) {
+    if (st->ops->snapshot(st, snap) == -1) {
+        return -1;
+    }
+    if (snap->size == -1) {
+        // Without a known end only the whole contents can be served
+        st->ops->snapshot_release(st, snap);
+        errno = EINVAL;
+        return -1;
+    }
+    if (offset > snap->size - snap->offset) {
+        offset = snap->size - snap->offset;
+    }
+    snap->offset += offset;
+    if (len != 0 && len < snap->size - snap->offset) {
+        snap->size = snap->offset + len;
+    }
+    return 0;
+}
+
+int storage_packet_snapshot(struct storage *st, uint32_t first, uint32_t last, struct storage_snapshot *snap) {
+    if (last < first) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (st->ops->seek_snapshot(st, first, 0, snap) == -1) {
+        return -1;
+    }
+    if (last < UINT32_MAX && st->ops->snapshot_truncate(st, snap, last + 1) == -1) {
+        st->ops->snapshot_release(st, snap);
+        return -1;
+    }
+    return 0;
+}
+
+void storage_close(struct storage *st) {
+    if (st != NULL) {
+        st->ops->close(st);
+        free(st);
+    }
+}
+
+int storage_parse_config(struct storage_config *config, char *options) {
+    enum { OPT_SEGMENT, OPT_BYTES, OPT_AGE, OPT_PACKETS };
+    char *const keys[] = { "segment", "bytes", "age", "packets", NULL };
+    char *value, *end;
+
+    while (*options != '\0') {
+        int key = getsubopt(&options, keys, &value);
+        if (key == -1 || value == NULL) {
+            return -1;
+        }
+        unsigned long long n = strtoull(value, &end, 10);
+        if (*end != '\0') {
+            return -1;
+        }
+        switch (key) {
+        case OPT_SEGMENT:
+            if (n == 0) {
+                return -1;
+            }
+            config->segment_size = n;
+            break;
+        case OPT_BYTES:
+            config->retain_bytes = n;
+            break;
+        case OPT_AGE:
+            config->retain_age = n;
+            break;
+        case OPT_PACKETS:
+            config->retain_packets = n;
+            break;
+        }
+    }
+    return 0;
+}
+
+const char *storage_names(void) {
+    static char names[64];
+
+    if (names[0] == '\0') {
+        for (size_t i = 0; i < BACKEND_COUNT; i++) {
+            if (i > 0) {
+                strncat(names, "|", sizeof(names) - strlen(names) - 1);
+            }
+            strncat(names, backends[i]->name, sizeof(names) - strlen(names) - 1);
+        }
+    }
+    return names;
+}
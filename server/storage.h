@@ -0,0 +1,163 @@
+/*
+ * storage.h
+ *
+ * Storage backends for aesdsocket packets, selected at startup with -S.
+ */
+#ifndef AESDSOCKET_STORAGE_H
+#define AESDSOCKET_STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FILE_DATA_PATH "/var/tmp/aesdsocketdata"
+#define CHAR_DEVICE_PATH "/dev/aesdchar"
+
+// An immutable, reference counted chunk of stored data
+struct data_segment {
+    int refs;
+    size_t len;
+    char data[];
+};
+
+struct data_segment *segment_alloc(size_t len);
+struct data_segment *segment_get(struct data_segment *seg);
+void segment_put(struct data_segment *seg);
+
+/*
+ * A consistent view of the stored data taken under the caller's lock and
+ * read afterwards without it, while other connections keep appending.
+ */
+struct storage_snapshot {
+    off_t offset;   // next byte to read
+    off_t size;     // end of the snapshot, -1 to read until the backend's EOF
+    int fd;         // descriptor pinned by the snapshot, -1 if unused
+    void *priv;     // backend state pinned by the snapshot
+};
+
+struct storage;
+
+/*
+ * Backend operations.  append, snapshot, seek_snapshot and size are
+ * serialized by the caller; snapshot_read and snapshot_release may run
+ * concurrently with them and with each other on different snapshots.
+ */
+struct storage_ops {
+    const char *name;
+    // Whether periodic timestamp records are stored in this backend
+    int timestamps;
+    // Whether snapshot offsets keep naming the same bytes as appends are made
+    int append_only;
+    // Whether close leaves the data for a successor when st->keep is set
+    int handoff;
+    // Commands kept by a ring that drops the oldest as appends arrive, 0 for a log
+    unsigned int ring_entries;
+    int (*open)(struct storage *st);
+    // Release resources and remove the data, unless st->keep asks to hand it on
+    void (*close)(struct storage *st);
+    int (*append)(struct storage *st, const char *buf, size_t len);
+    // Snapshot of everything stored so far, read from the start
+    int (*snapshot)(struct storage *st, struct storage_snapshot *snap);
+    // Snapshot read from write_cmd_offset bytes into command write_cmd
+    int (*seek_snapshot)(struct storage *st, uint32_t write_cmd, uint32_t write_cmd_offset,
+                         struct storage_snapshot *snap);
+    // End a snapshot where command end_cmd starts, unchanged if there is no such command
+    int (*snapshot_truncate)(struct storage *st, struct storage_snapshot *snap, uint32_t end_cmd);
+    // Copy up to len bytes at snap->offset and advance it, 0 at the end
+    ssize_t (*snapshot_read)(struct storage *st, struct storage_snapshot *snap, char *buf, size_t len);
+    void (*snapshot_release)(struct storage *st, struct storage_snapshot *snap);
+    // Bytes currently stored, -1 on error
+    off_t (*size)(struct storage *st);
+    /*
+     * Drop everything stored and carry on at offset, past the end of the
+     * log, so a follower's offsets stay those of its primary when the
+     * primary no longer stores what comes next.  NULL for backends that
+     * cannot follow a primary.
+     */
+    int (*skip)(struct storage *st, off_t offset);
+    /*
+     * Durable storage, NULL where data lives only in memory or the driver.
+     * sync_begin is serialized like append and captures everything appended
+     * so far in *handle, NULL if that is already durable; sync_finish then
+     * waits for it without the caller's lock and releases the handle.
+     */
+    int (*sync_begin)(struct storage *st, void **handle);
+    int (*sync_finish)(struct storage *st, void *handle);
+};
+
+/*
+ * Tunables set with -R, applied by the backends that keep a history on disk.
+ * Retention limits of 0 mean unlimited.
+ */
+struct storage_config {
+    const char *data_path;      // file and mmap backends, FILE_DATA_PATH unless set with -f
+    size_t segment_size;        // bytes written to a segment before starting the next
+    size_t retain_bytes;        // drop the oldest segments beyond this many bytes
+    unsigned int retain_age;    // seconds since a segment was last written
+    size_t retain_packets;      // drop the oldest segments beyond this many packets
+};
+
+#define DEFAULT_SEGMENT_SIZE (1 << 20)
+
+struct storage {
+    const struct storage_ops *ops;
+    const struct storage_config *config;
+    const char *path;
+    int keep;       // close leaves the data for a successor process
+    void *priv;
+};
+
+/*
+ * Start offsets of the newline terminated commands in an append-only byte
+ * stream, used by backends without native command boundaries to implement
+ * seek_snapshot.
+ */
+struct command_index {
+    off_t *starts;
+    size_t head;    // commands before head have been trimmed away
+    size_t count;
+    size_t cap;
+    int open;       // the last command has no terminating newline yet
+};
+
+int command_index_append(struct command_index *idx, off_t base, const char *buf, size_t len);
+int command_index_locate(const struct command_index *idx, off_t size,
+                         uint32_t write_cmd, uint32_t write_cmd_offset, off_t *pos);
+void command_index_trim(struct command_index *idx, off_t base);
+void command_index_free(struct command_index *idx);
+
+extern const struct storage_ops file_storage_ops;
+extern const struct storage_ops chardev_storage_ops;
+extern const struct storage_ops ring_storage_ops;
+extern const struct storage_ops mmap_storage_ops;
+
+/**
+ * Open the backend registered under name, NULL if unknown or it fails to open
+ */
+struct storage *storage_open(const char *name, const struct storage_config *config);
+void storage_close(struct storage *st);
+
+/**
+ * Snapshot of len bytes starting offset bytes past the first byte still
+ * stored, clamped to what is there; len 0 reads to the end.  Serialized
+ * like the snapshot op.
+ */
+int storage_range_snapshot(struct storage *st, off_t offset, off_t len, struct storage_snapshot *snap);
+
+/**
+ * Snapshot of commands first through last, inclusive, of those still stored
+ */
+int storage_packet_snapshot(struct storage *st, uint32_t first, uint32_t last, struct storage_snapshot *snap);
+
+/**
+ * Parse a -R option list such as "segment=1048576,bytes=8388608,age=3600"
+ * into config, -1 on an unknown key or bad value
+ */
+int storage_parse_config(struct storage_config *config, char *options);
+
+/**
+ * Backend names separated by "|", for usage messages
+ */
+const char *storage_names(void);
+
+#endif /* AESDSOCKET_STORAGE_H */
@@ -0,0 +1,181 @@
+/*
+ * storage_chardev.c
+ *
+ * /dev/aesdchar backend.  The driver keeps the most recent commands and
+ * pins snapshots of them with AESDCHAR_IOCSNAPSHOT, so responses are read
+ * from the pinned image with pread() at the snapshot's offset.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "log.h"
+#include "storage.h"
+
+/* Include ioctl definitions inline to avoid path issues */
+struct aesd_seekto {
+    uint32_t write_cmd;
+    uint32_t write_cmd_offset;
+};
+
+#define AESD_IOC_MAGIC 0x16
+#define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+#define AESDCHAR_IOCSNAPSHOT _IO(AESD_IOC_MAGIC, 2)
+#define AESDCHAR_IOC_MAXNR 2
+
+// AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED in the driver
+#define CHARDEV_ENTRIES 10
+
+static int chardev_open(struct storage *st) {
+    st->path = CHAR_DEVICE_PATH;
+    if (access(st->path, R_OK | W_OK) == -1) {
+        log_msg(LOG_ERR, "Cannot access %s: %s", st->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void chardev_close(struct storage *st) {
+}
+
+static int chardev_append(struct storage *st, const char *buf, size_t len) {
+    // Open device file ONLY when needed
+    int data_fd = open(st->path, O_RDWR);
+    if (data_fd == -1) {
+        log_msg(LOG_ERR, "Failed to open data file: %s", strerror(errno));
+        return -1;
+    }
+    size_t total_written = 0;
+    int rc = 0;
+    while (total_written < len) {
+        ssize_t bytes_written = write(data_fd, buf + total_written, len - total_written);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "Write failed: %s", strerror(errno));
+            rc = -1;
+            break;
+        }
+        total_written += bytes_written;
+    }
+    close(data_fd);
+    return rc;
+}
+
+// Open the device and pin its current contents for reading without the lock
+static int chardev_snapshot(struct storage *st, struct storage_snapshot *snap) {
+    snap->fd = open(st->path, O_RDONLY);
+    if (snap->fd == -1) {
+        log_msg(LOG_ERR, "Failed to open data file for reading: %s", strerror(errno));
+        return -1;
+    }
+    if (ioctl(snap->fd, AESDCHAR_IOCSNAPSHOT, 1) == -1) {
+        log_msg(LOG_ERR, "IOCTL snapshot failed: %s", strerror(errno));
+        close(snap->fd);
+        snap->fd = -1;
+        return -1;
+    }
+    // The pinned image does not grow, so its size bounds every read
+    snap->size = lseek(snap->fd, 0, SEEK_END);
+    if (snap->size == -1) {
+        log_msg(LOG_ERR, "Failed to size snapshot: %s", strerror(errno));
+        close(snap->fd);
+        snap->fd = -1;
+        return -1;
+    }
+    snap->offset = 0;
+    return 0;
+}
+
+static int chardev_seek_snapshot(struct storage *st, uint32_t write_cmd, uint32_t write_cmd_offset,
+                                 struct storage_snapshot *snap) {
+    struct aesd_seekto seekto;
+
+    if (chardev_snapshot(st, snap) == -1) {
+        return -1;
+    }
+    seekto.write_cmd = write_cmd;
+    seekto.write_cmd_offset = write_cmd_offset;
+    if (ioctl(snap->fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+        log_msg(LOG_ERR, "IOCTL seek failed: %s", strerror(errno));
+        close(snap->fd);
+        snap->fd = -1;
+        return -1;
+    }
+    // The driver moved the descriptor to the command's byte offset
+    snap->offset = lseek(snap->fd, 0, SEEK_CUR);
+    if (snap->offset == -1) {
+        close(snap->fd);
+        snap->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Let the driver find where end_cmd starts in the pinned image
+static int chardev_snapshot_truncate(struct storage *st, struct storage_snapshot *snap, uint32_t end_cmd) {
+    struct aesd_seekto seekto = { .write_cmd = end_cmd, .write_cmd_offset = 0 };
+
+    if (ioctl(snap->fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+        // EINVAL: there are not that many commands
+        return errno == EINVAL ? 0 : -1;
+    }
+    off_t pos = lseek(snap->fd, 0, SEEK_CUR);
+    if (pos == -1) {
+        return -1;
+    }
+    snap->size = pos;
+    return 0;
+}
+
+static ssize_t chardev_snapshot_read(struct storage *st, struct storage_snapshot *snap, char *buf, size_t len) {
+    if ((off_t)len > snap->size - snap->offset) {
+        len = snap->size - snap->offset;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    ssize_t n = pread(snap->fd, buf, len, snap->offset);
+    if (n > 0) {
+        snap->offset += n;
+    }
+    return n;
+}
+
+static void chardev_snapshot_release(struct storage *st, struct storage_snapshot *snap) {
+    if (snap->fd != -1) {
+        close(snap->fd);
+        snap->fd = -1;
+    }
+}
+
+static off_t chardev_size(struct storage *st) {
+    int fd = open(st->path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    return size;
+}
+
+const struct storage_ops chardev_storage_ops = {
+    .name = "chardev",
+    .timestamps = 0,
+    // The driver holds the data whichever process has it open
+    .handoff = 1,
+    .ring_entries = CHARDEV_ENTRIES,
+    .open = chardev_open,
+    .close = chardev_close,
+    .append = chardev_append,
+    .snapshot = chardev_snapshot,
+    .seek_snapshot = chardev_seek_snapshot,
+    .snapshot_truncate = chardev_snapshot_truncate,
+    .snapshot_read = chardev_snapshot_read,
+    .snapshot_release = chardev_snapshot_release,
+    .size = chardev_size,
+};
@@ -0,0 +1,513 @@
+/*
+ * storage_file.c
+ *
+ * Append-only data log backend.  The log is a chain of segment files
+ * <path>.<seq>.<base>, FILE_DATA_PATH unless -f names another: appends go to the newest one, a new segment is
+ * started once it reaches the configured size, and whole segments are
+ * dropped from the old end to honour the retention limits.  Bytes below the
+ * end of the log never change, so a snapshot pins the segments it covers
+ * and is read back with pread() while appends and retention carry on.
+ *
+ * <base> is the log offset of the segment's first byte, so offsets survive
+ * a restart after retention has dropped the start of the log; followers
+ * resume replication by them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <libgen.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "storage.h"
+
+struct log_segment {
+    int refs;               // the log's reference plus one per snapshot
+    int fd;
+    unsigned long long seq;
+    off_t base;             // log offset of the segment's first byte
+    off_t len;
+    size_t packets;         // newline terminated packets in the segment
+    time_t last_write;
+    int dirty;              // written since the last sync_begin
+    int created;            // directory entry not yet synced
+    struct log_segment *next;
+};
+
+struct file_storage {
+    const char *path;           // segment files are named path.<seq>
+    struct log_segment *head;   // oldest segment
+    struct log_segment *tail;   // segment being appended to
+    unsigned long long next_seq;
+    off_t base;                 // log offset of the oldest retained byte
+    off_t size;                 // log offset of the next appended byte
+    size_t packets;
+    struct command_index index;
+};
+
+// Segments with data a sync has to make durable
+struct file_sync {
+    size_t count;
+    int sync_dir;
+    struct log_segment *segment[];
+};
+
+// Segments covered by a snapshot, oldest first
+struct file_snapshot {
+    size_t count;
+    size_t cursor;              // segment the last read ended in
+    struct log_segment *segment[];
+};
+
+static void segment_path(const struct file_storage *fs, char *path, size_t len, unsigned long long seq, off_t base) {
+    snprintf(path, len, "%s.%08llu.%llu", fs->path, seq, (unsigned long long)base);
+}
+
+static void log_segment_put(struct log_segment *seg) {
+    if (__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+// Open the segment starting at the end of the log
+static struct log_segment *log_segment_open(const struct file_storage *fs, unsigned long long seq, int flags) {
+    char path[PATH_MAX];
+    struct log_segment *seg = calloc(1, sizeof(struct log_segment));
+
+    if (seg == NULL) {
+        return NULL;
+    }
+    segment_path(fs, path, sizeof(path), seq, fs->size);
+    seg->fd = open(path, O_RDWR | O_APPEND | flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (seg->fd == -1) {
+        log_msg(LOG_ERR, "Failed to open data file %s: %s", path, strerror(errno));
+        free(seg);
+        return NULL;
+    }
+    seg->refs = 1;
+    seg->seq = seq;
+    seg->last_write = time(NULL);
+    return seg;
+}
+
+static void file_link_segment(struct file_storage *fs, struct log_segment *seg) {
+    seg->base = fs->size;
+    if (fs->tail == NULL) {
+        fs->head = seg;
+    } else {
+        fs->tail->next = seg;
+    }
+    fs->tail = seg;
+}
+
+// Unlink the oldest segment; snapshots still reading it keep it open
+static void file_drop_head(struct file_storage *fs) {
+    struct log_segment *seg = fs->head;
+    char path[PATH_MAX];
+
+    segment_path(fs, path, sizeof(path), seg->seq, seg->base);
+    unlink(path);
+    fs->head = seg->next;
+    fs->base += seg->len;
+    fs->packets -= seg->packets;
+    command_index_trim(&fs->index, fs->base);
+    log_segment_put(seg);
+}
+
+// Close the log, leaving its segment files in place
+static void file_release_segments(struct file_storage *fs) {
+    while (fs->head != NULL) {
+        struct log_segment *seg = fs->head;
+        fs->head = seg->next;
+        log_segment_put(seg);
+    }
+}
+
+// Drop old segments past any retention limit, never the one being appended to
+static void file_apply_retention(struct storage *st) {
+    struct file_storage *fs = st->priv;
+    const struct storage_config *cfg = st->config;
+    time_t now = time(NULL);
+
+    while (fs->head != fs->tail) {
+        struct log_segment *seg = fs->head;
+        if ((cfg->retain_bytes == 0 || fs->size - fs->base <= (off_t)cfg->retain_bytes) &&
+            (cfg->retain_packets == 0 || fs->packets <= cfg->retain_packets) &&
+            (cfg->retain_age == 0 || now - seg->last_write <= (time_t)cfg->retain_age)) {
+            break;
+        }
+        file_drop_head(fs);
+    }
+}
+
+static size_t count_packets(const char *buf, size_t len) {
+    size_t packets = 0;
+    const char *end = buf + len;
+
+    while ((buf = memchr(buf, '\n', end - buf)) != NULL) {
+        packets++;
+        buf++;
+    }
+    return packets;
+}
+
+/*
+ * Log offset a segment file left behind starts at, from its name, or -1 if
+ * its name predates offsets being kept there.  0 if the name is not a
+ * segment's at all.
+ */
+static int parse_segment_name(const struct file_storage *fs, const char *name,
+                              unsigned long long *seq, off_t *base) {
+    char *end;
+
+    *seq = strtoull(name + strlen(fs->path) + 1, &end, 10);
+    if (*end == '\0') {
+        *base = -1;
+        return 1;
+    }
+    if (*end != '.' || end[1] == '\0') {
+        return 0;
+    }
+    *base = strtoull(end + 1, &end, 10);
+    return *end == '\0';
+}
+
+// Index the segments an earlier run left behind, in sequence order
+static int file_recover(struct file_storage *fs) {
+    char pattern[PATH_MAX];
+    char path[PATH_MAX];
+    glob_t found;
+
+    snprintf(pattern, sizeof(pattern), "%s.*", fs->path);
+    if (glob(pattern, 0, NULL, &found) != 0) {
+        return 0;
+    }
+    // Zero padded sequence numbers sort in order
+    for (size_t i = 0; i < found.gl_pathc; i++) {
+        unsigned long long seq;
+        off_t base;
+        if (!parse_segment_name(fs, found.gl_pathv[i], &seq, &base)) {
+            continue;
+        }
+        if (base > fs->size && fs->head != NULL) {
+            // Segments before a gap were being dropped when the last run ended
+            log_msg(LOG_WARNING, "Dropping data below log offset %lld, %s starts past the end",
+                    (long long)base, found.gl_pathv[i]);
+            while (fs->head != NULL) {
+                file_drop_head(fs);
+            }
+            fs->tail = NULL;
+        }
+        if (fs->head == NULL && base > 0) {
+            fs->base = base;
+            fs->size = base;
+            command_index_free(&fs->index);
+        } else if (base != -1 && base != fs->size) {
+            log_msg(LOG_WARNING, "%s should start at log offset %lld, renumbering",
+                    found.gl_pathv[i], (long long)fs->size);
+        }
+        // Files named without their offset, or with the wrong one, are renamed to match the log
+        segment_path(fs, path, sizeof(path), seq, fs->size);
+        if (strcmp(path, found.gl_pathv[i]) != 0 && rename(found.gl_pathv[i], path) == -1) {
+            log_msg(LOG_ERR, "Failed to rename %s: %s", found.gl_pathv[i], strerror(errno));
+            globfree(&found);
+            return -1;
+        }
+        struct log_segment *seg = log_segment_open(fs, seq, 0);
+        if (seg == NULL) {
+            globfree(&found);
+            return -1;
+        }
+        struct stat sb;
+        if (fstat(seg->fd, &sb) == 0) {
+            seg->last_write = sb.st_mtime;
+        }
+        file_link_segment(fs, seg);
+
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(seg->fd, buf, sizeof(buf))) > 0) {
+            command_index_append(&fs->index, fs->size, buf, n);
+            seg->packets += count_packets(buf, n);
+            seg->len += n;
+            fs->size += n;
+        }
+        fs->packets += seg->packets;
+        fs->next_seq = seq + 1;
+    }
+    globfree(&found);
+    return 0;
+}
+
+static int file_open(struct storage *st) {
+    struct file_storage *fs = calloc(1, sizeof(struct file_storage));
+    if (fs == NULL) {
+        return -1;
+    }
+    st->path = st->config->data_path;
+    fs->path = st->path;
+    st->priv = fs;
+    if (file_recover(fs) == -1) {
+        // Leave the recovered segments on disk for the next attempt
+        file_release_segments(fs);
+        command_index_free(&fs->index);
+        free(fs);
+        return -1;
+    }
+    file_apply_retention(st);
+    return 0;
+}
+
+static void file_close(struct storage *st) {
+    struct file_storage *fs = st->priv;
+
+    if (st->keep) {
+        file_release_segments(fs);
+    }
+    while (fs->head != NULL) {
+        file_drop_head(fs);
+    }
+    command_index_free(&fs->index);
+    free(fs);
+}
+
+static int file_append(struct storage *st, const char *buf, size_t len) {
+    struct file_storage *fs = st->priv;
+    size_t total_written = 0;
+
+    // Appends are never split, so a segment may overrun its size by one
+    if (fs->tail == NULL || fs->tail->len >= (off_t)st->config->segment_size) {
+        struct log_segment *seg = log_segment_open(fs, fs->next_seq, O_CREAT | O_TRUNC);
+        if (seg == NULL) {
+            return -1;
+        }
+        seg->created = 1;
+        fs->next_seq++;
+        file_link_segment(fs, seg);
+    }
+
+    struct log_segment *seg = fs->tail;
+    while (total_written < len) {
+        ssize_t bytes_written = write(seg->fd, buf + total_written, len - total_written);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "Write failed: %s", strerror(errno));
+            return -1;
+        }
+        total_written += bytes_written;
+    }
+    size_t packets = count_packets(buf, len);
+    command_index_append(&fs->index, fs->size, buf, len);
+    seg->len += len;
+    seg->packets += packets;
+    seg->last_write = time(NULL);
+    seg->dirty = 1;
+    fs->size += len;
+    fs->packets += packets;
+    file_apply_retention(st);
+    return 0;
+}
+
+static int file_snapshot(struct storage *st, struct storage_snapshot *snap) {
+    struct file_storage *fs = st->priv;
+    size_t count = 0;
+
+    file_apply_retention(st);
+    for (struct log_segment *seg = fs->head; seg != NULL; seg = seg->next) {
+        count++;
+    }
+    struct file_snapshot *fsnap = malloc(sizeof(struct file_snapshot) + count * sizeof(struct log_segment *));
+    if (fsnap == NULL) {
+        return -1;
+    }
+    fsnap->count = 0;
+    fsnap->cursor = 0;
+    for (struct log_segment *seg = fs->head; seg != NULL; seg = seg->next) {
+        __atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+        fsnap->segment[fsnap->count++] = seg;
+    }
+    snap->offset = fs->base;
+    snap->size = fs->size;
+    snap->priv = fsnap;
+    return 0;
+}
+
+static void file_snapshot_release(struct storage *st, struct storage_snapshot *snap) {
+    struct file_snapshot *fsnap = snap->priv;
+
+    if (fsnap == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < fsnap->count; i++) {
+        log_segment_put(fsnap->segment[i]);
+    }
+    free(fsnap);
+    snap->priv = NULL;
+}
+
+static int file_seek_snapshot(struct storage *st, uint32_t write_cmd, uint32_t write_cmd_offset,
+                              struct storage_snapshot *snap) {
+    struct file_storage *fs = st->priv;
+    off_t pos;
+
+    if (file_snapshot(st, snap) == -1) {
+        return -1;
+    }
+    if (command_index_locate(&fs->index, fs->size, write_cmd, write_cmd_offset, &pos) == -1) {
+        file_snapshot_release(st, snap);
+        errno = EINVAL;
+        return -1;
+    }
+    snap->offset = pos;
+    return 0;
+}
+
+static int file_snapshot_truncate(struct storage *st, struct storage_snapshot *snap, uint32_t end_cmd) {
+    struct file_storage *fs = st->priv;
+    off_t pos;
+
+    if (command_index_locate(&fs->index, fs->size, end_cmd, 0, &pos) == 0) {
+        snap->size = pos;
+    }
+    return 0;
+}
+
+static ssize_t file_snapshot_read(struct storage *st, struct storage_snapshot *snap, char *buf, size_t len) {
+    struct file_snapshot *fsnap = snap->priv;
+
+    if ((off_t)len > snap->size - snap->offset) {
+        len = snap->size - snap->offset;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    // Reads only move forward, so the segment holding offset is found from the cursor
+    while (fsnap->cursor + 1 < fsnap->count && fsnap->segment[fsnap->cursor + 1]->base <= snap->offset) {
+        fsnap->cursor++;
+    }
+    struct log_segment *seg = fsnap->segment[fsnap->cursor];
+    off_t seg_offset = snap->offset - seg->base;
+    if (fsnap->cursor + 1 < fsnap->count && (off_t)len > fsnap->segment[fsnap->cursor + 1]->base - snap->offset) {
+        len = fsnap->segment[fsnap->cursor + 1]->base - snap->offset;
+    }
+    ssize_t n = pread(seg->fd, buf, len, seg_offset);
+    if (n > 0) {
+        snap->offset += n;
+    }
+    return n;
+}
+
+static int file_sync_begin(struct storage *st, void **handle) {
+    struct file_storage *fs = st->priv;
+    struct file_sync *sync;
+    size_t count = 0;
+
+    *handle = NULL;
+    for (struct log_segment *seg = fs->head; seg != NULL; seg = seg->next) {
+        count += seg->dirty;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    sync = malloc(sizeof(struct file_sync) + count * sizeof(struct log_segment *));
+    if (sync == NULL) {
+        return -1;
+    }
+    sync->count = 0;
+    sync->sync_dir = 0;
+    for (struct log_segment *seg = fs->head; seg != NULL; seg = seg->next) {
+        if (seg->dirty) {
+            __atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+            sync->segment[sync->count++] = seg;
+            sync->sync_dir |= seg->created;
+            seg->dirty = 0;
+            seg->created = 0;
+        }
+    }
+    *handle = sync;
+    return 0;
+}
+
+static int file_sync_finish(struct storage *st, void *handle) {
+    struct file_sync *sync = handle;
+    int rc = 0;
+
+    if (sync == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < sync->count; i++) {
+        if (fdatasync(sync->segment[i]->fd) == -1) {
+            log_msg(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+            rc = -1;
+        }
+        log_segment_put(sync->segment[i]);
+    }
+    // New segments are only found again after a crash once their names are durable
+    if (sync->sync_dir) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s", st->path);
+        const char *dir = dirname(path);
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd == -1 || fsync(dir_fd) == -1) {
+            log_msg(LOG_ERR, "Failed to sync %s: %s", dir, strerror(errno));
+            rc = -1;
+        }
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+    }
+    free(sync);
+    return rc;
+}
+
+static int file_skip(struct storage *st, off_t offset) {
+    struct file_storage *fs = st->priv;
+
+    if (offset < fs->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    // The next append starts a segment named with the new offset
+    while (fs->head != NULL) {
+        file_drop_head(fs);
+    }
+    fs->tail = NULL;
+    command_index_free(&fs->index);
+    fs->base = offset;
+    fs->size = offset;
+    return 0;
+}
+
+static off_t file_size(struct storage *st) {
+    struct file_storage *fs = st->priv;
+
+    return fs->size - fs->base;
+}
+
+const struct storage_ops file_storage_ops = {
+    .name = "file",
+    .timestamps = 1,
+    .append_only = 1,
+    .handoff = 1,
+    .open = file_open,
+    .close = file_close,
+    .append = file_append,
+    .snapshot = file_snapshot,
+    .seek_snapshot = file_seek_snapshot,
+    .snapshot_truncate = file_snapshot_truncate,
+    .snapshot_read = file_snapshot_read,
+    .snapshot_release = file_snapshot_release,
+    .size = file_size,
+    .skip = file_skip,
+    .sync_begin = file_sync_begin,
+    .sync_finish = file_sync_finish,
+};
@@ -0,0 +1,263 @@
+/*
+ * storage_mmap.c
+ *
+ * Data file backend that appends through shared mappings instead of
+ * write().  The file grows one fixed-size segment at a time and every
+ * segment stays mapped until close, so snapshots are read with memcpy from
+ * mappings that never move.  Segments are allocated on disk before they
+ * are mapped, so a full disk fails an append rather than a store.
+ *
+ * A close that hands the data on trims the file to the logical size, which
+ * the next open recovers; a file a crash left padded to a segment is taken
+ * to end at its last non-zero byte.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "storage.h"
+
+#define MMAP_SEGMENT_SIZE (1 << 20)
+// Mapped segments never move, so the table is fixed; 4 GiB of data
+#define MMAP_MAX_SEGMENTS 4096
+
+struct mmap_storage {
+    int fd;
+    off_t size;     // logical size, the file itself is rounded up to a segment
+    unsigned int nsegments;
+    int dirty;      // written since the last sync_begin
+    char *segment[MMAP_MAX_SEGMENTS];
+    struct command_index index;
+};
+
+// Extend the file by one segment and map it
+static int mmap_grow(struct mmap_storage *ms) {
+    if (ms->nsegments == MMAP_MAX_SEGMENTS) {
+        errno = EFBIG;
+        return -1;
+    }
+    off_t offset = (off_t)ms->nsegments * MMAP_SEGMENT_SIZE;
+    // Reserve the blocks up front: a store into a hole the disk has no room
+    // for raises SIGBUS, where this fails the append with ENOSPC
+    int err = posix_fallocate(ms->fd, offset, MMAP_SEGMENT_SIZE);
+    if (err != 0) {
+        if (ftruncate(ms->fd, offset) == -1) {
+            log_msg(LOG_WARNING, "Failed to trim data file: %s", strerror(errno));
+        }
+        errno = err;
+        return -1;
+    }
+    void *addr = mmap(NULL, MMAP_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ms->fd, offset);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    ms->segment[ms->nsegments++] = addr;
+    return 0;
+}
+
+static void mmap_unmap(struct mmap_storage *ms) {
+    for (unsigned int i = 0; i < ms->nsegments; i++) {
+        munmap(ms->segment[i], MMAP_SEGMENT_SIZE);
+    }
+}
+
+// Map what an earlier run left in the file and index its commands
+static int mmap_recover(struct mmap_storage *ms) {
+    struct stat sb;
+
+    if (fstat(ms->fd, &sb) == -1) {
+        return -1;
+    }
+    if (sb.st_size > (off_t)MMAP_MAX_SEGMENTS * MMAP_SEGMENT_SIZE) {
+        errno = EFBIG;
+        return -1;
+    }
+    while ((off_t)ms->nsegments * MMAP_SEGMENT_SIZE < sb.st_size) {
+        if (mmap_grow(ms) == -1) {
+            return -1;
+        }
+    }
+    ms->size = sb.st_size;
+    if (ms->size > 0 && ms->size % MMAP_SEGMENT_SIZE == 0) {
+        // Padding the crash left unwritten
+        const char *last = ms->segment[ms->nsegments - 1];
+        off_t len = MMAP_SEGMENT_SIZE;
+        while (len > 0 && last[len - 1] == '\0') {
+            len--;
+        }
+        ms->size -= MMAP_SEGMENT_SIZE - len;
+    }
+    for (unsigned int i = 0; (off_t)i * MMAP_SEGMENT_SIZE < ms->size; i++) {
+        off_t base = (off_t)i * MMAP_SEGMENT_SIZE;
+        off_t len = ms->size - base < MMAP_SEGMENT_SIZE ? ms->size - base : MMAP_SEGMENT_SIZE;
+        command_index_append(&ms->index, base, ms->segment[i], len);
+    }
+    return 0;
+}
+
+static int mmap_open(struct storage *st) {
+    struct mmap_storage *ms = calloc(1, sizeof(struct mmap_storage));
+    if (ms == NULL) {
+        return -1;
+    }
+    st->path = st->config->data_path;
+    ms->fd = open(st->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (ms->fd == -1) {
+        log_msg(LOG_ERR, "Failed to open data file: %s", strerror(errno));
+        free(ms);
+        return -1;
+    }
+    if (mmap_recover(ms) == -1) {
+        log_msg(LOG_ERR, "Failed to recover data file %s: %s", st->path, strerror(errno));
+        mmap_unmap(ms);
+        close(ms->fd);
+        command_index_free(&ms->index);
+        free(ms);
+        return -1;
+    }
+    st->priv = ms;
+    return 0;
+}
+
+static void mmap_close(struct storage *st) {
+    struct mmap_storage *ms = st->priv;
+
+    mmap_unmap(ms);
+    // The trimmed length is what a successor recovers
+    if (ftruncate(ms->fd, ms->size) == -1) {
+        log_msg(LOG_ERR, "Failed to trim data file: %s", strerror(errno));
+    }
+    close(ms->fd);
+    if (!st->keep) {
+        unlink(st->path);
+    }
+    command_index_free(&ms->index);
+    free(ms);
+}
+
+static int mmap_append(struct storage *st, const char *buf, size_t len) {
+    struct mmap_storage *ms = st->priv;
+    off_t pos = ms->size;
+    size_t copied = 0;
+
+    while (copied < len) {
+        unsigned int seg = pos / MMAP_SEGMENT_SIZE;
+        size_t offset = pos % MMAP_SEGMENT_SIZE;
+        if (seg == ms->nsegments && mmap_grow(ms) == -1) {
+            log_msg(LOG_ERR, "Failed to grow data file: %s", strerror(errno));
+            return -1;
+        }
+        size_t n = MMAP_SEGMENT_SIZE - offset;
+        if (n > len - copied) {
+            n = len - copied;
+        }
+        memcpy(ms->segment[seg] + offset, buf + copied, n);
+        copied += n;
+        pos += n;
+    }
+    command_index_append(&ms->index, ms->size, buf, len);
+    ms->size = pos;
+    ms->dirty = 1;
+    return 0;
+}
+
+static int mmap_snapshot(struct storage *st, struct storage_snapshot *snap) {
+    struct mmap_storage *ms = st->priv;
+
+    snap->offset = 0;
+    snap->size = ms->size;
+    return 0;
+}
+
+static int mmap_seek_snapshot(struct storage *st, uint32_t write_cmd, uint32_t write_cmd_offset,
+                              struct storage_snapshot *snap) {
+    struct mmap_storage *ms = st->priv;
+
+    if (command_index_locate(&ms->index, ms->size, write_cmd, write_cmd_offset, &snap->offset) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    snap->size = ms->size;
+    return 0;
+}
+
+static int mmap_snapshot_truncate(struct storage *st, struct storage_snapshot *snap, uint32_t end_cmd) {
+    struct mmap_storage *ms = st->priv;
+    off_t pos;
+
+    if (command_index_locate(&ms->index, ms->size, end_cmd, 0, &pos) == 0) {
+        snap->size = pos;
+    }
+    return 0;
+}
+
+static ssize_t mmap_snapshot_read(struct storage *st, struct storage_snapshot *snap, char *buf, size_t len) {
+    struct mmap_storage *ms = st->priv;
+    size_t copied = 0;
+
+    if ((off_t)len > snap->size - snap->offset) {
+        len = snap->size - snap->offset;
+    }
+    // Segments below snap->size were mapped before the snapshot was taken
+    while (copied < len) {
+        char *seg = ms->segment[snap->offset / MMAP_SEGMENT_SIZE];
+        size_t offset = snap->offset % MMAP_SEGMENT_SIZE;
+        size_t n = MMAP_SEGMENT_SIZE - offset;
+        if (n > len - copied) {
+            n = len - copied;
+        }
+        memcpy(buf + copied, seg + offset, n);
+        copied += n;
+        snap->offset += n;
+    }
+    return copied;
+}
+
+static void mmap_snapshot_release(struct storage *st, struct storage_snapshot *snap) {
+}
+
+static int mmap_sync_begin(struct storage *st, void **handle) {
+    struct mmap_storage *ms = st->priv;
+
+    *handle = ms->dirty ? ms : NULL;
+    ms->dirty = 0;
+    return 0;
+}
+
+static int mmap_sync_finish(struct storage *st, void *handle) {
+    struct mmap_storage *ms = handle;
+
+    // Linux writes back pages dirtied through shared mappings on fdatasync
+    if (ms != NULL && fdatasync(ms->fd) == -1) {
+        log_msg(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static off_t mmap_size(struct storage *st) {
+    return ((struct mmap_storage *)st->priv)->size;
+}
+
+const struct storage_ops mmap_storage_ops = {
+    .name = "mmap",
+    .timestamps = 1,
+    .append_only = 1,
+    .handoff = 1,
+    .open = mmap_open,
+    .close = mmap_close,
+    .append = mmap_append,
+    .snapshot = mmap_snapshot,
+    .seek_snapshot = mmap_seek_snapshot,
+    .snapshot_truncate = mmap_snapshot_truncate,
+    .snapshot_read = mmap_snapshot_read,
+    .snapshot_release = mmap_snapshot_release,
+    .size = mmap_size,
+    .sync_begin = mmap_sync_begin,
+    .sync_finish = mmap_sync_finish,
+};
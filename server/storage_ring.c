@@ -0,0 +1,210 @@
+/*
+ * storage_ring.c
+ *
+ * In-memory ring of the most recent commands, with the same semantics as
+ * the aesdchar driver but without a kernel round trip.  Commands are
+ * immutable segments; a snapshot takes a reference to each one.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "storage.h"
+
+// Same depth as AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED in the driver
+#define RING_ENTRIES 10
+
+struct ring_storage {
+    struct data_segment *entry[RING_ENTRIES];
+    unsigned int out_offs;  // oldest command
+    unsigned int count;
+};
+
+// Commands pinned by a snapshot, oldest first
+struct ring_snapshot {
+    unsigned int count;
+    struct data_segment *entry[RING_ENTRIES];
+};
+
+static int ring_open(struct storage *st) {
+    st->priv = calloc(1, sizeof(struct ring_storage));
+    return st->priv == NULL ? -1 : 0;
+}
+
+static void ring_close(struct storage *st) {
+    struct ring_storage *ring = st->priv;
+
+    for (unsigned int i = 0; i < RING_ENTRIES; i++) {
+        segment_put(ring->entry[i]);
+    }
+    free(ring);
+}
+
+static struct data_segment **ring_newest(struct ring_storage *ring) {
+    if (ring->count == 0) {
+        return NULL;
+    }
+    return &ring->entry[(ring->out_offs + ring->count - 1) % RING_ENTRIES];
+}
+
+// Store one fragment ending in a newline or at the end of an append
+static int ring_add(struct ring_storage *ring, const char *buf, size_t len) {
+    struct data_segment **newest = ring_newest(ring);
+    struct data_segment *seg;
+
+    // An unterminated newest command is extended, copying so snapshots keep theirs
+    if (newest != NULL && (*newest)->data[(*newest)->len - 1] != '\n') {
+        seg = segment_alloc((*newest)->len + len);
+        if (seg == NULL) {
+            return -1;
+        }
+        memcpy(seg->data, (*newest)->data, (*newest)->len);
+        memcpy(seg->data + (*newest)->len, buf, len);
+        segment_put(*newest);
+        *newest = seg;
+        return 0;
+    }
+
+    seg = segment_alloc(len);
+    if (seg == NULL) {
+        return -1;
+    }
+    memcpy(seg->data, buf, len);
+    if (ring->count == RING_ENTRIES) {
+        segment_put(ring->entry[ring->out_offs]);
+        ring->entry[ring->out_offs] = seg;
+        ring->out_offs = (ring->out_offs + 1) % RING_ENTRIES;
+    } else {
+        ring->entry[(ring->out_offs + ring->count) % RING_ENTRIES] = seg;
+        ring->count++;
+    }
+    return 0;
+}
+
+static int ring_append(struct storage *st, const char *buf, size_t len) {
+    struct ring_storage *ring = st->priv;
+    size_t start = 0;
+
+    // Split writes terminated by '\n'
+    while (start < len) {
+        const char *newline = memchr(buf + start, '\n', len - start);
+        size_t end = newline != NULL ? (size_t)(newline - buf) + 1 : len;
+        if (ring_add(ring, buf + start, end - start) == -1) {
+            return -1;
+        }
+        start = end;
+    }
+    return 0;
+}
+
+static int ring_snapshot(struct storage *st, struct storage_snapshot *snap) {
+    struct ring_storage *ring = st->priv;
+    struct ring_snapshot *rs = malloc(sizeof(struct ring_snapshot));
+
+    if (rs == NULL) {
+        return -1;
+    }
+    rs->count = ring->count;
+    snap->size = 0;
+    for (unsigned int i = 0; i < ring->count; i++) {
+        rs->entry[i] = segment_get(ring->entry[(ring->out_offs + i) % RING_ENTRIES]);
+        snap->size += rs->entry[i]->len;
+    }
+    snap->offset = 0;
+    snap->priv = rs;
+    return 0;
+}
+
+static void ring_snapshot_release(struct storage *st, struct storage_snapshot *snap) {
+    struct ring_snapshot *rs = snap->priv;
+
+    if (rs == NULL) {
+        return;
+    }
+    for (unsigned int i = 0; i < rs->count; i++) {
+        segment_put(rs->entry[i]);
+    }
+    free(rs);
+    snap->priv = NULL;
+}
+
+static int ring_seek_snapshot(struct storage *st, uint32_t write_cmd, uint32_t write_cmd_offset,
+                              struct storage_snapshot *snap) {
+    if (ring_snapshot(st, snap) == -1) {
+        return -1;
+    }
+
+    struct ring_snapshot *rs = snap->priv;
+    if (write_cmd >= rs->count || write_cmd_offset >= rs->entry[write_cmd]->len) {
+        ring_snapshot_release(st, snap);
+        errno = EINVAL;
+        return -1;
+    }
+    for (uint32_t i = 0; i < write_cmd; i++) {
+        snap->offset += rs->entry[i]->len;
+    }
+    snap->offset += write_cmd_offset;
+    return 0;
+}
+
+static int ring_snapshot_truncate(struct storage *st, struct storage_snapshot *snap, uint32_t end_cmd) {
+    struct ring_snapshot *rs = snap->priv;
+
+    if (end_cmd < rs->count) {
+        snap->size = 0;
+        for (uint32_t i = 0; i < end_cmd; i++) {
+            snap->size += rs->entry[i]->len;
+        }
+    }
+    return 0;
+}
+
+static ssize_t ring_snapshot_read(struct storage *st, struct storage_snapshot *snap, char *buf, size_t len) {
+    struct ring_snapshot *rs = snap->priv;
+    off_t entry_start = 0;
+    size_t copied = 0;
+
+    if ((off_t)len > snap->size - snap->offset) {
+        len = snap->size - snap->offset;
+    }
+    for (unsigned int i = 0; i < rs->count && copied < len; i++) {
+        off_t entry_end = entry_start + rs->entry[i]->len;
+        if (snap->offset < entry_end) {
+            size_t offset = snap->offset - entry_start;
+            size_t n = rs->entry[i]->len - offset;
+            if (n > len - copied) {
+                n = len - copied;
+            }
+            memcpy(buf + copied, rs->entry[i]->data + offset, n);
+            copied += n;
+            snap->offset += n;
+        }
+        entry_start = entry_end;
+    }
+    return copied;
+}
+
+static off_t ring_size(struct storage *st) {
+    struct ring_storage *ring = st->priv;
+    off_t size = 0;
+
+    for (unsigned int i = 0; i < ring->count; i++) {
+        size += ring->entry[(ring->out_offs + i) % RING_ENTRIES]->len;
+    }
+    return size;
+}
+
+const struct storage_ops ring_storage_ops = {
+    .name = "ring",
+    .timestamps = 0,
+    .ring_entries = RING_ENTRIES,
+    .open = ring_open,
+    .close = ring_close,
+    .append = ring_append,
+    .snapshot = ring_snapshot,
+    .seek_snapshot = ring_seek_snapshot,
+    .snapshot_truncate = ring_snapshot_truncate,
+    .snapshot_read = ring_snapshot_read,
+    .snapshot_release = ring_snapshot_release,
+    .size = ring_size,
+};
@@ -0,0 +1,133 @@
+/*
+ * subscribe.c
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "subscribe.h"
+
+struct subscriber *subscriber_create(void) {
+    struct subscriber *sub = calloc(1, sizeof(struct subscriber));
+
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sub->wake_fd == -1) {
+        free(sub);
+        return NULL;
+    }
+    pthread_mutex_init(&sub->lock, NULL);
+    return sub;
+}
+
+void subscriber_destroy(struct subscriber *sub) {
+    for (unsigned int i = 0; i < sub->count; i++) {
+        segment_put(sub->queue[(sub->head + i) & (SUBSCRIBER_QUEUE_SEGMENTS - 1)]);
+    }
+    close(sub->wake_fd);
+    pthread_mutex_destroy(&sub->lock);
+    free(sub);
+}
+
+void subscriber_attach(struct subscriber_list *list, struct subscriber *sub) {
+    sub->next = list->head;
+    list->head = sub;
+    list->count++;
+}
+
+void subscriber_detach(struct subscriber_list *list, struct subscriber *sub) {
+    struct subscriber **link = &list->head;
+
+    while (*link != NULL && *link != sub) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = sub->next;
+        list->count--;
+    }
+}
+
+// Queue one reference, or mark the subscriber overflowed; returns whether to wake it
+static int subscriber_push(struct subscriber *sub, struct data_segment *seg) {
+    int wake;
+
+    pthread_mutex_lock(&sub->lock);
+    if (sub->overflowed) {
+        wake = 0;
+    } else if (sub->count == SUBSCRIBER_QUEUE_SEGMENTS ||
+               sub->queued_bytes + seg->len > SUBSCRIBER_QUEUE_BYTES) {
+        sub->overflowed = 1;
+        wake = 1;
+    } else {
+        sub->queue[(sub->head + sub->count) & (SUBSCRIBER_QUEUE_SEGMENTS - 1)] = segment_get(seg);
+        sub->queued_bytes += seg->len;
+        wake = sub->count++ == 0;
+    }
+    pthread_mutex_unlock(&sub->lock);
+    return wake;
+}
+
+void subscribers_publish_segment(struct subscriber_list *list, struct data_segment *seg) {
+    if (seg == NULL) {
+        // Every subscriber would miss these bytes, so none may carry on
+        for (struct subscriber *sub = list->head; sub != NULL; sub = sub->next) {
+            pthread_mutex_lock(&sub->lock);
+            sub->overflowed = 1;
+            pthread_mutex_unlock(&sub->lock);
+        }
+    }
+    for (struct subscriber *sub = list->head; sub != NULL; sub = sub->next) {
+        if (seg == NULL || subscriber_push(sub, seg)) {
+            uint64_t one = 1;
+            if (write(sub->wake_fd, &one, sizeof(one)) == -1) {
+                // Already readable, the counter is not needed
+            }
+        }
+    }
+}
+
+void subscribers_publish(struct subscriber_list *list, const char *buf, size_t len) {
+    if (list->head == NULL || len == 0) {
+        return;
+    }
+    struct data_segment *seg = segment_alloc(len);
+    if (seg != NULL) {
+        memcpy(seg->data, buf, len);
+    }
+    subscribers_publish_segment(list, seg);
+    segment_put(seg);
+}
+
+int subscriber_take(struct subscriber *sub, struct data_segment **segs, int max) {
+    uint64_t count;
+    int n = 0;
+
+    if (read(sub->wake_fd, &count, sizeof(count)) == -1) {
+        // Not readable, the queue is checked regardless
+    }
+    pthread_mutex_lock(&sub->lock);
+    if (sub->overflowed) {
+        pthread_mutex_unlock(&sub->lock);
+        return -1;
+    }
+    while (n < max && sub->count > 0) {
+        segs[n] = sub->queue[sub->head];
+        sub->queued_bytes -= segs[n]->len;
+        sub->head = (sub->head + 1) & (SUBSCRIBER_QUEUE_SEGMENTS - 1);
+        sub->count--;
+        n++;
+    }
+    // Wake again for whatever did not fit
+    if (sub->count > 0) {
+        uint64_t one = 1;
+        if (write(sub->wake_fd, &one, sizeof(one)) == -1) {
+            // Already readable
+        }
+    }
+    pthread_mutex_unlock(&sub->lock);
+    return n;
+}
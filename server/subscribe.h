@@ -0,0 +1,63 @@
+/*
+ * subscribe.h
+ *
+ * Push streams for subscribed connections.  Each append is copied once into
+ * a shared segment and a reference is queued for every subscriber; a
+ * subscriber whose queue fills up is cut off rather than letting it hold
+ * unbounded memory or slow the appends down.
+ */
+#ifndef AESDSOCKET_SUBSCRIBE_H
+#define AESDSOCKET_SUBSCRIBE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "storage.h"
+
+#define SUBSCRIBER_QUEUE_SEGMENTS 1024     // power of two
+#define SUBSCRIBER_QUEUE_BYTES (4 * 1024 * 1024)
+
+struct subscriber {
+    pthread_mutex_t lock;       // protects the queue
+    struct data_segment *queue[SUBSCRIBER_QUEUE_SEGMENTS];
+    unsigned int head;
+    unsigned int count;
+    size_t queued_bytes;
+    int overflowed;             // data was lost, the subscriber has to go
+    int wake_fd;                // eventfd, readable while the queue is not empty
+    struct subscriber *next;
+};
+
+/*
+ * The list is protected by the caller's storage lock, which also
+ * serializes publishing.
+ */
+struct subscriber_list {
+    struct subscriber *head;
+    unsigned int count;
+};
+
+struct subscriber *subscriber_create(void);
+void subscriber_destroy(struct subscriber *sub);
+
+void subscriber_attach(struct subscriber_list *list, struct subscriber *sub);
+void subscriber_detach(struct subscriber_list *list, struct subscriber *sub);
+
+/**
+ * Queue len bytes for every subscriber, sharing one copy
+ */
+void subscribers_publish(struct subscriber_list *list, const char *buf, size_t len);
+
+/**
+ * Queue a reference to seg for every subscriber; NULL for bytes that were
+ * lost, which cuts every subscriber off
+ */
+void subscribers_publish_segment(struct subscriber_list *list, struct data_segment *seg);
+
+/**
+ * Take up to max queued segments, which the caller puts; -1 once the
+ * subscriber has overflowed
+ */
+int subscriber_take(struct subscriber *sub, struct data_segment **segs, int max);
+
+#endif /* AESDSOCKET_SUBSCRIBE_H */
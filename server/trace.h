@@ -0,0 +1,34 @@
+/*
+ * trace.h
+ *
+ * USDT probes marking the steps of a packet through aesdsocket, for
+ * aesdsocket-latency.bt.  A probe is a single nop until a tracer attaches
+ * to it, and compiles to nothing where <sys/sdt.h> is missing or
+ * AESD_NO_USDT is defined, so arguments must be free of side effects.
+ *
+ *   recv(fd, bytes)                 bytes read from a client
+ *   lock_wait(fd), lock_acquired(fd)   around taking data_mutex to store
+ *   append_start(bytes), append_done(bytes, rc)   the storage write
+ *   read_start(bytes), read_done(bytes)   reading the echo back from storage
+ *   send_start(fd, bytes), send_done(fd, bytes)   sending a response
+ *   packets_done(fd, bytes)         a run of packets stored and echoed
+ */
+#ifndef AESDSOCKET_TRACE_H
+#define AESDSOCKET_TRACE_H
+
+#if defined(__has_include) && !defined(AESD_NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AESD_USDT 1
+#endif
+#endif
+
+#ifdef AESD_USDT
+#define TRACE1(name, a) DTRACE_PROBE1(aesdsocket, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(aesdsocket, name, a, b)
+#else
+#define TRACE1(name, a) do { } while (0)
+#define TRACE2(name, a, b) do { } while (0)
+#endif
+
+#endif /* AESDSOCKET_TRACE_H */
@@ -0,0 +1,328 @@
+/*
+ * writer.c
+ *
+ * The queue is an iovec array sent from iov[first]; a partial send trims
+ * the first piece in place.  Zerocopy completions arrive in send order on
+ * a TCP socket, so the references they release are kept in a ring ordered
+ * by send id.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#include "log.h"
+#include "writer.h"
+
+int writer_parse_config(struct writer_config *config, char *options) {
+    enum { OPT_SNDBUF, OPT_RCVBUF, OPT_NODELAY, OPT_ZEROCOPY };
+    char *const keys[] = { "sndbuf", "rcvbuf", "nodelay", "zerocopy", NULL };
+    char *value, *end;
+
+    while (*options != '\0') {
+        int key = getsubopt(&options, keys, &value);
+        if (key == -1 || value == NULL) {
+            return -1;
+        }
+        unsigned long long n = strtoull(value, &end, 10);
+        if (*end != '\0') {
+            return -1;
+        }
+        switch (key) {
+        case OPT_SNDBUF:
+        case OPT_RCVBUF:
+            if (n > INT_MAX) {
+                return -1;
+            }
+            *(key == OPT_SNDBUF ? &config->sndbuf : &config->rcvbuf) = n;
+            break;
+        case OPT_NODELAY:
+            if (n > 1) {
+                return -1;
+            }
+            config->nodelay = n;
+            break;
+        case OPT_ZEROCOPY:
+            config->zerocopy = n;
+            break;
+        }
+    }
+    return 0;
+}
+
+int writer_tune_socket(int fd, const struct writer_config *config, int listening) {
+    int one = 1;
+
+    if (config->sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &config->sndbuf, sizeof(int)) == -1) {
+        return -1;
+    }
+    if (config->rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &config->rcvbuf, sizeof(int)) == -1) {
+        return -1;
+    }
+    // Followers on the unix socket have no Nagle to turn off
+    if (!listening && config->nodelay) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+    }
+    return 0;
+}
+
+void writer_init(struct response_writer *w, int fd, const struct writer_config *config) {
+    w->fd = fd;
+    w->first = 0;
+    w->count = 0;
+    w->queued = 0;
+    w->staged = 0;
+    w->corked = 0;
+    w->zerocopy = 0;
+    w->zerocopy_min = config->zerocopy;
+    w->zc_sent = 0;
+    w->zc_done = 0;
+    w->zc_head = 0;
+    w->zc_count = 0;
+#ifdef SO_ZEROCOPY
+    int one = 1;
+    if (config->zerocopy > 0 && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(int)) == 0) {
+        w->zerocopy = 1;
+    }
+#endif
+}
+
+static int writer_push(struct response_writer *w, const char *data, size_t len, struct data_segment *seg) {
+    w->iov[w->count].iov_base = (char *)data;
+    w->iov[w->count].iov_len = len;
+    w->seg[w->count] = seg;
+    w->count++;
+    w->queued += len;
+    return 0;
+}
+
+int writer_add(struct response_writer *w, const char *data, size_t len, struct data_segment *seg) {
+    if (len == 0) {
+        return 0;
+    }
+    if (seg != NULL) {
+        if (w->count == WRITER_IOV) {
+            return -1;
+        }
+        return writer_push(w, data, len, segment_get(seg));
+    }
+    if (len > WRITER_STAGE - w->staged) {
+        return -1;
+    }
+    char *copy = w->stage + w->staged;
+    memcpy(copy, data, len);
+    w->staged += len;
+    // Consecutive copied pieces share one iovec
+    if (w->count > w->first && w->seg[w->count - 1] == NULL &&
+        (char *)w->iov[w->count - 1].iov_base + w->iov[w->count - 1].iov_len == copy) {
+        w->iov[w->count - 1].iov_len += len;
+        w->queued += len;
+        return 0;
+    }
+    if (w->count == WRITER_IOV) {
+        w->staged -= len;
+        return -1;
+    }
+    return writer_push(w, copy, len, NULL);
+}
+
+int writer_borrow(struct response_writer *w, const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (w->count == WRITER_IOV) {
+        return -1;
+    }
+    return writer_push(w, data, len, NULL);
+}
+
+// Drop n sent bytes from the front of the queue
+static void writer_consume(struct response_writer *w, size_t n) {
+    while (n > 0) {
+        struct iovec *v = &w->iov[w->first];
+        if (n < v->iov_len) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+            w->queued -= n;
+            break;
+        }
+        n -= v->iov_len;
+        w->queued -= v->iov_len;
+        segment_put(w->seg[w->first]);
+        w->seg[w->first] = NULL;
+        w->first++;
+    }
+    if (w->first == w->count) {
+        w->first = 0;
+        w->count = 0;
+        w->staged = 0;
+    }
+}
+
+#ifdef SO_ZEROCOPY
+// Bytes of segment data in the run of pieces starting at i, *end set past it
+static size_t writer_segment_run(const struct response_writer *w, int i, int *end) {
+    size_t run = 0;
+
+    for (; i < w->count && w->seg[i] != NULL; i++) {
+        run += w->iov[i].iov_len;
+    }
+    *end = i;
+    return run;
+}
+
+// Hold the segments the zerocopy send of n bytes from the front went out from
+static void writer_pin(struct response_writer *w, size_t n) {
+    for (int i = w->first; n > 0; i++) {
+        unsigned int slot = (w->zc_head + w->zc_count++) % WRITER_ZC_PENDING;
+        w->zc_pending[slot].id = w->zc_sent;
+        w->zc_pending[slot].seg = segment_get(w->seg[i]);
+        n -= n < w->iov[i].iov_len ? n : w->iov[i].iov_len;
+    }
+    w->zc_sent++;
+}
+#endif
+
+ssize_t writer_send(struct response_writer *w, int more) {
+    int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    int end = w->count;
+    int zerocopy = 0;
+
+#ifdef SO_ZEROCOPY
+    // Large runs of segment data go out on their own, everything else copied
+    if (w->zerocopy) {
+        int run_end;
+        int run_start = w->first;
+        while (run_start < w->count && w->seg[run_start] == NULL) {
+            run_start++;
+        }
+        size_t run = writer_segment_run(w, run_start, &run_end);
+        if (run >= w->zerocopy_min) {
+            if (run_start > w->first) {
+                end = run_start;
+            } else {
+                if (WRITER_ZC_PENDING - w->zc_count < (unsigned int)(run_end - run_start)) {
+                    writer_reap(w);
+                }
+                if (WRITER_ZC_PENDING - w->zc_count >= (unsigned int)(run_end - run_start)) {
+                    end = run_end;
+                    zerocopy = 1;
+                }
+            }
+        }
+    }
+#endif
+    if (more || end < w->count) {
+        flags |= MSG_MORE;
+    }
+
+    struct msghdr msg = { .msg_iov = w->iov + w->first, .msg_iovlen = end - w->first };
+    ssize_t n;
+#ifdef SO_ZEROCOPY
+    if (zerocopy) {
+        n = sendmsg(w->fd, &msg, flags | MSG_ZEROCOPY);
+        if (n > 0) {
+            writer_pin(w, n);
+        } else if (n == -1 && errno == ENOBUFS) {
+            // Out of option memory for notifications, copy this one
+            n = sendmsg(w->fd, &msg, flags);
+        }
+    } else
+#endif
+    n = sendmsg(w->fd, &msg, flags);
+    if (n > 0) {
+        writer_consume(w, n);
+        w->corked = (flags & MSG_MORE) != 0;
+    }
+    return n;
+}
+
+void writer_uncork(struct response_writer *w) {
+    int off = 0;
+
+    if (w->corked) {
+        // Clearing TCP_CORK pushes pending frames whether or not it was set
+        setsockopt(w->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(int));
+        w->corked = 0;
+    }
+}
+
+int writer_reap(struct response_writer *w) {
+#ifdef SO_ZEROCOPY
+    while (w->zc_count > 0) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+
+        if (recvmsg(w->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+            if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // ee_info to ee_data completed; sends the kernel copied gain nothing
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                w->zerocopy = 0;
+            }
+            if ((int32_t)(serr.ee_data + 1 - w->zc_done) > 0) {
+                w->zc_done = serr.ee_data + 1;
+            }
+        }
+        while (w->zc_count > 0 && (int32_t)(w->zc_pending[w->zc_head].id - w->zc_done) < 0) {
+            segment_put(w->zc_pending[w->zc_head].seg);
+            w->zc_head = (w->zc_head + 1) % WRITER_ZC_PENDING;
+            w->zc_count--;
+        }
+    }
+#endif
+    return 0;
+}
+
+void writer_release(struct response_writer *w) {
+    struct timespec now, deadline;
+
+    for (int i = w->first; i < w->count; i++) {
+        segment_put(w->seg[i]);
+        w->seg[i] = NULL;
+    }
+    w->first = 0;
+    w->count = 0;
+    w->queued = 0;
+    w->staged = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += WRITER_CLOSE_WAIT_MS / 1000;
+    deadline.tv_nsec += (WRITER_CLOSE_WAIT_MS % 1000) * 1000000L;
+    while (writer_reap(w) == 0 && w->zc_count > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        // The error queue being readable shows as POLLERR
+        struct pollfd pfd = { .fd = w->fd, .events = 0 };
+        int rc = remaining > 0 ? poll(&pfd, 1, remaining) : 0;
+        if (rc == 0 || (rc == -1 && errno != EINTR)) {
+            break;
+        }
+        if (rc == 1 && (pfd.revents & POLLHUP)) {
+            // Nothing further will be acknowledged
+            writer_reap(w);
+            break;
+        }
+    }
+    if (w->zc_count > 0) {
+        log_msg(LOG_WARNING, "Leaving %u segments the kernel may still be sending from", w->zc_count);
+        w->zc_count = 0;
+    }
+}
@@ -0,0 +1,120 @@
+/*
+ * writer.h
+ *
+ * Per-connection response writer.  The pieces of a response are gathered
+ * into an iovec and go out in as few sendmsg calls as possible: headers and
+ * other small pieces are copied into a staging area, stored data is sent
+ * from the reference counted segments holding it.  Every send but the last
+ * of a response carries MSG_MORE, which corks the socket for that call, so
+ * a response leaves in full-sized segments while TCP_NODELAY sends its
+ * tail at once instead of waiting on Nagle.
+ *
+ * With zerocopy set, runs of segment data of at least that many bytes are
+ * sent with MSG_ZEROCOPY.  The segments are then held until the kernel
+ * reports the send complete on the socket's error queue.  A connection
+ * where the kernel had to copy anyway, as over loopback, stops asking.
+ */
+#ifndef AESDSOCKET_WRITER_H
+#define AESDSOCKET_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "storage.h"
+
+#define WRITER_IOV 128                  // pieces queued before a send is forced
+#define WRITER_STAGE 4096               // bytes of copied pieces queued
+#define WRITER_ZC_PENDING 256           // segment references awaiting zerocopy completion
+#define WRITER_CLOSE_WAIT_MS 1000       // longest a close waits for zerocopy completions
+
+// Socket options, from -T
+struct writer_config {
+    int sndbuf;                 // SO_SNDBUF, 0 leaves the system default
+    int rcvbuf;                 // SO_RCVBUF, 0 leaves the system default
+    int nodelay;                // TCP_NODELAY on client connections
+    size_t zerocopy;            // smallest MSG_ZEROCOPY send, 0 never
+};
+
+struct writer_zc {
+    uint32_t id;                // the zerocopy send that took this reference
+    struct data_segment *seg;
+};
+
+struct response_writer {
+    int fd;
+    int first;                  // next iov to send
+    int count;
+    size_t queued;              // bytes in iov[first, count)
+    size_t staged;              // bytes of stage in use
+    struct iovec iov[WRITER_IOV];
+    struct data_segment *seg[WRITER_IOV];   // holding iov[i], NULL if staged or borrowed
+    char stage[WRITER_STAGE];
+    int corked;                 // the last send carried MSG_MORE
+    // MSG_ZEROCOPY sends are numbered by the kernel from 0
+    int zerocopy;
+    size_t zerocopy_min;
+    uint32_t zc_sent;           // id of the next zerocopy send
+    uint32_t zc_done;           // sends before this one have completed
+    unsigned int zc_head;
+    unsigned int zc_count;
+    struct writer_zc zc_pending[WRITER_ZC_PENDING];
+};
+
+/**
+ * Parse "sndbuf=bytes,rcvbuf=bytes,nodelay=0|1,zerocopy=bytes" into config,
+ * -1 if malformed
+ */
+int writer_parse_config(struct writer_config *config, char *options);
+
+/**
+ * Apply the buffer sizes, and TCP_NODELAY unless listening, to fd; -1 if a
+ * buffer size was refused
+ */
+int writer_tune_socket(int fd, const struct writer_config *config, int listening);
+
+void writer_init(struct response_writer *w, int fd, const struct writer_config *config);
+
+/**
+ * Queue len bytes, taking a reference on seg when data lies in it and
+ * copying them otherwise.  -1 when there is no room until a send.
+ */
+int writer_add(struct response_writer *w, const char *data, size_t len, struct data_segment *seg);
+
+/**
+ * Queue len bytes without copying or a reference; they must stay put until
+ * sent.  -1 when there is no room until a send.
+ */
+int writer_borrow(struct response_writer *w, const char *data, size_t len);
+
+static inline size_t writer_queued(const struct response_writer *w) {
+    return w->queued;
+}
+
+/**
+ * One non-blocking sendmsg of queued data, with MSG_MORE when more of the
+ * response follows.  Returns the bytes sent, -1 with errno set.
+ */
+ssize_t writer_send(struct response_writer *w, int more);
+
+/**
+ * Push out what the last send held back for MSG_MORE when the response
+ * ended with nothing left to send
+ */
+void writer_uncork(struct response_writer *w);
+
+/**
+ * Release the segments of completed zerocopy sends, -1 on an error other
+ * than there being none
+ */
+int writer_reap(struct response_writer *w);
+
+/**
+ * Drop whatever is queued before the socket closes.  Segments the kernel
+ * may still be sending from are waited for up to WRITER_CLOSE_WAIT_MS, then
+ * left allocated rather than handed back for reuse.
+ */
+void writer_release(struct response_writer *w);
+
+#endif /* AESDSOCKET_WRITER_H */
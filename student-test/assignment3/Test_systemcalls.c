@@ -0,0 +1,323 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+#define REDIRECT_FILE "/tmp/aesd-test-systemcalls-redirect.txt"
+
+// Commands as do_exec_batch() takes them, each ending with a NULL
+static char *const sleep_03[] = { "/bin/sleep", "0.3", NULL };
+static char *const sleep_02[] = { "/bin/sleep", "0.2", NULL };
+static char *const sleep_01[] = { "/bin/sleep", "0.1", NULL };
+static char *const true_cmd[] = { "/bin/true", NULL };
+static char *const false_cmd[] = { "/bin/false", NULL };
+static char *const missing_cmd[] = { "/nonexistent/command", NULL };
+static char *const relative_cmd[] = { "true", NULL };
+
+// Indices passed to batch_record(), in the order the commands finished
+struct batch_order {
+    int index[8];
+    int count;
+};
+
+static void batch_record(struct exec_batch_cmd *cmd, int index, void *arg)
+{
+    struct batch_order *order = arg;
+
+    (void)cmd;
+    if (order->count < 8) {
+        order->index[order->count] = index;
+    }
+    order->count++;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/**
+ * Four 0.2 second sleeps in two slots need two rounds, and all at once only one
+ */
+void test_exec_batch_parallel_limit()
+{
+    struct exec_batch_cmd cmds[4];
+    struct timespec start;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        cmds[i] = (struct exec_batch_cmd){ .argv = sleep_02 };
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_EQUAL_INT(0, do_exec_batch(cmds, 4, 2, NULL, NULL));
+    TEST_ASSERT_GREATER_OR_EQUAL(400, elapsed_ms(&start));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_EQUAL_INT(0, do_exec_batch(cmds, 4, 0, NULL, NULL));
+    TEST_ASSERT_LESS_THAN(800, elapsed_ms(&start));
+    for (i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE(cmds[i].pid > 0);
+        TEST_ASSERT_TRUE(exec_batch_succeeded(&cmds[i]));
+    }
+}
+
+/**
+ * The callback sees commands as they finish, not as they were listed
+ */
+void test_exec_batch_completion_order()
+{
+    struct exec_batch_cmd cmds[3] = {
+        { .argv = sleep_03 },
+        { .argv = sleep_01 },
+        { .argv = sleep_02 },
+    };
+    struct batch_order order = { .count = 0 };
+
+    TEST_ASSERT_EQUAL_INT(0, do_exec_batch(cmds, 3, 0, batch_record, &order));
+    TEST_ASSERT_EQUAL_INT(3, order.count);
+    TEST_ASSERT_EQUAL_INT(1, order.index[0]);
+    TEST_ASSERT_EQUAL_INT(2, order.index[1]);
+    TEST_ASSERT_EQUAL_INT(0, order.index[2]);
+
+    // With one slot they can only finish in the order they were started
+    order.count = 0;
+    TEST_ASSERT_EQUAL_INT(0, do_exec_batch(cmds, 3, 1, batch_record, &order));
+    TEST_ASSERT_EQUAL_INT(3, order.count);
+    TEST_ASSERT_EQUAL_INT(0, order.index[0]);
+    TEST_ASSERT_EQUAL_INT(1, order.index[1]);
+    TEST_ASSERT_EQUAL_INT(2, order.index[2]);
+}
+
+/**
+ * A command exiting nonzero is counted as failed with its status kept
+ */
+void test_exec_batch_nonzero_exit()
+{
+    struct exec_batch_cmd cmds[3] = {
+        { .argv = true_cmd },
+        { .argv = false_cmd },
+        { .argv = true_cmd },
+    };
+
+    TEST_ASSERT_EQUAL_INT(1, do_exec_batch(cmds, 3, 2, NULL, NULL));
+    TEST_ASSERT_TRUE(exec_batch_succeeded(&cmds[0]));
+    TEST_ASSERT_FALSE(exec_batch_succeeded(&cmds[1]));
+    TEST_ASSERT_TRUE(cmds[1].pid > 0);
+    TEST_ASSERT_TRUE(WIFEXITED(cmds[1].status));
+    TEST_ASSERT_EQUAL_INT(1, WEXITSTATUS(cmds[1].status));
+    TEST_ASSERT_TRUE(exec_batch_succeeded(&cmds[2]));
+}
+
+/**
+ * Commands which cannot be started are reported and the rest still run
+ */
+void test_exec_batch_spawn_failure()
+{
+    struct exec_batch_cmd cmds[3] = {
+        { .argv = missing_cmd },
+        { .argv = true_cmd },
+        { .argv = relative_cmd },
+    };
+    struct batch_order order = { .count = 0 };
+
+    TEST_ASSERT_EQUAL_INT(2, do_exec_batch(cmds, 3, 1, batch_record, &order));
+    TEST_ASSERT_EQUAL_INT(3, order.count);
+    TEST_ASSERT_EQUAL_INT(0, cmds[0].pid);
+    TEST_ASSERT_EQUAL_INT(-1, cmds[0].status);
+    TEST_ASSERT_FALSE(exec_batch_succeeded(&cmds[0]));
+    TEST_ASSERT_TRUE(exec_batch_succeeded(&cmds[1]));
+    TEST_ASSERT_EQUAL_INT(0, cmds[2].pid);
+    TEST_ASSERT_FALSE(exec_batch_succeeded(&cmds[2]));
+}
+
+/**
+ * Standard out of the command replaces the contents of the output file
+ */
+void test_exec_redirect()
+{
+    char buf[64];
+    FILE *f;
+    size_t n;
+
+    TEST_ASSERT_TRUE(do_exec_redirect(REDIRECT_FILE, 3, "/bin/echo", "home is", "$HOME"));
+    TEST_ASSERT_TRUE(do_exec_redirect(REDIRECT_FILE, 2, "/bin/echo", "again"));
+    f = fopen(REDIRECT_FILE, "r");
+    TEST_ASSERT_NOT_NULL(f);
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    TEST_ASSERT_EQUAL_STRING("again\n", buf);
+    unlink(REDIRECT_FILE);
+}
+
+/**
+ * A command fails the redirect if it cannot start, cannot open the file
+ * or exits nonzero
+ */
+void test_exec_redirect_failure()
+{
+    TEST_ASSERT_FALSE(do_exec_redirect(REDIRECT_FILE, 1, "/bin/false"));
+    TEST_ASSERT_FALSE(do_exec_redirect(REDIRECT_FILE, 1, "/nonexistent/command"));
+    TEST_ASSERT_FALSE(do_exec_redirect(REDIRECT_FILE, 2, "echo", "relative"));
+    TEST_ASSERT_FALSE(do_exec_redirect("/nonexistent/dir/out.txt", 2, "/bin/echo", "lost"));
+    unlink(REDIRECT_FILE);
+}
+
+// Output streamed to capture_record(), with the stream each piece came from
+struct capture_stream {
+    char out[64];
+    size_t out_len;
+    char err[64];
+    size_t err_len;
+};
+
+static void capture_record(int fd, const char *data, size_t len, void *arg)
+{
+    struct capture_stream *stream = arg;
+    char *buf = fd == STDOUT_FILENO ? stream->out : stream->err;
+    size_t *buf_len = fd == STDOUT_FILENO ? &stream->out_len : &stream->err_len;
+
+    if (*buf_len + len < sizeof(stream->out)) {
+        memcpy(buf + *buf_len, data, len);
+        *buf_len += len;
+        buf[*buf_len] = '\0';
+    }
+}
+
+/**
+ * With no buffer given, each stream is captured into one allocated for it
+ */
+void test_exec_capture_growable()
+{
+    struct exec_capture capture = { .status = 0 };
+
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, 3, "/bin/sh", "-c", "echo out; echo err >&2"));
+    TEST_ASSERT_EQUAL_STRING("out\n", capture.out.data);
+    TEST_ASSERT_EQUAL_INT(4, capture.out.size);
+    TEST_ASSERT_EQUAL_STRING("err\n", capture.err.data);
+    TEST_ASSERT_FALSE(capture.out.truncated);
+    TEST_ASSERT_TRUE(WIFEXITED(capture.status));
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(capture.status));
+    free(capture.out.data);
+    free(capture.err.data);
+
+    // Far more than the first allocation, and nothing on stderr
+    memset(&capture, 0, sizeof(capture));
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, 3, "/bin/sh", "-c", "seq 1 20000"));
+    TEST_ASSERT_NOT_NULL(capture.out.data);
+    TEST_ASSERT_EQUAL_INT(108894, capture.out.size);
+    TEST_ASSERT_EQUAL_STRING("20000\n", capture.out.data + capture.out.size - 6);
+    TEST_ASSERT_NULL(capture.err.data);
+    TEST_ASSERT_EQUAL_INT(0, capture.err.size);
+    free(capture.out.data);
+}
+
+/**
+ * A caller's buffer is filled up to its capacity, less the NUL
+ */
+void test_exec_capture_caller_buffer()
+{
+    char out[16];
+    char err[4];
+    struct exec_capture capture = {
+        .out = { .data = out, .capacity = sizeof(out) },
+        .err = { .data = err, .capacity = sizeof(err) },
+    };
+
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, 3, "/bin/sh", "-c", "echo hello; echo error >&2"));
+    TEST_ASSERT_EQUAL_PTR(out, capture.out.data);
+    TEST_ASSERT_EQUAL_STRING("hello\n", out);
+    TEST_ASSERT_FALSE(capture.out.truncated);
+    TEST_ASSERT_EQUAL_STRING("err", err);
+    TEST_ASSERT_EQUAL_INT(3, capture.err.size);
+    TEST_ASSERT_TRUE(capture.err.truncated);
+}
+
+/**
+ * Output past max_output is dropped without failing the command
+ */
+void test_exec_capture_max_output()
+{
+    struct exec_capture capture = { .max_output = 4 };
+
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, 3, "/bin/sh", "-c", "echo 0123456789; echo ab >&2"));
+    TEST_ASSERT_EQUAL_STRING("0123", capture.out.data);
+    TEST_ASSERT_TRUE(capture.out.truncated);
+    TEST_ASSERT_EQUAL_STRING("ab\n", capture.err.data);
+    TEST_ASSERT_FALSE(capture.err.truncated);
+    free(capture.out.data);
+    free(capture.err.data);
+
+    // The pipe keeps draining past the cap, so a command writing a lot still exits
+    memset(&capture, 0, sizeof(capture));
+    capture.max_output = 10;
+    capture.timeout_ms = 5000;
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, 3, "/bin/sh", "-c", "seq 1 100000"));
+    TEST_ASSERT_FALSE(capture.timed_out);
+    TEST_ASSERT_EQUAL_STRING("1\n2\n3\n4\n5\n", capture.out.data);
+    TEST_ASSERT_TRUE(capture.out.truncated);
+    free(capture.out.data);
+}
+
+/**
+ * With a callback, output streams to it instead of into buffers
+ */
+void test_exec_capture_callback()
+{
+    struct capture_stream stream = { .out_len = 0, .err_len = 0 };
+    struct exec_capture capture = { .callback = capture_record, .arg = &stream };
+
+    TEST_ASSERT_TRUE(do_exec_capture(&capture, 3, "/bin/sh", "-c", "echo one; echo two >&2; echo three"));
+    TEST_ASSERT_EQUAL_STRING("one\nthree\n", stream.out);
+    TEST_ASSERT_EQUAL_STRING("two\n", stream.err);
+    TEST_ASSERT_EQUAL_INT(10, capture.out.size);
+    TEST_ASSERT_EQUAL_INT(4, capture.err.size);
+    TEST_ASSERT_NULL(capture.out.data);
+    TEST_ASSERT_NULL(capture.err.data);
+}
+
+/**
+ * A command still running at the timeout is killed rather than waited for
+ */
+void test_exec_capture_timeout()
+{
+    struct exec_capture capture = { .timeout_ms = 200 };
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_FALSE(do_exec_capture(&capture, 2, "/bin/sleep", "10"));
+    TEST_ASSERT_LESS_THAN(5000, elapsed_ms(&start));
+    TEST_ASSERT_TRUE(capture.timed_out);
+    TEST_ASSERT_TRUE(WIFSIGNALED(capture.status));
+    TEST_ASSERT_EQUAL_INT(SIGKILL, WTERMSIG(capture.status));
+
+    // One that closes its output early is still held to the deadline
+    memset(&capture, 0, sizeof(capture));
+    capture.timeout_ms = 200;
+    TEST_ASSERT_FALSE(do_exec_capture(&capture, 3, "/bin/sh", "-c", "exec >&- 2>&-; sleep 10"));
+    TEST_ASSERT_TRUE(capture.timed_out);
+}
+
+/**
+ * A nonzero exit fails the call with the status and output still returned
+ */
+void test_exec_capture_nonzero_exit()
+{
+    struct exec_capture capture = { .timeout_ms = 5000 };
+
+    TEST_ASSERT_FALSE(do_exec_capture(&capture, 3, "/bin/sh", "-c", "echo partial; exit 3"));
+    TEST_ASSERT_FALSE(capture.timed_out);
+    TEST_ASSERT_TRUE(WIFEXITED(capture.status));
+    TEST_ASSERT_EQUAL_INT(3, WEXITSTATUS(capture.status));
+    TEST_ASSERT_EQUAL_STRING("partial\n", capture.out.data);
+    free(capture.out.data);
+
+    // A command which never ran has no status
+    memset(&capture, 0, sizeof(capture));
+    TEST_ASSERT_FALSE(do_exec_capture(&capture, 1, "/nonexistent/command"));
+    TEST_ASSERT_EQUAL_INT(-1, capture.status);
+}
@@ -0,0 +1,177 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/scan.h"
+
+// Parse a string literal as the newline terminated line it holds
+#define PARSE(line, x, y) parse_text_command((line), sizeof(line) - 1, (x), (y))
+
+/**
+ * Each command is recognised with its arguments
+ */
+void test_parse_text_command_commands()
+{
+    unsigned long long x = 0, y = 0;
+
+    TEST_ASSERT_EQUAL_INT(TEXT_SEEKTO, PARSE("AESDCHAR_IOCSEEKTO:3,17\n", &x, &y));
+    TEST_ASSERT_EQUAL_UINT64(3, x);
+    TEST_ASSERT_EQUAL_UINT64(17, y);
+    TEST_ASSERT_EQUAL_INT(TEXT_READ, PARSE("AESDCHAR_READ:100,0\n", &x, &y));
+    TEST_ASSERT_EQUAL_UINT64(100, x);
+    TEST_ASSERT_EQUAL_UINT64(0, y);
+    TEST_ASSERT_EQUAL_INT(TEXT_READPACKETS, PARSE("AESDCHAR_READPACKETS:0,9\n", &x, &y));
+    TEST_ASSERT_EQUAL_UINT64(0, x);
+    TEST_ASSERT_EQUAL_UINT64(9, y);
+    TEST_ASSERT_EQUAL_INT(TEXT_COMPRESS, PARSE("AESDCHAR_COMPRESS:deflate\n", &x, &y));
+    TEST_ASSERT_EQUAL_UINT64(1, x);
+    TEST_ASSERT_EQUAL_INT(TEXT_COMPRESS, PARSE("AESDCHAR_COMPRESS:none\n", &x, &y));
+    TEST_ASSERT_EQUAL_UINT64(0, x);
+    // Unknown methods still answer as a compress command, with it off
+    TEST_ASSERT_EQUAL_INT(TEXT_COMPRESS, PARSE("AESDCHAR_COMPRESS:lz4\n", &x, &y));
+    TEST_ASSERT_EQUAL_UINT64(0, x);
+    x = 1;
+    TEST_ASSERT_EQUAL_INT(TEXT_COMPRESS, PARSE("AESDCHAR_COMPRESS:\n", &x, &y));
+    TEST_ASSERT_EQUAL_UINT64(0, x);
+    TEST_ASSERT_EQUAL_INT(TEXT_SUBSCRIBE, PARSE("AESDCHAR_SUBSCRIBE\n", &x, &y));
+}
+
+/**
+ * Arguments are plain decimal digits: signs and spaces make the line a packet
+ */
+void test_parse_text_command_signs_and_spaces()
+{
+    unsigned long long x = 0, y = 0;
+
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_IOCSEEKTO:-1,2\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_IOCSEEKTO:+1,2\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_IOCSEEKTO:1,-2\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_IOCSEEKTO: 1,2\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_IOCSEEKTO:1, 2\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_IOCSEEKTO:1,2 \n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_READ:0x10,2\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_READ:1,\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_READ:,1\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_READ:1,2,3\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_SUBSCRIBE \n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE(" AESDCHAR_SUBSCRIBE\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("hello world\n", &x, &y));
+    // The newline is part of the command
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_READ:1,2", &x, &y));
+}
+
+/**
+ * Numbers too large for their argument make the line a packet
+ */
+void test_parse_text_command_overflow()
+{
+    unsigned long long x = 0, y = 0;
+
+    TEST_ASSERT_EQUAL_INT(TEXT_READ, PARSE("AESDCHAR_READ:18446744073709551615,1\n", &x, &y));
+    TEST_ASSERT_EQUAL_UINT64(18446744073709551615ULL, x);
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_READ:18446744073709551616,1\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_READ:1,99999999999999999999\n", &x, &y));
+    // Seeks and packet ranges are 32 bit
+    TEST_ASSERT_EQUAL_INT(TEXT_SEEKTO, PARSE("AESDCHAR_IOCSEEKTO:4294967295,0\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_IOCSEEKTO:4294967296,0\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_IOCSEEKTO:0,4294967296\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_READPACKETS, PARSE("AESDCHAR_READPACKETS:0,4294967295\n", &x, &y));
+    TEST_ASSERT_EQUAL_INT(TEXT_PACKET, PARSE("AESDCHAR_READPACKETS:4294967296,0\n", &x, &y));
+}
+
+#define SCAN_TEST_LEN 300
+
+/*
+ * Compare the scanner impl against the scalar one on buf, from every start
+ * offset in the first block and with the result cut short by max
+ */
+static void scan_check_agrees(enum scan_impl impl, const char *buf, size_t len)
+{
+    size_t expect[SCAN_TEST_LEN];
+    size_t got[SCAN_TEST_LEN];
+    static const size_t maxes[] = { 1, 2, 3, SCAN_TEST_LEN };
+    size_t start, m;
+
+    for (start = 0; start < 65 && start <= len; start++) {
+        for (m = 0; m < sizeof(maxes) / sizeof(maxes[0]); m++) {
+            size_t max = maxes[m];
+            TEST_ASSERT_EQUAL_INT(0, scan_select(SCAN_SCALAR));
+            size_t n = scan_newlines(buf + start, len - start, expect, max);
+            TEST_ASSERT_EQUAL_INT(0, scan_select(impl));
+            TEST_ASSERT_EQUAL_size_t(n, scan_newlines(buf + start, len - start, got, max));
+            TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expect, got, n * sizeof(size_t), scan_impl_name(impl));
+        }
+    }
+}
+
+/**
+ * The vector scanners find the same newlines as the scalar one with
+ * newlines on, either side of and far from the 64 byte block boundaries
+ */
+void test_scan_impls_agree_at_block_boundaries()
+{
+    static const size_t positions[] = { 0, 1, 62, 63, 64, 65, 126, 127, 128, 129, 191, 192, 255, 256, 299 };
+    const size_t npositions = sizeof(positions) / sizeof(positions[0]);
+    enum scan_impl impls[] = { SCAN_SSE2, SCAN_AVX2 };
+    char buf[SCAN_TEST_LEN];
+    size_t i, j, len;
+    int k;
+
+    for (k = 0; k < 2; k++) {
+        if (scan_select(impls[k]) == -1) {
+            continue;
+        }
+        // One newline at each position, and every pair of them
+        for (i = 0; i < npositions; i++) {
+            for (j = i; j < npositions; j++) {
+                memset(buf, 'x', sizeof(buf));
+                buf[positions[i]] = '\n';
+                buf[positions[j]] = '\n';
+                scan_check_agrees(impls[k], buf, sizeof(buf));
+            }
+        }
+        // No newline at all, and lengths ending on and around a block
+        memset(buf, 'x', sizeof(buf));
+        scan_check_agrees(impls[k], buf, sizeof(buf));
+        for (len = 60; len <= 200; len++) {
+            memset(buf, 'x', len);
+            buf[len - 1] = '\n';
+            buf[len / 2] = '\n';
+            scan_check_agrees(impls[k], buf, len);
+        }
+        // Dense newlines, several to a block
+        srand(45);
+        for (i = 0; i < sizeof(buf); i++) {
+            buf[i] = rand() % 8 == 0 ? '\n' : 'a';
+        }
+        scan_check_agrees(impls[k], buf, sizeof(buf));
+    }
+    scan_select(SCAN_SCALAR);
+}
+
+/**
+ * Lines spanning more than one batch of newlines are all handed out in order
+ */
+void test_scan_lines_across_batches()
+{
+    const size_t nlines = SCAN_BATCH * 2 + 10;
+    size_t len = nlines * 3;
+    char *buf = malloc(len + 1);
+    struct scan_lines lines;
+    size_t i;
+
+    TEST_ASSERT_NOT_NULL(buf);
+    for (i = 0; i < nlines; i++) {
+        memcpy(buf + i * 3, "ab\n", 3);
+    }
+    // A partial line at the end is left alone
+    buf[len] = 'c';
+    scan_lines_init(&lines, buf, len + 1);
+    for (i = 0; i < nlines; i++) {
+        TEST_ASSERT_EQUAL_size_t(i * 3 + 3, scan_lines_peek(&lines));
+        TEST_ASSERT_EQUAL_size_t(i * 3 + 3, scan_lines_next(&lines));
+    }
+    TEST_ASSERT_EQUAL_size_t(0, scan_lines_next(&lines));
+    free(buf);
+}
@@ -0,0 +1,339 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "../../server/log.h"
+#include "../../server/storage.h"
+
+static char test_dir[] = "/tmp/aesd-test-storage-XXXXXX";
+static char data_path[64];
+static struct storage_config config;
+
+void setUp()
+{
+    TEST_ASSERT_NOT_NULL(mkdtemp(strcpy(test_dir, "/tmp/aesd-test-storage-XXXXXX")));
+    snprintf(data_path, sizeof(data_path), "%s/data", test_dir);
+    config = (struct storage_config){ .data_path = data_path, .segment_size = DEFAULT_SEGMENT_SIZE };
+    log_set_sink("stderr");
+}
+
+void tearDown()
+{
+    char pattern[PATH_MAX];
+    glob_t found;
+
+    snprintf(pattern, sizeof(pattern), "%s/*", test_dir);
+    if (glob(pattern, 0, NULL, &found) == 0) {
+        for (size_t i = 0; i < found.gl_pathc; i++) {
+            unlink(found.gl_pathv[i]);
+        }
+        globfree(&found);
+    }
+    rmdir(test_dir);
+}
+
+// Leave a segment file as an earlier run would have, named data.<suffix>
+static void write_segment(const char *suffix, const char *contents)
+{
+    char path[PATH_MAX];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s.%s", data_path, suffix);
+    f = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL_MESSAGE(f, path);
+    fputs(contents, f);
+    fclose(f);
+}
+
+// Set a segment file's last write to seconds ago
+static void age_segment(const char *suffix, time_t seconds)
+{
+    char path[PATH_MAX];
+    struct timeval times[2];
+
+    snprintf(path, sizeof(path), "%s.%s", data_path, suffix);
+    gettimeofday(&times[0], NULL);
+    times[0].tv_sec -= seconds;
+    times[1] = times[0];
+    TEST_ASSERT_EQUAL_INT(0, utimes(path, times));
+}
+
+static bool segment_exists(const char *suffix)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s.%s", data_path, suffix);
+    return access(path, F_OK) == 0;
+}
+
+static size_t segment_count()
+{
+    char pattern[PATH_MAX];
+    glob_t found;
+    size_t count = 0;
+
+    snprintf(pattern, sizeof(pattern), "%s.*", data_path);
+    if (glob(pattern, 0, NULL, &found) == 0) {
+        count = found.gl_pathc;
+        globfree(&found);
+    }
+    return count;
+}
+
+// Everything still stored, NUL terminated in buf
+static void read_all(struct storage *st, char *buf, size_t len)
+{
+    struct storage_snapshot snap;
+    size_t total = 0;
+    ssize_t n;
+
+    TEST_ASSERT_EQUAL_INT(0, st->ops->snapshot(st, &snap));
+    while ((n = st->ops->snapshot_read(st, &snap, buf + total, len - 1 - total)) > 0) {
+        total += n;
+    }
+    st->ops->snapshot_release(st, &snap);
+    TEST_ASSERT_TRUE(n == 0);
+    buf[total] = '\0';
+}
+
+// Commands first through last of those still stored, NUL terminated in buf
+static void read_packets(struct storage *st, uint32_t first, uint32_t last, char *buf, size_t len)
+{
+    struct storage_snapshot snap;
+    size_t total = 0;
+    ssize_t n;
+
+    TEST_ASSERT_EQUAL_INT(0, storage_packet_snapshot(st, first, last, &snap));
+    while ((n = st->ops->snapshot_read(st, &snap, buf + total, len - 1 - total)) > 0) {
+        total += n;
+    }
+    st->ops->snapshot_release(st, &snap);
+    buf[total] = '\0';
+}
+
+/**
+ * Segments named <path>.<seq>.<base> are picked up in sequence order and
+ * appends carry on from the end of the newest
+ */
+void test_file_recover_named_segments()
+{
+    struct storage *st;
+    char buf[256];
+
+    write_segment("00000002.4", "c\n");
+    write_segment("00000001.0", "a\nb\n");
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_EQUAL_INT(6, st->ops->size(st));
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("a\nb\nc\n", buf);
+    read_packets(st, 1, 2, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("b\nc\n", buf);
+
+    TEST_ASSERT_EQUAL_INT(0, st->ops->append(st, "d\n", 2));
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("a\nb\nc\nd\n", buf);
+    st->keep = 1;
+    storage_close(st);
+    TEST_ASSERT_EQUAL_size_t(2, segment_count());
+
+    // A log whose start was dropped keeps its offsets, and new segments are named by them
+    config.segment_size = 4;
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("a\nb\nc\nd\n", buf);
+    TEST_ASSERT_EQUAL_INT(0, st->ops->append(st, "e\n", 2));
+    TEST_ASSERT_TRUE(segment_exists("00000003.8"));
+    read_packets(st, 4, 4, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("e\n", buf);
+
+    // Without keep, close removes the log
+    storage_close(st);
+    TEST_ASSERT_EQUAL_size_t(0, segment_count());
+}
+
+/**
+ * A log recovered from past a dropped start serves what it has from there
+ */
+void test_file_recover_nonzero_base()
+{
+    struct storage *st;
+    char buf[256];
+
+    write_segment("00000007.100", "x\ny\n");
+    config.segment_size = 2;
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_EQUAL_INT(4, st->ops->size(st));
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("x\ny\n", buf);
+    TEST_ASSERT_EQUAL_INT(0, st->ops->append(st, "z\n", 2));
+    TEST_ASSERT_TRUE(segment_exists("00000008.104"));
+    read_packets(st, 2, 2, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("z\n", buf);
+    storage_close(st);
+}
+
+/**
+ * Segments named without their offset, as older runs left them, are
+ * renamed to carry it
+ */
+void test_file_recover_old_style_names()
+{
+    struct storage *st;
+    char buf[256];
+
+    write_segment("00000001", "one\n");
+    write_segment("00000002", "two\n");
+    write_segment("00000003", "thr");
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_TRUE(segment_exists("00000001.0"));
+    TEST_ASSERT_TRUE(segment_exists("00000002.4"));
+    TEST_ASSERT_TRUE(segment_exists("00000003.8"));
+    TEST_ASSERT_FALSE(segment_exists("00000001"));
+    TEST_ASSERT_FALSE(segment_exists("00000002"));
+    TEST_ASSERT_FALSE(segment_exists("00000003"));
+    TEST_ASSERT_EQUAL_size_t(3, segment_count());
+
+    // The unterminated command at the end is completed by the next append
+    TEST_ASSERT_EQUAL_INT(0, st->ops->append(st, "ee\n", 3));
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("one\ntwo\nthree\n", buf);
+    read_packets(st, 2, 2, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("three\n", buf);
+    storage_close(st);
+
+    // A name with the wrong offset is renumbered to follow the segment before it
+    write_segment("00000001.0", "one\n");
+    write_segment("00000002.2", "two\n");
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_TRUE(segment_exists("00000002.4"));
+    TEST_ASSERT_FALSE(segment_exists("00000002.2"));
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("one\ntwo\n", buf);
+    storage_close(st);
+}
+
+/**
+ * Segments before a gap in the offsets were being dropped by retention
+ * when the last run ended, so only those after it are kept
+ */
+void test_file_recover_drops_segments_before_gap()
+{
+    struct storage *st;
+    char buf[256];
+
+    write_segment("00000001.0", "a\n");
+    write_segment("00000002.2", "b\n");
+    write_segment("00000004.50", "late\n");
+    write_segment("00000005.55", "later\n");
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_FALSE(segment_exists("00000001.0"));
+    TEST_ASSERT_FALSE(segment_exists("00000002.2"));
+    TEST_ASSERT_TRUE(segment_exists("00000004.50"));
+    TEST_ASSERT_TRUE(segment_exists("00000005.55"));
+    TEST_ASSERT_EQUAL_INT(11, st->ops->size(st));
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("late\nlater\n", buf);
+    read_packets(st, 0, 0, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("late\n", buf);
+    storage_close(st);
+}
+
+/**
+ * The oldest segments go once the log holds more than the byte limit
+ */
+void test_file_retain_bytes()
+{
+    struct storage *st;
+    char buf[256];
+
+    write_segment("00000001.0", "aa\n");
+    write_segment("00000002.3", "bb\n");
+    write_segment("00000003.6", "cc\n");
+    config.retain_bytes = 4;
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_EQUAL_size_t(1, segment_count());
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("cc\n", buf);
+
+    // The segment being appended to stays however large it gets
+    TEST_ASSERT_EQUAL_INT(0, st->ops->append(st, "dddd\n", 5));
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("cc\ndddd\n", buf);
+
+    // Appends past the limit drop old segments as new ones start
+    config.segment_size = 3;
+    TEST_ASSERT_EQUAL_INT(0, st->ops->append(st, "e\n", 2));
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("e\n", buf);
+    TEST_ASSERT_TRUE(segment_exists("00000004.14"));
+    TEST_ASSERT_EQUAL_size_t(1, segment_count());
+    storage_close(st);
+}
+
+/**
+ * The oldest segments go once the log holds more than the packet limit
+ */
+void test_file_retain_packets()
+{
+    struct storage *st;
+    char buf[256];
+
+    write_segment("00000001.0", "a\nb\n");
+    write_segment("00000002.4", "c\n");
+    write_segment("00000003.6", "d\ne\n");
+    config.retain_packets = 3;
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_EQUAL_size_t(2, segment_count());
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("c\nd\ne\n", buf);
+    // Commands are numbered from the first one still stored
+    read_packets(st, 0, 0, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("c\n", buf);
+    storage_close(st);
+}
+
+/**
+ * Segments last written longer ago than the age limit go, except the one
+ * being appended to
+ */
+void test_file_retain_age()
+{
+    struct storage *st;
+    char buf[256];
+
+    write_segment("00000001.0", "old\n");
+    write_segment("00000002.4", "older\n");
+    write_segment("00000003.10", "new\n");
+    age_segment("00000001.0", 7200);
+    age_segment("00000002.4", 3600);
+    config.retain_age = 60;
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_EQUAL_size_t(1, segment_count());
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("new\n", buf);
+    st->keep = 1;
+    storage_close(st);
+
+    age_segment("00000003.10", 7200);
+    st = storage_open("file", &config);
+    TEST_ASSERT_NOT_NULL(st);
+    TEST_ASSERT_TRUE(segment_exists("00000003.10"));
+    read_all(st, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING("new\n", buf);
+    storage_close(st);
+}